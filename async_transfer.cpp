@@ -0,0 +1,408 @@
+#include "async_transfer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+////////////////////////////////////////////////////////////////////////
+/////////////////////////////// ENGINE /////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+progress_engine::progress_engine(std::function<bool()> step, std::function<void(std::exception_ptr)> fail) :
+    step(step), fail(fail)
+{
+    thread = std::thread(&progress_engine::run, this);
+}
+
+progress_engine::~progress_engine()
+{
+    stop();
+}
+
+void progress_engine::submit(std::function<void()> fn)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(fn);
+    }
+    wake.notify_one();
+}
+
+void progress_engine::drain()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    idle_cond.wait(guard, [this] { return idle && queue.empty(); });
+}
+
+void progress_engine::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    if (thread.joinable())
+        thread.join();
+}
+
+bool progress_engine::call(const std::function<bool()>& fn)
+{
+    try {
+        return fn();
+    } catch (...) {
+        fail(std::current_exception());
+        return false;
+    }
+}
+
+void progress_engine::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        while (!queue.empty()) {
+            std::function<void()> fn = queue.front();
+            queue.pop_front();
+            guard.unlock();
+            call([&fn] { fn(); return false; });
+            guard.lock();
+        }
+        if (stopping)
+            break;
+
+        guard.unlock();
+        bool busy = call(step);
+        guard.lock();
+        if (!busy && queue.empty()) {
+            idle = true;
+            idle_cond.notify_all();
+            wake.wait(guard, [this] { return stopping || !queue.empty(); });
+            idle = false;
+        }
+    }
+    idle = true;
+    idle_cond.notify_all();
+}
+
+////////////////////////////////////////////////////////////////////////
+/////////////////////////////// CLIENT /////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+rdma_async_client::rdma_async_client(uint16_t tcp_port, const transfer_config& config) :
+    rdma_client_context(tcp_port, config),
+    engine([this] { return step(); }, [this](std::exception_ptr error) { fail(error); })
+{
+}
+
+rdma_async_client::~rdma_async_client()
+{
+    engine.drain();
+    engine.stop();
+}
+
+std::future<int> rdma_async_client::submit_send(const char *filename)
+{
+    std::unique_ptr<outgoing> o(new outgoing);
+    o->path = filename;
+    return submit(std::move(o));
+}
+
+std::future<int> rdma_async_client::submit_send(const void *buffer, uint64_t length)
+{
+    std::unique_ptr<outgoing> o(new outgoing);
+    o->buffer = (const char *)buffer;
+    o->length = length;
+    return submit(std::move(o));
+}
+
+std::future<void> rdma_async_client::submit_invalidate(const void *buffer, uint64_t length)
+{
+    /* the MR cache is the engine's: only its thread may deregister */
+    auto done = std::make_shared<std::promise<void>>();
+    std::future<void> result = done->get_future();
+    engine.submit([this, buffer, length, done] {
+        device->mem_pool->invalidate((void *)buffer, std::max<uint64_t>(length, 1));
+        done->set_value();
+    });
+    return result;
+}
+
+std::future<int> rdma_async_client::submit(std::unique_ptr<outgoing> o)
+{
+    std::future<int> result = o->done.get_future();
+    /* std::function wants something copyable; the closure always runs */
+    outgoing *raw = o.release();
+    engine.submit([this, raw] {
+        std::unique_ptr<outgoing> o(raw);
+        if (broken) {
+            finish(std::move(o), broken);
+            return;
+        }
+        o->request_id = take_request_id();
+        backlog.push_back(std::move(o));
+    });
+    return result;
+}
+
+void rdma_async_client::start(outgoing *o)
+{
+    const char *data = o->buffer;
+    struct ibv_mr *mr = nullptr;
+    auto refuse = [this, o](const std::string& error) {
+        auto it = in_flight.find(o->request_id);
+        std::unique_ptr<outgoing> owned = std::move(it->second);
+        in_flight.erase(it);
+        finish(std::move(owned), std::make_exception_ptr(transfer_failed(error)));
+    };
+
+    if (!o->path.empty()) {
+        /* a copy, as send_file() makes by default */
+        int fd = open(o->path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st)) {
+            std::string error = o->path + ": " + strerror(errno);
+            if (fd >= 0)
+                close(fd);
+            refuse(error);
+            return;
+        }
+        o->length = st.st_size;
+        o->file_buf = device->mem_pool->get(std::max<uint64_t>(o->length, 1));
+        for (uint64_t done = 0; done < o->length; ) {
+            ssize_t n = pread(fd, o->file_buf.addr + done, o->length - done, done);
+            if (n <= 0) {
+                std::string error = o->path + ": " + (n ? strerror(errno) : "file shrank while reading");
+                close(fd);
+                refuse(error);
+                return;
+            }
+            done += n;
+        }
+        close(fd);
+    } else if (!o->length) {
+        /* nothing to register, but the request carries an rkey anyway */
+        o->file_buf = device->mem_pool->get(1);
+    } else {
+        mr = device->mem_pool->lookup((void *)o->buffer, o->length);
+    }
+    if (o->file_buf.addr) {
+        data = o->file_buf.addr;
+        mr = o->file_buf.mr;
+    }
+
+    uint32_t block = config.verify && o->length ? CRC_BLOCK_SIZE : 0;
+    file_request req = {};
+    req.request_id = o->request_id;
+    req.type = REQ_FILE;
+    req.rkey = mr->rkey;
+    req.length = o->length;
+    req.addr = (uint64_t)data;
+    req.flags = block ? FILE_REQUEST_CRC : 0;
+    req.crc_block = block;
+    send_message(req);
+
+    /* the server is reading already; the table goes out before the next
+     * request, which is where the server looks for it */
+    if (block) {
+        o->crc_table = device->mem_pool->get((o->length + block - 1) / block * sizeof(uint32_t));
+        crc_table = o->crc_table;
+        crc_block = block;
+        checksum_blocks(data, o->length, 0, o->length);
+        send_checksums(o->request_id, o->length);
+        crc_table = registered_buffer();
+    }
+}
+
+void rdma_async_client::finish(std::unique_ptr<outgoing> o, std::exception_ptr error)
+{
+    device->mem_pool->put(o->file_buf);
+    device->mem_pool->put(o->crc_table);
+    if (error)
+        o->done.set_exception(error);
+    else
+        o->done.set_value(o->request_id);
+}
+
+bool rdma_async_client::step()
+{
+    while (!backlog.empty() && (int)in_flight.size() < config.max_requests) {
+        /* in flight before anything can fail, so fail() finds it */
+        outgoing *o = backlog.front().get();
+        in_flight[o->request_id] = std::move(backlog.front());
+        backlog.pop_front();
+        start(o);
+    }
+
+    file_request ack;
+    while (try_recv_message(&ack)) {
+        auto it = in_flight.find(ack.request_id);
+        if (ack.type != REQ_ACK || it == in_flight.end()) {
+            fprintf(stderr, "unexpected message %u for request %d\n", ack.type, ack.request_id);
+            continue;
+        }
+        std::unique_ptr<outgoing> o = std::move(it->second);
+        in_flight.erase(it);
+        std::exception_ptr error;
+        if (ack.flags & FILE_ACK_CORRUPT)
+            error = std::make_exception_ptr(transfer_failed("request " + std::to_string(ack.request_id) +
+                                                            ": the server received corrupted data"));
+        finish(std::move(o), error);
+    }
+    return !in_flight.empty() || !backlog.empty();
+}
+
+void rdma_async_client::fail(std::exception_ptr error)
+{
+    broken = error;
+    for (auto& entry : in_flight)
+        finish(std::move(entry.second), error);
+    in_flight.clear();
+    while (!backlog.empty()) {
+        finish(std::move(backlog.front()), error);
+        backlog.pop_front();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+/////////////////////////////// SERVER /////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+rdma_async_server::rdma_async_server(uint16_t tcp_port, const transfer_config& config) :
+    rdma_server_context(tcp_port, config),
+    engine([this] { return step(); }, [this](std::exception_ptr error) { fail(error); })
+{
+}
+
+rdma_async_server::~rdma_async_server()
+{
+    engine.stop();
+    if (current) {
+        /* stop the reads into the caller's buffer before giving it back */
+        struct ibv_qp_attr attr = {};
+        attr.qp_state = IBV_QPS_ERR;
+        for (struct ibv_qp *q : qps)
+            ibv_modify_qp(q, &attr, IBV_QP_STATE);
+        file = nullptr;
+        mr_file = nullptr;
+    }
+    fail(std::make_exception_ptr(rdma_error("server shut down")));
+}
+
+std::future<received_file> rdma_async_server::submit_receive(void *buffer, uint64_t capacity)
+{
+    incoming *raw = new incoming;
+    raw->buffer = (char *)buffer;
+    raw->capacity = capacity;
+    std::future<received_file> result = raw->done.get_future();
+    engine.submit([this, raw] {
+        std::unique_ptr<incoming> in(raw);
+        if (broken)
+            in->done.set_exception(broken);
+        else
+            wanted.push_back(std::move(in));
+    });
+    return result;
+}
+
+std::future<void> rdma_async_server::submit_invalidate(void *buffer, uint64_t capacity)
+{
+    auto done = std::make_shared<std::promise<void>>();
+    std::future<void> result = done->get_future();
+    engine.submit([this, buffer, capacity, done] {
+        device->mem_pool->invalidate(buffer, std::max<uint64_t>(capacity, 1));
+        done->set_value();
+    });
+    return result;
+}
+
+void rdma_async_server::begin(const file_request& req)
+{
+    current = std::move(wanted.front());
+    wanted.pop_front();
+
+    const char *problem = nullptr;
+    if (req.type != REQ_FILE || (req.flags & ~FILE_REQUEST_CRC))
+        problem = "not a plain file transfer";
+    else if (req.length > current->capacity)
+        problem = "larger than the receive buffer";
+    if (problem) {
+        /* refused: the client's send fails too */
+        file_request ack = req;
+        ack.type = REQ_ACK;
+        ack.flags |= FILE_ACK_CORRUPT;
+        send_message(ack);
+        current->done.set_exception(std::make_exception_ptr(
+            transfer_failed("request " + std::to_string(req.request_id) + " of " + std::to_string(req.length) +
+                            " bytes: " + problem)));
+        current.reset();
+        return;
+    }
+
+    file = current->buffer;
+    mr_file = device->mem_pool->lookup(current->buffer, std::max<uint64_t>(current->capacity, 1));
+    file_length = req.length;
+    start_receive(req);
+}
+
+void rdma_async_server::complete()
+{
+    finish_receive();
+    file_request ack = cur_req;
+    ack.type = REQ_ACK;
+    if (corrupt)
+        ack.flags |= FILE_ACK_CORRUPT;
+    send_message(ack);
+
+    if (corrupt)
+        current->done.set_exception(std::make_exception_ptr(
+            transfer_failed("request " + std::to_string(cur_req.request_id) + ": received corrupted data")));
+    else
+        current->done.set_value({ cur_req.request_id, cur_req.length });
+    current.reset();
+    /* the buffer was the caller's */
+    file = nullptr;
+    mr_file = nullptr;
+    file_length = 0;
+}
+
+bool rdma_async_server::step()
+{
+    if (!current) {
+        if (wanted.empty())
+            return false;
+        file_request req;
+        if (!try_recv_message(&req))
+            return true;
+        if (req.request_id == -1) {
+            fail(std::make_exception_ptr(rdma_error("the client ended the session")));
+            return false;
+        }
+        begin(req);
+        return true;
+    }
+
+    struct ibv_wc wc[MAX_OUTSTANDING_READS];
+    int n = poll_cq(wc, MAX_OUTSTANDING_READS);
+    for (int i = 0; i < n; i++)
+        handle_data_completion(wc[i]);
+    take_transfer_messages();
+    post_reads();
+    verify_chunks();
+    if (receive_done())
+        complete();
+    return current || !wanted.empty();
+}
+
+void rdma_async_server::fail(std::exception_ptr error)
+{
+    broken = error;
+    if (current) {
+        current->done.set_exception(error);
+        current.reset();
+    }
+    while (!wanted.empty()) {
+        wanted.front()->done.set_exception(error);
+        wanted.pop_front();
+    }
+}
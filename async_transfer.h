@@ -0,0 +1,154 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "rdma_context.h"
+
+/* A future's transfer failed on its own (refused, unreadable, corrupted);
+ * the connection carries on. Any other rdma_error from a future means the
+ * connection is gone, and every transfer still waiting fails with it */
+class transfer_failed : public rdma_error
+{
+public:
+    using rdma_error::rdma_error;
+};
+
+/* The thread behind an asynchronous context. Contexts are not thread safe,
+ * so the engine owns one: every verbs call, buffer and completion of the
+ * connection is touched from its thread only, and submissions reach it as
+ * closures. It calls step() for as long as step() reports work outstanding
+ * (busy-polling, like the blocking data path) and sleeps until the next
+ * submission otherwise. An exception thrown by a closure or by step() is
+ * handed to fail(), and the engine carries on */
+class progress_engine
+{
+public:
+    progress_engine(std::function<bool()> step, std::function<void(std::exception_ptr)> fail);
+    ~progress_engine();
+
+    /* Run fn on the engine thread */
+    void submit(std::function<void()> fn);
+    /* Return once everything submitted has run and step() has nothing left */
+    void drain();
+    /* Run what is already submitted, then end the thread */
+    void stop();
+
+private:
+    std::function<bool()> step;
+    std::function<void(std::exception_ptr)> fail;
+
+    std::mutex lock;
+    std::condition_variable wake; /* a submission, or stop() */
+    std::condition_variable idle_cond;
+    std::deque<std::function<void()>> queue;
+    bool idle = false;
+    bool stopping = false;
+    std::thread thread;
+
+    void run();
+    bool call(const std::function<bool()>& fn);
+};
+
+/* Client side of asynchronous transfers: any number of sends outstanding on
+ * one connection, each completing its future when the server acks it.
+ * Requests go out back to back (up to config.max_requests of them in
+ * flight) and the server reads them in order, so any server mode serves
+ * them. These are plain pull transfers, checked with CRC32C when
+ * config.verify is set; push, streaming and delta stay with send_file().
+ * The client context is a private base: only the engine thread may use it */
+class rdma_async_client : private rdma_client_context
+{
+public:
+    explicit rdma_async_client(uint16_t tcp_port, const transfer_config& config = transfer_config());
+    /* Waits for the outstanding sends, then ends the session */
+    ~rdma_async_client();
+
+    /* Send a file, or a caller-owned buffer that must stay unchanged until
+     * the future is ready. The future yields the request id the transfer
+     * went under, or throws transfer_failed or rdma_error. A buffer's
+     * registration is cached by address range, as with send_buffer() */
+    std::future<int> submit_send(const char *filename);
+    std::future<int> submit_send(const void *buffer, uint64_t length);
+    /* Drop the cached registration of a buffer whose sends are all done;
+     * the memory may be freed or reused once the future is ready */
+    std::future<void> submit_invalidate(const void *buffer, uint64_t length);
+
+private:
+    struct outgoing {
+        int request_id = -1;
+        std::string path;             /* empty for a caller buffer */
+        const char *buffer = nullptr;
+        uint64_t length = 0;
+        registered_buffer file_buf;   /* the file, read in */
+        registered_buffer crc_table;
+        std::promise<int> done;
+    };
+    std::deque<std::unique_ptr<outgoing>> backlog;                /* submitted, not started */
+    std::unordered_map<int, std::unique_ptr<outgoing>> in_flight; /* requested, waiting for the ack */
+    std::exception_ptr broken; /* the connection failed: so does every send from now on */
+
+    progress_engine engine; /* last: started once the rest is set up, stopped first */
+
+    std::future<int> submit(std::unique_ptr<outgoing> o);
+    /* Request o, already in in_flight */
+    void start(outgoing *o);
+    void finish(std::unique_ptr<outgoing> o, std::exception_ptr error);
+    bool step();
+    void fail(std::exception_ptr error);
+};
+
+/* A file received by rdma_async_server, in the buffer it was submitted with */
+struct received_file
+{
+    int request_id;
+    uint64_t length;
+};
+
+/* Server side of asynchronous transfers: each submit_receive() takes the
+ * next file the client sends, RDMA-read straight into the caller's buffer.
+ * Receives are served in submission order, one transfer at a time, while
+ * the application does something else. As with rdma_async_client, the
+ * context is a private base */
+class rdma_async_server : private rdma_server_context
+{
+public:
+    explicit rdma_async_server(uint16_t tcp_port, const transfer_config& config = transfer_config());
+    /* Receives still waiting fail */
+    ~rdma_async_server();
+
+    /* buffer (capacity bytes) belongs to the transfer until the future is
+     * ready. It throws transfer_failed if the file is larger, arrives
+     * corrupted or is not a plain file transfer, and rdma_error if the
+     * client ends the session first. Its registration is cached by address
+     * range, so receives into the same buffer skip ibv_reg_mr */
+    std::future<received_file> submit_receive(void *buffer, uint64_t capacity);
+    /* Drop the cached registration of a buffer whose receives are all done;
+     * the memory may be freed or reused once the future is ready */
+    std::future<void> submit_invalidate(void *buffer, uint64_t capacity);
+
+private:
+    struct incoming {
+        char *buffer;
+        uint64_t capacity;
+        std::promise<received_file> done;
+    };
+    std::deque<std::unique_ptr<incoming>> wanted; /* submitted, oldest first */
+    std::unique_ptr<incoming> current;            /* the transfer being read */
+    std::exception_ptr broken; /* connection failed or session over */
+
+    progress_engine engine;
+
+    void begin(const file_request& req);
+    void complete();
+    bool step();
+    void fail(std::exception_ptr error);
+};
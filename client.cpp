@@ -12,35 +12,189 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 
+#include <limits.h>
+
+#include <atomic>
 #include <memory>
 #include <random>
+#include <string>
+#include <vector>
 #include "rdma_context.h"
+#include "async_transfer.h"
+#include "tcp_transfer.h"
+#include "worker_pool.h"
 
-#define MAX_FILENAME_SIZE 20
-
-void parse_arguments(int argc, char **argv, uint16_t *tcp_port, char* filename)
+void parse_arguments(int argc, char **argv, uint16_t *tcp_port, const char **filename, transfer_config *config)
 {
     if (argc < 3) {
-        printf("usage: %s <tcp_port> <file_name>\n", argv[0]);
+        printf("usage: %s <tcp_port> <file_name|dir|-> [num_qps] [copy|mmap|stream|compress|delta|get|async] [pull|push]\n", argv[0]);
         exit(1);
     }
     *tcp_port = atoi(argv[1]);
-    strcpy(filename, argv[2]);
+    *filename = argv[2];
+    if (argc > 3)
+        config->num_qps = atoi(argv[3]);
+    /* mmap: register the page cache of the file instead of reading it into a buffer */
+    /* stream: stage the file through a bounded ring, for files larger than memory */
+    /* compress: stream, deflating segments on worker threads while that pays off */
+    /* delta: copy, sending only what the server's previous version (the file of the same name in its output dir) lacks */
+    /* get: file_name is the object id a multi server acked an upload with; read it from its object cache */
+    /* async: copy, with every file submitted at once on one connection, each completing on its own */
+    if (argc > 4) {
+        config->zero_copy = !strcmp(argv[4], "mmap");
+        config->delta = !strcmp(argv[4], "delta");
+        config->compress = !strcmp(argv[4], "compress");
+        config->streaming = !strcmp(argv[4], "stream") || config->compress;
+    }
+    /* push: write the file into the server's buffer instead of having it read */
+    if (argc > 5)
+        config->push = !strcmp(argv[5], "push");
+}
+
+/* A multi server with an object cache gives every file an id to GET it by */
+static void print_object_id(file_sender& client, const char *filename)
+{
+    rdma_client_context *rdma = dynamic_cast<rdma_client_context *>(&client);
+    if (rdma && rdma->object_id)
+        printf("%s: cached as object %" PRIu64 "\n", filename, rdma->object_id);
 }
 
+/* One file, or a list of them on stdin, one per line, in one session */
+void send_files(file_sender& client, const char *filename)
+{
+    if (strcmp(filename, "-")) {
+        if (client.send_file(1, filename))
+            print_object_id(client, filename);
+        return;
+    }
+    char path[PATH_MAX];
+    while (fgets(path, sizeof(path), stdin)) {
+        path[strcspn(path, "\n")] = '\0';
+        if (!*path)
+            continue;
+        int id = client.send_file(path);
+        if (id < 0) {
+            fprintf(stderr, "%s: not sent\n", path);
+            continue;
+        }
+        printf("%s: sent as request %d\n", path, id);
+        print_object_id(client, path);
+    }
+}
+
+/* filename, or the list on stdin for "-" */
+static std::vector<std::string> read_paths(const char *filename)
+{
+    std::vector<std::string> paths;
+    if (strcmp(filename, "-")) {
+        paths.push_back(filename);
+        return paths;
+    }
+    char path[PATH_MAX];
+    while (fgets(path, sizeof(path), stdin)) {
+        path[strcspn(path, "\n")] = '\0';
+        if (*path)
+            paths.push_back(path);
+    }
+    return paths;
+}
 
-int main(int argc, char *argv[]) {
+int main(int argc, char *argv[]) try {
     uint16_t tcp_port;
-    char* filename = (char*) malloc(MAX_FILENAME_SIZE*sizeof(char));
+    const char *filename;
 
-    parse_arguments(argc, argv, &tcp_port, filename);
+    transfer_config config;
+    load_config_env(&config);
+    parse_arguments(argc, argv, &tcp_port, &filename, &config);
     if (!tcp_port) {
         printf("usage: %s <tcp port>\n", argv[0]);
         exit(1);
     }
 
-    auto client = std::make_unique<rdma_client_context>(tcp_port);
-    bool file_sent = client->send_file(1, filename);
+    if (tcp_transfers(config)) {
+        /* plain files over parallel TCP streams; the modes need verbs */
+        auto client = std::make_unique<tcp_client_context>(tcp_port, config);
+        send_files(*client, filename);
+        client.reset();
+        metrics_report();
+        return 0;
+    }
+
+    if (!strcmp(filename, "-") && config.num_workers != 1) {
+        /* RDMA_WORKERS: a session per pinned worker, each taking the next
+         * file off the shared list. The server must be multi or srq */
+        std::vector<std::string> paths = read_paths(filename);
+
+        std::atomic<size_t> next(0);
+        worker_pool workers(config.device_name, config.num_workers);
+        workers.run([&](int worker) {
+            rdma_client_context client(tcp_port, config);
+            for (size_t i; (i = next++) < paths.size(); ) {
+                int id = client.send_file(paths[i].c_str());
+                if (id < 0)
+                    fprintf(stderr, "%s: not sent\n", paths[i].c_str());
+                else
+                    printf("%s: sent as request %d by worker %d\n", paths[i].c_str(), id, worker);
+            }
+        });
+        metrics_report();
+        return 0;
+    }
+
+    /* everything below runs on this thread; keep it and its buffers near the NIC */
+    run_near_nic(config.device_name);
+
+    if (argc > 4 && !strcmp(argv[4], "async")) {
+        /* a file that can't be read, or that the server refuses (an async
+         * server takes files up to its buffer size), fails its own future */
+        std::vector<std::string> paths = read_paths(filename);
+        auto client = std::make_unique<rdma_async_client>(tcp_port, config);
+        std::vector<std::future<int>> sends;
+        for (const std::string& path : paths)
+            sends.push_back(client->submit_send(path.c_str()));
+        for (size_t i = 0; i < sends.size(); i++) {
+            try {
+                printf("%s: sent as request %d\n", paths[i].c_str(), sends[i].get());
+            } catch (const transfer_failed& e) {
+                fprintf(stderr, "%s: not sent: %s\n", paths[i].c_str(), e.what());
+            }
+        }
+        client.reset();
+        metrics_report();
+        return 0;
+    }
+
+    auto client = std::make_unique<rdma_client_context>(tcp_port, config);
+    struct stat st;
+    if (argc > 4 && !strcmp(argv[4], "get")) {
+        registered_buffer buf;
+        uint64_t length;
+        uint64_t id = strtoull(filename, NULL, 0);
+        if (client->get_object(id, &buf, &length)) {
+            std::string out = "object_" + std::to_string(id);
+            int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0 || write(fd, buf.addr, length) != (ssize_t)length)
+                perror(out.c_str());
+            else
+                printf("object %" PRIu64 ": %" PRIu64 " bytes written to %s\n", id, length, out.c_str());
+            if (fd >= 0)
+                close(fd);
+            client->put_object(buf);
+        } else {
+            printf("object %" PRIu64 ": not cached\n", id);
+        }
+    } else if (strcmp(filename, "-") && !stat(filename, &st) && S_ISDIR(st.st_mode)) {
+        /* a directory: its small files go packed in batches */
+        int sent = client->send_directory(filename);
+        printf("%s: %d files sent\n", filename, sent);
+    } else {
+        send_files(*client, filename);
+    }
 
+    client.reset();
+    metrics_report();
     return 0;
+} catch (const rdma_error& e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
 }
@@ -0,0 +1,232 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define POLY 0x82f63b78 /* CRC-32C, reflected */
+
+/* The hardware kernel runs three independent CRCs over adjacent blocks of
+ * LONG (then SHORT) bytes, since the instruction has a latency of about
+ * three cycles but a throughput of one per cycle. The partial CRCs are then
+ * merged by shifting one over the length of the next, with tables of the
+ * "append that many zero bytes" operator */
+#define LONG 8192
+#define SHORT 256
+
+struct crc32c_tables
+{
+    uint32_t sw[8][256];      /* slicing-by-8 */
+    uint32_t long_op[4][256]; /* append LONG zero bytes, one table per byte of the crc */
+    uint32_t short_op[4][256];
+
+    crc32c_tables();
+};
+
+/* multiply a GF(2) 32x32 matrix by a vector */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* operator appending len zero bytes to a crc; len is a power of two */
+static void zeros_op(uint32_t *even, size_t len)
+{
+    uint32_t odd[32];
+
+    /* one zero bit */
+    odd[0] = POLY;
+    for (int n = 1; n < 32; n++)
+        odd[n] = 1U << (n - 1);
+
+    /* two, then four zero bits */
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+
+    /* each square doubles it, starting from one zero byte */
+    do {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (!len)
+            return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    } while (len);
+    memcpy(even, odd, sizeof(odd));
+}
+
+static void zeros_tables(uint32_t tables[4][256], size_t len)
+{
+    uint32_t op[32];
+    zeros_op(op, len);
+    for (uint32_t n = 0; n < 256; n++)
+        for (int b = 0; b < 4; b++)
+            tables[b][n] = gf2_matrix_times(op, n << (8 * b));
+}
+
+crc32c_tables::crc32c_tables()
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        sw[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int k = 1; k < 8; k++)
+            sw[k][n] = (sw[k - 1][n] >> 8) ^ sw[0][sw[k - 1][n] & 0xff];
+
+    zeros_tables(long_op, LONG);
+    zeros_tables(short_op, SHORT);
+}
+
+static const crc32c_tables& tables()
+{
+    static const crc32c_tables t;
+    return t;
+}
+
+static inline uint32_t shift(const uint32_t op[4][256], uint32_t crc)
+{
+    return op[0][crc & 0xff] ^ op[1][(crc >> 8) & 0xff] ^ op[2][(crc >> 16) & 0xff] ^ op[3][crc >> 24];
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    const crc32c_tables& t = tables();
+    const unsigned char *next = (const unsigned char *)buf;
+    uint64_t c = ~crc;
+
+    while (len && ((uintptr_t)next & 7)) {
+        c = t.sw[0][(c ^ *next++) & 0xff] ^ (c >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, next, 8);
+        c ^= word;
+        c = t.sw[7][c & 0xff] ^ t.sw[6][(c >> 8) & 0xff] ^ t.sw[5][(c >> 16) & 0xff] ^ t.sw[4][(c >> 24) & 0xff] ^
+            t.sw[3][(c >> 32) & 0xff] ^ t.sw[2][(c >> 40) & 0xff] ^ t.sw[1][(c >> 48) & 0xff] ^ t.sw[0][c >> 56];
+        next += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = t.sw[0][(c ^ *next++) & 0xff] ^ (c >> 8);
+    return ~(uint32_t)c;
+}
+
+#if defined(__x86_64__)
+#define HW_TARGET __attribute__((target("sse4.2")))
+#define CRC_U8(crc, v) _mm_crc32_u8(crc, v)
+#define CRC_U64(crc, v) _mm_crc32_u64(crc, v)
+#elif defined(__aarch64__)
+#define HW_TARGET __attribute__((target("+crc")))
+#define CRC_U8(crc, v) __crc32cb(crc, v)
+#define CRC_U64(crc, v) __crc32cd(crc, v)
+#endif
+
+#ifdef HW_TARGET
+/* three streams over LONG and then SHORT blocks, then one stream for the tail */
+HW_TARGET static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+    const crc32c_tables& t = tables();
+    const unsigned char *next = (const unsigned char *)buf;
+    uint64_t crc0 = ~crc, crc1, crc2;
+
+    while (len && ((uintptr_t)next & 7)) {
+        crc0 = CRC_U8(crc0, *next++);
+        len--;
+    }
+
+    while (len >= LONG * 3) {
+        crc1 = crc2 = 0;
+        const unsigned char *end = next + LONG;
+        do {
+            crc0 = CRC_U64(crc0, *(const uint64_t *)next);
+            crc1 = CRC_U64(crc1, *(const uint64_t *)(next + LONG));
+            crc2 = CRC_U64(crc2, *(const uint64_t *)(next + 2 * LONG));
+            next += 8;
+        } while (next < end);
+        crc0 = shift(t.long_op, crc0) ^ crc1;
+        crc0 = shift(t.long_op, crc0) ^ crc2;
+        next += 2 * LONG;
+        len -= 3 * LONG;
+    }
+
+    while (len >= SHORT * 3) {
+        crc1 = crc2 = 0;
+        const unsigned char *end = next + SHORT;
+        do {
+            crc0 = CRC_U64(crc0, *(const uint64_t *)next);
+            crc1 = CRC_U64(crc1, *(const uint64_t *)(next + SHORT));
+            crc2 = CRC_U64(crc2, *(const uint64_t *)(next + 2 * SHORT));
+            next += 8;
+        } while (next < end);
+        crc0 = shift(t.short_op, crc0) ^ crc1;
+        crc0 = shift(t.short_op, crc0) ^ crc2;
+        next += 2 * SHORT;
+        len -= 3 * SHORT;
+    }
+
+    for (; len >= 8; len -= 8, next += 8)
+        crc0 = CRC_U64(crc0, *(const uint64_t *)next);
+    while (len--)
+        crc0 = CRC_U8(crc0, *next++);
+    return ~(uint32_t)crc0;
+}
+#endif
+
+typedef uint32_t (*crc32c_fn)(uint32_t, const void *, size_t);
+
+struct crc32c_choice
+{
+    crc32c_fn fn = crc32c_sw;
+    const char *name = "software";
+
+    crc32c_choice()
+    {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("sse4.2")) {
+            fn = crc32c_hw;
+            name = "sse4.2";
+        }
+#elif defined(__aarch64__)
+        if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+            fn = crc32c_hw;
+            name = "armv8-crc";
+        }
+#endif
+    }
+};
+
+static const crc32c_choice& choice()
+{
+    static const crc32c_choice c;
+    return c;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return choice().fn(crc, buf, len);
+}
+
+const char *crc32c_impl()
+{
+    return choice().name;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli), the checksum of iSCSI and ext4. zlib only has the
+ * CRC-32 polynomial, which no CPU computes in hardware; this one is a
+ * single instruction on SSE4.2 and ARMv8 CPUs.
+ *
+ * crc32c(0, buf, len) checksums one buffer; pass a previous result as crc to
+ * continue it over the next bytes */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Portable slicing-by-8 version, what crc32c() uses when the CPU has no
+ * CRC32C instructions */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/* The implementation crc32c() picked: "sse4.2", "armv8-crc" or "software" */
+const char *crc32c_impl();
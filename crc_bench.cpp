@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include <zlib.h>
+
+#include "crc32c.h"
+
+#define DEFAULT_LINK_GBITS 100
+#define BENCH_BYTES (1ULL << 30) /* checksummed per size and implementation */
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t zlib_crc32(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32(crc, (const Bytef *)buf, len);
+}
+
+static volatile uint32_t sink; /* keeps the checksums from being optimized away */
+
+struct bench_impl
+{
+    const char *name;
+    uint32_t (*fn)(uint32_t, const void *, size_t);
+};
+
+/* Checksum throughput of each implementation over a range of buffer sizes,
+ * next to the link rate the transfer has to keep up with. zlib's CRC-32 is
+ * a different polynomial, listed for comparison only */
+int main(int argc, char *argv[]) {
+    double link_gbits = argc > 1 ? atof(argv[1]) : DEFAULT_LINK_GBITS;
+    if (link_gbits <= 0) {
+        printf("usage: %s [link Gb/s]\n", argv[0]);
+        exit(1);
+    }
+
+    bench_impl impls[] = {
+        { crc32c_impl(), crc32c },
+        { "crc32c_sw", crc32c_sw },
+        { "zlib crc32", zlib_crc32 },
+    };
+    size_t sizes[] = { 4 << 10, 64 << 10, 1 << 20, 16 << 20 };
+
+    std::vector<unsigned char> buf(sizes[3]);
+    for (size_t i = 0; i < buf.size(); i++)
+        buf[i] = (unsigned char)(i * 2654435761U >> 13);
+
+    printf("%-12s %10s %10s %10s %8s\n", "impl", "size", "GB/s", "Gb/s", "x link");
+    for (const bench_impl& impl : impls) {
+        for (size_t size : sizes) {
+            uint64_t rounds = BENCH_BYTES / size;
+            uint32_t crc = 0;
+            impl.fn(0, buf.data(), size); /* warm the cache and the tables */
+            uint64_t start = now_ns();
+            for (uint64_t r = 0; r < rounds; r++)
+                crc ^= impl.fn(0, buf.data(), size);
+            uint64_t ns = now_ns() - start;
+
+            double bytes_per_ns = (double)rounds * size / ns;
+            sink = crc;
+            printf("%-12s %10zu %10.2f %10.1f %8.1f\n", impl.name, size, bytes_per_ns, bytes_per_ns * 8,
+                   bytes_per_ns * 8 / link_gbits);
+        }
+    }
+    return 0;
+}
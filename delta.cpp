@@ -0,0 +1,130 @@
+#include "delta.h"
+
+#include <string.h>
+
+#include <unordered_map>
+
+/* rsync's checksum: s1 sums the bytes, s2 sums the running s1, both mod
+ * 2^16. Dropping the first byte of the window and adding the next one
+ * updates them in constant time */
+static inline uint32_t weak_value(uint32_t s1, uint32_t s2)
+{
+    return (s1 & 0xffff) | (s2 << 16);
+}
+
+static void weak_sums(const unsigned char *p, size_t len, uint32_t *s1, uint32_t *s2)
+{
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += p[i];
+        b += a;
+    }
+    *s1 = a;
+    *s2 = b;
+}
+
+uint32_t weak_checksum(const void *buf, size_t len)
+{
+    uint32_t s1, s2;
+    weak_sums((const unsigned char *)buf, len, &s1, &s2);
+    return weak_value(s1, s2);
+}
+
+/* MurmurHash64A: a word at a time, so signing runs near memory speed */
+uint64_t strong_checksum(const void *buf, size_t len)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const unsigned char *p = (const unsigned char *)buf;
+    uint64_t h = 0x8445d61a4e774912ULL ^ (len * m);
+
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if (len) {
+        uint64_t k = 0;
+        memcpy(&k, p, len);
+        h ^= k;
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+void compute_signatures(const char *data, uint64_t length, uint32_t block, block_signature *sigs)
+{
+    for (uint64_t i = 0; i < length / block; i++) {
+        const char *p = data + i * block;
+        sigs[i].weak = weak_checksum(p, block);
+        sigs[i].reserved = 0;
+        sigs[i].strong = strong_checksum(p, block);
+    }
+}
+
+std::vector<delta_copy> match_blocks(const char *data, uint64_t length, uint32_t block,
+                                     const block_signature *sigs, uint64_t num_blocks)
+{
+    std::vector<delta_copy> copies;
+    if (!block || !num_blocks || length < block)
+        return copies;
+
+    std::unordered_map<uint32_t, std::vector<uint64_t>> by_weak;
+    by_weak.reserve(num_blocks);
+    for (uint64_t i = 0; i < num_blocks; i++)
+        by_weak[sigs[i].weak].push_back(i);
+
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t pos = 0;
+    uint32_t s1, s2;
+    weak_sums(p, block, &s1, &s2);
+
+    while (true) {
+        int64_t found = -1;
+        auto it = by_weak.find(weak_value(s1, s2));
+        if (it != by_weak.end()) {
+            uint64_t strong = strong_checksum(p + pos, block);
+            for (uint64_t i : it->second) {
+                if (sigs[i].strong != strong)
+                    continue;
+                /* a block that didn't move needs no copying at all in a clone of the old file */
+                if (found < 0 || i * block == pos)
+                    found = i;
+                if (i * block == pos)
+                    break;
+            }
+        }
+
+        if (found >= 0) {
+            uint64_t basis_offset = found * block;
+            delta_copy *last = copies.empty() ? nullptr : &copies.back();
+            if (last && last->offset + last->length == pos && last->basis_offset + last->length == basis_offset)
+                last->length += block;
+            else
+                copies.push_back({ pos, basis_offset, block });
+
+            pos += block;
+            if (pos + block > length)
+                break;
+            weak_sums(p + pos, block, &s1, &s2);
+            continue;
+        }
+
+        if (pos + block >= length)
+            break;
+        /* slide the window one byte */
+        uint32_t out = p[pos], in = p[pos + block];
+        s1 += in - out;
+        s2 += s1 - block * out;
+        pos++;
+    }
+    return copies;
+}
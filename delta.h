@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+/* rsync-style delta transfers. The receiver signs each block of its old copy
+ * of a file; the sender slides a window over the new version looking for
+ * blocks whose signatures match, wherever they moved to. Only the bytes
+ * between matches have to travel.
+ *
+ * A block matches if its weak checksum (rsync's rolling sum, cheap to
+ * update one byte at a time) and then its strong one (64-bit hash) agree.
+ * A false match is still possible; the CRC32Cs of the transfer catch it */
+
+struct block_signature
+{
+    uint32_t weak;
+    uint32_t reserved;
+    uint64_t strong;
+};
+
+/* New bytes [offset, offset + length) are the old copy's [basis_offset, ...) */
+struct delta_copy
+{
+    uint64_t offset;
+    uint64_t basis_offset;
+    uint64_t length;
+};
+
+uint32_t weak_checksum(const void *buf, size_t len);
+uint64_t strong_checksum(const void *buf, size_t len);
+
+/* Sign the length / block full blocks of data; a short tail is not signed */
+void compute_signatures(const char *data, uint64_t length, uint32_t block, block_signature *sigs);
+
+/* Where the old copy's blocks (num_blocks signatures) turn up in data,
+ * in order of offset, adjacent runs merged */
+std::vector<delta_copy> match_blocks(const char *data, uint64_t length, uint32_t block,
+                                     const block_signature *sigs, uint64_t num_blocks);
@@ -0,0 +1,243 @@
+#include "mem_pool.h"
+#include "metrics.h"
+#include "rdma_error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* index of the smallest size class holding length, or -1 if none does */
+static int size_class(size_t length)
+{
+    int shift = MEM_POOL_MIN_SHIFT;
+    while (shift <= MEM_POOL_MAX_SHIFT && (1UL << shift) < length)
+        shift++;
+    return shift <= MEM_POOL_MAX_SHIFT ? shift - MEM_POOL_MIN_SHIFT : -1;
+}
+
+static size_t round_up(size_t length, size_t align)
+{
+    return (length + align - 1) / align * align;
+}
+
+char *alloc_pages(size_t length, size_t huge_page_size, size_t *mapped, page_backing *backing)
+{
+    if (huge_page_size && length >= huge_page_size) {
+        /* MAP_HUGE_2MB, MAP_HUGE_1GB...: log2 of the page size */
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (__builtin_ctzl(huge_page_size) << MAP_HUGE_SHIFT);
+        size_t size = round_up(length, huge_page_size);
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (p != MAP_FAILED) {
+            *mapped = size;
+            *backing = PAGES_HUGETLB;
+            return (char *)p;
+        }
+        /* none reserved (vm.nr_hugepages), or not that size: try THP */
+    }
+
+    if (huge_page_size && length >= THP_PAGE_SIZE) {
+        /* THP only fills aligned extents, so map a page more and trim */
+        size_t size = round_up(length, THP_PAGE_SIZE);
+        char *p = (char *)mmap(NULL, size + THP_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            throw_errno("mmap() failed for pool buffer");
+        }
+        char *aligned = (char *)round_up((uintptr_t)p, THP_PAGE_SIZE);
+        if (aligned > p)
+            munmap(p, aligned - p);
+        munmap(aligned + size, p + THP_PAGE_SIZE - aligned);
+        /* registering faults the buffer in, in huge pages where the kernel has them */
+        madvise(aligned, size, MADV_HUGEPAGE);
+        *mapped = size;
+        *backing = PAGES_THP;
+        return aligned;
+    }
+
+    char *p;
+    if (posix_memalign((void **)&p, 4096, length)) {
+        throw_error("posix_memalign() failed for %zu bytes", length);
+    }
+    *mapped = 0;
+    *backing = PAGES_4K;
+    return p;
+}
+
+void free_pages(char *addr, size_t mapped)
+{
+    if (mapped)
+        munmap(addr, mapped);
+    else
+        free(addr);
+}
+
+rdma_mem_pool::rdma_mem_pool(struct ibv_pd *pd, size_t huge_page_size) : pd(pd), huge_page_size(huge_page_size) {}
+
+rdma_mem_pool::~rdma_mem_pool()
+{
+    for (auto& list : free_lists)
+        for (registered_buffer& buf : list) {
+            ibv_dereg_mr(buf.mr);
+            free_pages(buf.addr, buf.mapped);
+        }
+    for (auto& entry : mr_cache)
+        ibv_dereg_mr(entry.second.mr);
+}
+
+struct ibv_mr *rdma_mem_pool::timed_reg_mr(void *addr, size_t length, uint64_t *ns)
+{
+    METRIC_SCOPE(PHASE_MR_REG);
+    uint64_t start = now_ns();
+    struct ibv_mr *mr = ibv_reg_mr(pd, addr, length, access);
+    *ns += now_ns() - start;
+    return mr;
+}
+
+registered_buffer rdma_mem_pool::get(size_t length)
+{
+    registered_buffer buf;
+    int c = size_class(length);
+
+    if (c >= 0 && !free_lists[c].empty()) {
+        buf = free_lists[c].back();
+        free_lists[c].pop_back();
+        cached_bytes -= buf.size;
+        class_stats[c].hits++;
+        return buf;
+    }
+
+    buf.size = c >= 0 ? 1UL << (c + MEM_POOL_MIN_SHIFT) : length;
+    page_backing backing;
+    buf.addr = alloc_pages(buf.size, huge_page_size, &buf.mapped, &backing);
+    backing_allocs[backing]++;
+
+    uint64_t oversize_ns = 0;
+    buf.mr = timed_reg_mr(buf.addr, buf.size, c >= 0 ? &class_stats[c].reg_ns : &oversize_ns);
+    if (!buf.mr) {
+        int err = errno;
+        free_pages(buf.addr, buf.mapped);
+        errno = err;
+        throw_errno("ibv_reg_mr() failed for pool buffer");
+    }
+    if (c >= 0)
+        class_stats[c].misses++;
+    else
+        oversize_allocs++;
+    return buf;
+}
+
+void rdma_mem_pool::put(const registered_buffer& buf)
+{
+    if (!buf.addr)
+        return;
+
+    int c = size_class(buf.size);
+    bool pooled = c >= 0 && (1UL << (c + MEM_POOL_MIN_SHIFT)) == buf.size;
+    if (pooled && cached_bytes + buf.size <= MEM_POOL_MAX_CACHED) {
+        free_lists[c].push_back(buf);
+        cached_bytes += buf.size;
+        return;
+    }
+
+    ibv_dereg_mr(buf.mr);
+    free_pages(buf.addr, buf.mapped);
+}
+
+void rdma_mem_pool::drop(const registered_buffer& buf)
+{
+    if (!buf.addr)
+        return;
+    ibv_dereg_mr(buf.mr);
+    free_pages(buf.addr, buf.mapped);
+}
+
+struct ibv_mr *rdma_mem_pool::lookup(void *addr, size_t length)
+{
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + length;
+
+    /* the covering entry, if any, starts at or below addr. Entries never
+     * overlap (see below), so only the closest one can cover the range */
+    auto it = mr_cache.upper_bound(start);
+    if (it != mr_cache.begin()) {
+        --it;
+        if (it->second.end >= end) {
+            it->second.last_use = ++use_clock;
+            cache_hits++;
+            cache_hit_bytes += length;
+            return it->second.mr;
+        }
+    }
+
+    /* miss: drop anything the new range overlaps, so entries stay disjoint */
+    invalidate(addr, length);
+    while (mr_cache.size() >= MR_CACHE_SIZE)
+        evict_lru();
+
+    struct ibv_mr *mr = timed_reg_mr(addr, length, &cache_reg_ns);
+    if (!mr) {
+        throw_errno("ibv_reg_mr() failed for cached buffer");
+    }
+    cache_misses++;
+    cache_reg_bytes += length;
+    mr_cache[start] = { end, mr, ++use_clock };
+    return mr;
+}
+
+void rdma_mem_pool::invalidate(void *addr, size_t length)
+{
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + length;
+
+    auto it = mr_cache.upper_bound(start);
+    if (it != mr_cache.begin() && std::prev(it)->second.end > start)
+        --it;
+    while (it != mr_cache.end() && it->first < end) {
+        ibv_dereg_mr(it->second.mr);
+        it = mr_cache.erase(it);
+    }
+}
+
+void rdma_mem_pool::evict_lru()
+{
+    auto lru = mr_cache.begin();
+    for (auto it = mr_cache.begin(); it != mr_cache.end(); ++it)
+        if (it->second.last_use < lru->second.last_use)
+            lru = it;
+    ibv_dereg_mr(lru->second.mr);
+    mr_cache.erase(lru);
+}
+
+void rdma_mem_pool::print_stats() const
+{
+    uint64_t hits = 0, misses = 0, saved_ns = 0;
+
+    /* a hit saves what registering a buffer of its class costs on average */
+    for (int c = 0; c < num_classes; c++) {
+        const size_class_stats& s = class_stats[c];
+        hits += s.hits;
+        misses += s.misses;
+        if (s.misses)
+            saved_ns += s.hits * (s.reg_ns / s.misses);
+    }
+    printf("buffer pool: %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit rate), %" PRIu64 " oversize, %zu bytes idle\n",
+           hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0, oversize_allocs, cached_bytes);
+    printf("pool pages: %" PRIu64 " buffers on hugetlb pages, %" PRIu64 " transparent, %" PRIu64 " 4 KiB\n",
+           backing_allocs[PAGES_HUGETLB], backing_allocs[PAGES_THP], backing_allocs[PAGES_4K]);
+
+    /* caller buffers vary in size, so estimate their registration cost per byte */
+    if (cache_reg_bytes)
+        saved_ns += (uint64_t)((double)cache_reg_ns / cache_reg_bytes * cache_hit_bytes);
+    printf("mr cache: %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit rate), %zu entries\n",
+           cache_hits, cache_misses, cache_hits + cache_misses ? 100.0 * cache_hits / (cache_hits + cache_misses) : 0.0,
+           mr_cache.size());
+    printf("registration time saved: ~%.3f ms\n", saved_ns / 1e6);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <map>
+#include <vector>
+
+#include <infiniband/verbs.h>
+
+#include "settings.h"
+
+/* A buffer handed out by rdma_mem_pool. size is the size class, which may be
+ * larger than what was asked for */
+struct registered_buffer
+{
+    char *addr = nullptr;
+    size_t size = 0;
+    struct ibv_mr *mr = nullptr;
+    size_t mapped = 0; /* see alloc_pages() */
+};
+
+/* What backs the pages of a buffer */
+enum page_backing {
+    PAGES_4K,      /* posix_memalign */
+    PAGES_THP,     /* anonymous mapping, madvise(MADV_HUGEPAGE) */
+    PAGES_HUGETLB, /* MAP_HUGETLB, from the reserved pool of huge_page_size pages */
+};
+
+/* Page-aligned memory to register. Every page of a registration is an entry
+ * in the HCA's translation tables, so big buffers want big pages: with
+ * huge_page_size set, a buffer of at least that size is mapped with
+ * MAP_HUGETLB in pages of that size (2 MiB or 1 GiB), or with transparent
+ * hugepages if none are reserved, and one of at least THP_PAGE_SIZE with
+ * transparent hugepages. The rest, and everything when huge_page_size is 0,
+ * gets 4 KiB pages.
+ *
+ * *mapped is the length of the mapping, 0 for posix_memalign; free_pages()
+ * needs it back. Throws rdma_error if there is no memory */
+char *alloc_pages(size_t length, size_t huge_page_size, size_t *mapped, page_backing *backing);
+void free_pages(char *addr, size_t mapped);
+
+/* Registered memory for transfers, so ibv_reg_mr stays off the hot path.
+ *
+ * get()/put() serve pool-owned buffers in power-of-two size classes. Released
+ * buffers stay registered and are recycled; sizes above the largest class are
+ * registered on demand and dropped on put().
+ *
+ * lookup() is an MR cache for caller-owned buffers: it returns a registration
+ * covering [addr, addr + length), reusing an earlier one when possible. The
+ * cache cannot see the caller free memory, so callers must invalidate() a
+ * range before freeing or remapping it */
+class rdma_mem_pool
+{
+public:
+    /* huge_page_size: see alloc_pages() */
+    rdma_mem_pool(struct ibv_pd *pd, size_t huge_page_size);
+    ~rdma_mem_pool();
+
+    registered_buffer get(size_t length);
+    void put(const registered_buffer& buf);
+    /* Deregister and free buf instead of recycling it, so no rkey of it
+     * ever works again */
+    void drop(const registered_buffer& buf);
+
+    struct ibv_mr *lookup(void *addr, size_t length);
+    void invalidate(void *addr, size_t length);
+
+    void print_stats() const;
+
+private:
+    static const int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+    static const int num_classes = MEM_POOL_MAX_SHIFT - MEM_POOL_MIN_SHIFT + 1;
+
+    struct ibv_pd *pd;
+    size_t huge_page_size;
+
+    std::vector<registered_buffer> free_lists[num_classes];
+    size_t cached_bytes = 0; /* idle bytes sitting in free_lists */
+
+    struct cache_entry {
+        uintptr_t end;
+        struct ibv_mr *mr;
+        uint64_t last_use;
+    };
+    std::map<uintptr_t, cache_entry> mr_cache; /* by start address */
+    uint64_t use_clock = 0;
+
+    /* counters */
+    struct size_class_stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t reg_ns = 0; /* time spent registering this class */
+    };
+    size_class_stats class_stats[num_classes];
+    uint64_t oversize_allocs = 0;
+    uint64_t backing_allocs[PAGES_HUGETLB + 1] = {}; /* by page_backing */
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t cache_hit_bytes = 0;
+    uint64_t cache_reg_ns = 0;
+    uint64_t cache_reg_bytes = 0;
+
+    struct ibv_mr *timed_reg_mr(void *addr, size_t length, uint64_t *ns);
+    void evict_lru();
+};
@@ -0,0 +1,231 @@
+#include "metrics.h"
+
+#ifdef RDMA_METRICS
+
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+static const char *phase_names[NUM_METRIC_PHASES] = {
+    "tcp_connect", "device_open", "qp_create", "qp_connect", "mr_reg", "probe", "transfer", "cq_sleep",
+};
+
+static const char *counter_names[NUM_METRIC_COUNTERS] = {
+    "bytes_read", "bytes_written", "wrs_posted", "wrs_signaled", "messages_sent", "messages_received",
+    "cqes", "retries", "errors", "cache_hits", "cache_misses", "cache_evictions",
+    "tcp_bytes_sent", "tcp_bytes_received", "zerocopy_sends", "zerocopy_copied",
+};
+
+struct metric_event
+{
+    uint64_t start;
+    uint64_t ticks;
+    int phase;
+};
+
+/* Everything one thread records. Only that thread writes it; reports read it
+ * concurrently, so fields are atomics accessed relaxed, and the ring index
+ * is published with release after its slot is written. A report racing a
+ * wrap of the ring may see a slot being overwritten; it is a snapshot of
+ * recent history, not a log */
+struct metrics_thread
+{
+    std::atomic<uint64_t> counters[NUM_METRIC_COUNTERS];
+    /* bucket b holds durations in [2^(b-1), 2^b) ticks */
+    std::atomic<uint64_t> histogram[NUM_METRIC_PHASES][METRICS_HIST_BUCKETS];
+    std::atomic<uint64_t> phase_ticks[NUM_METRIC_PHASES];
+    metric_event ring[METRICS_RING_SIZE];
+    std::atomic<uint64_t> ring_head;
+
+    metrics_thread()
+    {
+        for (auto& c : counters)
+            c.store(0, std::memory_order_relaxed);
+        for (auto& h : histogram)
+            for (auto& b : h)
+                b.store(0, std::memory_order_relaxed);
+        for (auto& t : phase_ticks)
+            t.store(0, std::memory_order_relaxed);
+        ring_head.store(0, std::memory_order_relaxed);
+    }
+};
+
+/* threads register once; their state outlives them so totals stay complete */
+static std::mutex registry_lock;
+static std::vector<metrics_thread *> registry;
+
+static metrics_thread *this_thread()
+{
+    static thread_local metrics_thread *t = nullptr;
+    if (!t) {
+        t = new metrics_thread();
+        std::lock_guard<std::mutex> guard(registry_lock);
+        registry.push_back(t);
+    }
+    return t;
+}
+
+static inline void bump(std::atomic<uint64_t>& v, uint64_t n)
+{
+    /* single writer: no read-modify-write needed */
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void metrics_record(metric_phase phase, uint64_t start_ticks, uint64_t end_ticks)
+{
+    metrics_thread *t = this_thread();
+    uint64_t ticks = end_ticks - start_ticks;
+
+    int bucket = ticks ? 64 - __builtin_clzll(ticks) : 0;
+    if (bucket >= METRICS_HIST_BUCKETS)
+        bucket = METRICS_HIST_BUCKETS - 1;
+    bump(t->histogram[phase][bucket], 1);
+    bump(t->phase_ticks[phase], ticks);
+
+    uint64_t head = t->ring_head.load(std::memory_order_relaxed);
+    t->ring[head % METRICS_RING_SIZE] = { start_ticks, ticks, phase };
+    t->ring_head.store(head + 1, std::memory_order_release);
+}
+
+void metrics_add(metric_counter counter, uint64_t n)
+{
+    bump(this_thread()->counters[counter], n);
+}
+
+/* ticks per nanosecond, measured once against CLOCK_MONOTONIC */
+static double ticks_per_ns()
+{
+    static double rate = 0;
+    if (rate)
+        return rate;
+
+    struct timespec t0, t1, pause = { 0, 20 * 1000 * 1000 };
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t c0 = metrics_ticks();
+    nanosleep(&pause, NULL);
+    uint64_t c1 = metrics_ticks();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    rate = ns > 0 && c1 > c0 ? (c1 - c0) / ns : 1.0;
+    return rate;
+}
+
+struct metrics_totals
+{
+    uint64_t counters[NUM_METRIC_COUNTERS] = {};
+    uint64_t histogram[NUM_METRIC_PHASES][METRICS_HIST_BUCKETS] = {};
+    uint64_t count[NUM_METRIC_PHASES] = {};
+    uint64_t ticks[NUM_METRIC_PHASES] = {};
+    std::vector<metric_event> recent;
+};
+
+static metrics_totals collect()
+{
+    metrics_totals m;
+    std::lock_guard<std::mutex> guard(registry_lock);
+    for (metrics_thread *t : registry) {
+        for (int c = 0; c < NUM_METRIC_COUNTERS; c++)
+            m.counters[c] += t->counters[c].load(std::memory_order_relaxed);
+        for (int p = 0; p < NUM_METRIC_PHASES; p++) {
+            for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+                uint64_t n = t->histogram[p][b].load(std::memory_order_relaxed);
+                m.histogram[p][b] += n;
+                m.count[p] += n;
+            }
+            m.ticks[p] += t->phase_ticks[p].load(std::memory_order_relaxed);
+        }
+
+        uint64_t head = t->ring_head.load(std::memory_order_acquire);
+        uint64_t first = head > METRICS_DUMP_EVENTS ? head - METRICS_DUMP_EVENTS : 0;
+        for (uint64_t i = first; i < head; i++)
+            m.recent.push_back(t->ring[i % METRICS_RING_SIZE]);
+    }
+    return m;
+}
+
+/* upper bound in ns of the bucket holding the p-th quantile */
+static double quantile_ns(const metrics_totals& m, int phase, double p)
+{
+    uint64_t target = (uint64_t)(p * m.count[phase]), seen = 0;
+    for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+        seen += m.histogram[phase][b];
+        if (seen > target)
+            return (double)(1ULL << b) / ticks_per_ns();
+    }
+    return 0;
+}
+
+void metrics_dump_json(FILE *out)
+{
+    metrics_totals m = collect();
+    double rate = ticks_per_ns();
+
+    fprintf(out, "{\n  \"counters\": {");
+    for (int c = 0; c < NUM_METRIC_COUNTERS; c++)
+        fprintf(out, "%s\n    \"%s\": %" PRIu64, c ? "," : "", counter_names[c], m.counters[c]);
+    fprintf(out, "\n  },\n  \"phases\": {");
+    for (int p = 0; p < NUM_METRIC_PHASES; p++)
+        fprintf(out, "%s\n    \"%s\": {\"count\": %" PRIu64 ", \"total_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}",
+                p ? "," : "", phase_names[p], m.count[p], m.ticks[p] / rate / 1e3,
+                quantile_ns(m, p, 0.5) / 1e3, quantile_ns(m, p, 0.99) / 1e3, quantile_ns(m, p, 0.999) / 1e3);
+    fprintf(out, "\n  },\n  \"recent\": [");
+    for (size_t i = 0; i < m.recent.size(); i++)
+        fprintf(out, "%s\n    {\"phase\": \"%s\", \"start_us\": %.1f, \"duration_us\": %.1f}", i ? "," : "",
+                phase_names[m.recent[i].phase], m.recent[i].start / rate / 1e3, m.recent[i].ticks / rate / 1e3);
+    fprintf(out, "\n  ]\n}\n");
+}
+
+void metrics_dump_prometheus(FILE *out)
+{
+    metrics_totals m = collect();
+    double rate = ticks_per_ns();
+
+    for (int c = 0; c < NUM_METRIC_COUNTERS; c++) {
+        fprintf(out, "# TYPE rdma_%s_total counter\n", counter_names[c]);
+        fprintf(out, "rdma_%s_total %" PRIu64 "\n", counter_names[c], m.counters[c]);
+    }
+
+    fprintf(out, "# TYPE rdma_phase_duration_seconds histogram\n");
+    for (int p = 0; p < NUM_METRIC_PHASES; p++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            cumulative += m.histogram[p][b];
+            /* skip the empty tail; +Inf below closes the series */
+            if (cumulative == m.count[p] && m.histogram[p][b] == 0)
+                continue;
+            fprintf(out, "rdma_phase_duration_seconds_bucket{phase=\"%s\",le=\"%.9f\"} %" PRIu64 "\n",
+                    phase_names[p], (double)(1ULL << b) / rate / 1e9, cumulative);
+        }
+        fprintf(out, "rdma_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", phase_names[p], m.count[p]);
+        fprintf(out, "rdma_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[p], m.ticks[p] / rate / 1e9);
+        fprintf(out, "rdma_phase_duration_seconds_count{phase=\"%s\"} %" PRIu64 "\n", phase_names[p], m.count[p]);
+    }
+}
+
+void metrics_report()
+{
+    const char *path = getenv("RDMA_METRICS_FILE");
+    if (!path) {
+        metrics_dump_json(stderr);
+        return;
+    }
+
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        perror("fopen() failed for metrics file");
+        return;
+    }
+    size_t len = strlen(path);
+    if (len > 5 && !strcmp(path + len - 5, ".prom"))
+        metrics_dump_prometheus(out);
+    else
+        metrics_dump_json(out);
+    fclose(out);
+}
+
+#endif
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "settings.h"
+
+/* Instrumentation of the transfer path: how long each phase takes and what
+ * went over the wire. Built in only with -DRDMA_METRICS; otherwise every
+ * METRIC_* macro expands to nothing and metrics.cpp is empty.
+ *
+ * Each thread records into its own state, so recording takes no locks:
+ * phase durations in TSC ticks go to a ring of recent events and to a log2
+ * histogram per phase, and counters are relaxed atomics. Ticks are only
+ * converted to time when a report is produced */
+
+enum metric_phase {
+    PHASE_TCP_CONNECT,  /* bootstrap socket: listen + accept, or connect */
+    PHASE_DEVICE_OPEN,  /* open device, allocate PD, query attributes */
+    PHASE_QP_CREATE,    /* CQ, QPs and request buffers */
+    PHASE_QP_CONNECT,   /* RESET -> RTS of all QPs */
+    PHASE_MR_REG,       /* one ibv_reg_mr */
+    PHASE_PROBE,        /* path probe of the tuner */
+    PHASE_TRANSFER,     /* one file, request to ack */
+    PHASE_CQ_SLEEP,     /* blocked on the completion channel */
+    NUM_METRIC_PHASES
+};
+
+enum metric_counter {
+    CTR_BYTES_READ,     /* RDMA read payload posted */
+    CTR_BYTES_WRITTEN,  /* RDMA write payload posted */
+    CTR_WRS_POSTED,     /* send WRs */
+    CTR_WRS_SIGNALED,   /* ... of which asked for a completion */
+    CTR_MESSAGES_SENT,
+    CTR_MESSAGES_RECEIVED,
+    CTR_CQES,           /* CQEs polled */
+    CTR_RETRIES,        /* connect attempts repeated */
+    CTR_ERRORS,         /* failed work completions */
+    CTR_CACHE_HITS,     /* object GETs served from the server's cache */
+    CTR_CACHE_MISSES,   /* ... not found there */
+    CTR_CACHE_EVICTIONS, /* objects the server dropped for room */
+    CTR_TCP_BYTES_SENT, /* payload of TCP transfers */
+    CTR_TCP_BYTES_RECEIVED,
+    CTR_ZEROCOPY_SENDS, /* MSG_ZEROCOPY sends ... */
+    CTR_ZEROCOPY_COPIED, /* ... the kernel had to copy after all */
+    NUM_METRIC_COUNTERS
+};
+
+#ifdef RDMA_METRICS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t metrics_ticks() { return __rdtsc(); }
+#elif defined(__aarch64__)
+static inline uint64_t metrics_ticks()
+{
+    uint64_t t;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+}
+#else
+#include <time.h>
+static inline uint64_t metrics_ticks()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+void metrics_record(metric_phase phase, uint64_t start_ticks, uint64_t end_ticks);
+void metrics_add(metric_counter counter, uint64_t n);
+
+/* Times the enclosing scope as one occurrence of phase */
+struct metric_scope
+{
+    metric_phase phase;
+    uint64_t start;
+
+    explicit metric_scope(metric_phase phase) : phase(phase), start(metrics_ticks()) {}
+    ~metric_scope() { metrics_record(phase, start, metrics_ticks()); }
+};
+
+#define METRIC_CONCAT2(a, b) a##b
+#define METRIC_CONCAT(a, b) METRIC_CONCAT2(a, b)
+#define METRIC_SCOPE(phase) metric_scope METRIC_CONCAT(metric_scope_, __LINE__)(phase)
+#define METRIC_ADD(counter, n) metrics_add(counter, n)
+
+/* Aggregate all threads and write the totals, per-phase histograms and the
+ * most recent events */
+void metrics_dump_json(FILE *out);
+void metrics_dump_prometheus(FILE *out);
+/* Dump to $RDMA_METRICS_FILE (Prometheus text if it ends in .prom, JSON
+ * otherwise), or as JSON to stderr when it is not set */
+void metrics_report();
+
+#else
+
+#define METRIC_SCOPE(phase) do {} while (0)
+#define METRIC_ADD(counter, n) do {} while (0)
+
+static inline void metrics_dump_json(FILE *) {}
+static inline void metrics_dump_prometheus(FILE *) {}
+static inline void metrics_report() {}
+
+#endif
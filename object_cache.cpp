@@ -0,0 +1,139 @@
+#include "object_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <algorithm>
+
+#include "crc32c.h"
+#include "metrics.h"
+#include "rdma_error.h"
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+object_cache::object_cache(rdma_mem_pool *pool, struct ibv_pd *pd, uint64_t capacity) :
+    pool(pool), pd(pd), capacity(capacity), directory(OBJECT_CACHE_SLOTS)
+{
+    mr_directory = ibv_reg_mr(pd, directory.data(), directory_length(), IBV_ACCESS_REMOTE_READ);
+    if (!mr_directory) {
+        throw_errno("ibv_reg_mr() failed for object directory");
+    }
+    for (int i = OBJECT_CACHE_SLOTS - 1; i >= 0; i--)
+        free_slots.push_back(i);
+    printf("object cache: %" PRIu64 " bytes in %d slots, directory at %p rkey 0x%x\n", capacity, OBJECT_CACHE_SLOTS,
+           directory.data(), mr_directory->rkey);
+}
+
+object_cache::~object_cache()
+{
+    print_stats();
+    /* the process is going away with its connections; nobody reads anymore */
+    for (object& o : lru)
+        pool->drop(o.buf);
+    for (retired& r : retiring)
+        pool->drop(r.buf);
+    ibv_dereg_mr(mr_directory);
+}
+
+void object_cache::publish(int slot, const object_entry& value)
+{
+    object_entry& e = directory[slot];
+    uint64_t version = e.version;
+
+    /* a seqlock the NIC reads through: odd while the fields change */
+    __atomic_store_n(&e.version, version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e.id = value.id;
+    e.addr = value.addr;
+    e.length = value.length;
+    e.rkey = value.rkey;
+    e.crc = value.crc;
+    __atomic_store_n(&e.version, version + 2, __ATOMIC_RELEASE);
+}
+
+void object_cache::retire(std::list<object>::iterator it)
+{
+    /* unlisted first: new lookups miss from now on */
+    publish(it->slot, object_entry());
+    free_slots.push_back(it->slot);
+    retiring.push_back({ it->buf, now_ns() + OBJECT_CACHE_GRACE_MS * 1000000ULL });
+    cached_bytes -= it->length;
+    by_id.erase(it->id);
+    lru.erase(it);
+}
+
+bool object_cache::insert(uint64_t id, const registered_buffer& buf, uint64_t length)
+{
+    if (length > capacity || !length) {
+        rejected++;
+        return false;
+    }
+
+    auto old = by_id.find(id);
+    if (old != by_id.end()) {
+        retire(old->second);
+        replacements++;
+    }
+    while (!lru.empty() && (cached_bytes + length > capacity || free_slots.empty())) {
+        retire(lru.begin());
+        evictions++;
+        METRIC_ADD(CTR_CACHE_EVICTIONS, 1);
+    }
+
+    /* readable by anyone with the directory, writable by nobody: the rkey
+     * the upload went through dies with the pool registration */
+    object o = { id, buf, length, free_slots.back() };
+    {
+        METRIC_SCOPE(PHASE_MR_REG);
+        o.buf.mr = ibv_reg_mr(pd, buf.addr, buf.size, IBV_ACCESS_REMOTE_READ);
+    }
+    if (!o.buf.mr) {
+        throw_errno("ibv_reg_mr() failed for cached object");
+    }
+    ibv_dereg_mr(buf.mr);
+    free_slots.pop_back();
+
+    object_entry e = {};
+    e.id = id;
+    e.addr = (uint64_t)buf.addr;
+    e.length = length;
+    e.rkey = o.buf.mr->rkey;
+    e.crc = crc32c(0, buf.addr, length);
+    publish(o.slot, e);
+
+    lru.push_back(o);
+    by_id[id] = std::prev(lru.end());
+    cached_bytes += length;
+    inserts++;
+    return true;
+}
+
+int object_cache::reap()
+{
+    uint64_t now = now_ns();
+    uint64_t next = UINT64_MAX;
+    for (size_t i = 0; i < retiring.size(); ) {
+        if (retiring[i].deadline_ns <= now) {
+            pool->drop(retiring[i].buf);
+            retiring[i] = retiring.back();
+            retiring.pop_back();
+            continue;
+        }
+        next = std::min(next, retiring[i].deadline_ns);
+        i++;
+    }
+    return next == UINT64_MAX ? -1 : (next - now + 999999) / 1000000;
+}
+
+void object_cache::print_stats() const
+{
+    printf("object cache: %zu objects, %" PRIu64 " bytes; %" PRIu64 " inserts, %" PRIu64 " replacements, %" PRIu64
+           " evictions, %" PRIu64 " too large\n", lru.size(), cached_bytes, inserts, replacements, evictions, rejected);
+}
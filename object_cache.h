@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "mem_pool.h"
+
+/* One slot of the object directory, as clients read it. version is odd
+ * while the server rewrites the slot; a reader that sees an odd version, or
+ * a different one after reading the object, has to look again */
+struct object_entry
+{
+    uint64_t version;
+    uint64_t id;
+    uint64_t addr;   /* 0: free slot */
+    uint64_t length;
+    uint32_t rkey;
+    uint32_t crc;    /* CRC32C of the object */
+};
+
+/* Files received by rdma_server, kept registered for other clients to GET
+ * with one-sided RDMA reads: the directory (a registered array of
+ * object_entry, advertised in a REQ_DIRECTORY reply), then the object it
+ * points to. The server CPU takes no part in a GET, so it also can't see
+ * them: recency is that of the upload.
+ *
+ * An object owns its buffer, registered read-only on insertion; the write
+ * access of the pool registration it arrived in is revoked with it. On
+ * eviction or replacement the directory slot is cleared first, and the
+ * registration is dropped only after OBJECT_CACHE_GRACE_MS, so GETs racing
+ * the eviction read intact memory and then notice the version change */
+class object_cache
+{
+public:
+    object_cache(rdma_mem_pool *pool, struct ibv_pd *pd, uint64_t capacity);
+    ~object_cache();
+
+    /* An id no object of this cache has had yet, for a new upload */
+    uint64_t new_id() { return next_id++; }
+
+    /* Take over buf, holding length bytes, as object id, replacing any
+     * older version. False if it can't fit; buf is still the caller's then,
+     * and GETs of id miss */
+    bool insert(uint64_t id, const registered_buffer& buf, uint64_t length);
+
+    uint64_t directory_addr() const { return (uint64_t)directory.data(); }
+    uint32_t directory_rkey() const { return mr_directory->rkey; }
+    uint64_t directory_length() const { return directory.size() * sizeof(object_entry); }
+
+    /* Release evicted objects whose grace period is over. Returns the
+     * milliseconds until the next one is due, or -1 if none is waiting */
+    int reap();
+
+    void print_stats() const;
+
+private:
+    struct object {
+        uint64_t id;
+        registered_buffer buf; /* mr is the read-only registration */
+        uint64_t length;
+        int slot;
+    };
+    struct retired {
+        registered_buffer buf;
+        uint64_t deadline_ns;
+    };
+
+    rdma_mem_pool *pool;
+    struct ibv_pd *pd;
+    uint64_t capacity;
+    uint64_t cached_bytes = 0;
+    uint64_t next_id = 1;
+
+    std::vector<object_entry> directory;
+    struct ibv_mr *mr_directory = nullptr;
+    std::vector<int> free_slots;
+
+    std::list<object> lru; /* least recently uploaded first */
+    std::unordered_map<uint64_t, std::list<object>::iterator> by_id;
+    std::vector<retired> retiring;
+
+    /* counters */
+    uint64_t inserts = 0;
+    uint64_t replacements = 0;
+    uint64_t evictions = 0;
+    uint64_t rejected = 0;
+
+    void publish(int slot, const object_entry& value);
+    void retire(std::list<object>::iterator it);
+};
@@ -0,0 +1,378 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rdma_context.h"
+#include "rdma_pool.h"
+#include "rdma_server.h"
+
+#define TCP_PORT_OFFSET 23456
+#define TCP_PORT_RANGE 1000
+
+#define DEFAULT_DEVICE "rxe0"
+#define DEFAULT_SERVER_IP "127.0.0.1"
+#define DEFAULT_DURATION 2
+#define REG_REPEATS 5 /* registrations of the client's buffer timed per case */
+#define SESSION_POOL_SIZE 2 /* connections kept open in the pool runs */
+
+/* one line of a testing/testcase_* file. depth is an optional extra column */
+struct bench_case
+{
+    uint64_t msg_size;
+    int num_qps;
+    int timeout;
+    int mtu;
+    int depth;
+};
+
+struct bench_result
+{
+    double bw_gbits;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+    uint64_t transfers;
+    double reg_us; /* median ibv_reg_mr of the client's buffer */
+    page_backing backing; /* of that buffer */
+};
+
+static const char *backing_names[] = { "4k", "thp", "hugetlb" };
+
+/* How the client gets the session each transfer goes over: one for the whole
+ * run, a new one per transfer, or one from an rdma_client_pool */
+enum session_mode
+{
+    SESSION_REUSE,
+    SESSION_CONNECT,
+    SESSION_POOL,
+};
+
+static const char *session_names[] = { "reuse", "connect", "pool" };
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Read a testcase file: a header naming num_qps, msg_size, mtu and timeout
+ * (and optionally depth) in any order, then one case per line. Blank lines
+ * are skipped, as stat_tool.py does */
+static std::vector<bench_case> read_testcases(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("fopen() failed for testcases file");
+        exit(1);
+    }
+
+    std::vector<std::string> header;
+    std::vector<bench_case> cases;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        std::vector<std::string> fields;
+        for (char *tok = strtok(line, ",\r\n"); tok; tok = strtok(NULL, ",\r\n")) {
+            while (*tok == ' ')
+                tok++;
+            fields.push_back(tok);
+        }
+        if (fields.empty())
+            continue;
+        if (header.empty()) {
+            header = fields;
+            continue;
+        }
+
+        std::map<std::string, std::string> row;
+        for (size_t i = 0; i < fields.size() && i < header.size(); i++)
+            row[header[i]] = fields[i];
+        if (!row.count("num_qps") || !row.count("msg_size") || !row.count("mtu") || !row.count("timeout")) {
+            fprintf(stderr, "%s: expected fields num_qps, msg_size, mtu, timeout [, depth]\n", path);
+            exit(1);
+        }
+
+        bench_case c;
+        c.msg_size = strtoull(row["msg_size"].c_str(), NULL, 0);
+        c.num_qps = atoi(row["num_qps"].c_str());
+        c.timeout = atoi(row["timeout"].c_str());
+        c.mtu = atoi(row["mtu"].c_str());
+        c.depth = row.count("depth") ? atoi(row["depth"].c_str()) : MAX_OUTSTANDING_READS;
+        cases.push_back(c);
+    }
+    fclose(f);
+    return cases;
+}
+
+static double percentile_us(const std::vector<uint64_t>& sorted_ns, double p)
+{
+    if (sorted_ns.empty())
+        return 0;
+    size_t i = std::min(sorted_ns.size() - 1, (size_t)(p * sorted_ns.size()));
+    return sorted_ns[i] / 1e3;
+}
+
+/* Serve one benchmark client, then exit. Runs in a forked child, so it opens
+ * its own device context */
+static void run_server(uint16_t tcp_port, const transfer_config& config)
+{
+    auto server = std::make_unique<rdma_server_context>(tcp_port, config);
+    while (server->receive_file())
+        ;
+    server.reset();
+    fflush(stdout);
+    _exit(0);
+}
+
+/* Serve any number of benchmark clients, until the parent kills us */
+static void run_multi_server(uint16_t tcp_port, const transfer_config& config)
+{
+    rdma_server server(tcp_port, config);
+    server.run();
+    _exit(1);
+}
+
+/* Median time to register (and deregister) length bytes at buffer, on a
+ * device context of our own */
+static double time_registration(const transfer_config& config, char *buffer, size_t length)
+{
+    rdma_device dev(config.device_name, config.huge_page_size);
+    std::vector<uint64_t> samples;
+    for (int i = 0; i < REG_REPEATS; i++) {
+        uint64_t t0 = now_ns();
+        struct ibv_mr *mr = ibv_reg_mr(dev.pd, buffer, length, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+        if (!mr) {
+            throw_errno("ibv_reg_mr() failed for benchmark buffer");
+        }
+        samples.push_back(now_ns() - t0);
+        ibv_dereg_mr(mr);
+    }
+    std::sort(samples.begin(), samples.end());
+    return percentile_us(samples, 0.50);
+}
+
+/* Run send(id) back to back for duration seconds, each call one latency
+ * sample */
+static void time_transfers(const std::function<bool(int)>& send, uint64_t msg_size, int duration, bench_result *r)
+{
+    std::vector<uint64_t> samples;
+    uint64_t start = now_ns();
+    uint64_t end = start + duration * 1000000000ULL;
+    uint64_t now = start;
+    for (int id = 1; now < end; id++) {
+        uint64_t t0 = now;
+        if (!send(id)) {
+            fprintf(stderr, "transfer %d failed\n", id);
+            exit(1);
+        }
+        now = now_ns();
+        samples.push_back(now - t0);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    r->transfers = samples.size();
+    r->bw_gbits = msg_size * 8.0 * samples.size() / (now - start);
+    r->p50_us = percentile_us(samples, 0.50);
+    r->p99_us = percentile_us(samples, 0.99);
+    r->p999_us = percentile_us(samples, 0.999);
+}
+
+/* Send msg_size buffers back to back for duration seconds through the
+ * regular send path: request, chunked reads by the server, ack. Each
+ * transfer is one latency sample, and includes setting up its session
+ * unless that is reused. The buffer sits on the pages the pool would give
+ * it under config.huge_page_size */
+static bench_result run_client(uint16_t tcp_port, const transfer_config& config, uint64_t msg_size, int duration,
+                               session_mode session)
+{
+    bench_result r;
+    size_t length = std::max<uint64_t>(msg_size, 1);
+    size_t mapped;
+    char *buffer = alloc_pages(length, config.huge_page_size, &mapped, &r.backing);
+    /* the baseline: keep THP (enabled=always) out of the 4 KiB runs */
+    if (r.backing == PAGES_4K && length >= 4096)
+        madvise(buffer, length & ~4095UL, MADV_NOHUGEPAGE);
+    for (size_t i = 0; i < length; i++)
+        buffer[i] = (char)i;
+    r.reg_us = time_registration(config, buffer, length);
+
+    if (session == SESSION_REUSE) {
+        auto client = std::make_unique<rdma_client_context>(tcp_port, config);
+
+        /* the first send registers the buffer; keep it out of the samples */
+        client->send_buffer(0, buffer, msg_size);
+        time_transfers([&](int id) { return client->send_buffer(id, buffer, msg_size); }, msg_size, duration, &r);
+        client->invalidate_buffer(buffer, msg_size);
+    } else if (session == SESSION_CONNECT) {
+        /* device context, QPs, registration and handshake, every time */
+        time_transfers([&](int id) {
+            rdma_client_context client(tcp_port, config);
+            return client.send_buffer(id, buffer, msg_size);
+        }, msg_size, duration, &r);
+    } else {
+        rdma_client_pool pool(tcp_port, SESSION_POOL_SIZE, config);
+
+        /* hold one more connection than the pool has, so it opens another,
+         * and register the buffer on the device they share */
+        std::vector<std::unique_ptr<rdma_client_context>> held;
+        for (int i = 0; i <= SESSION_POOL_SIZE; i++) {
+            held.push_back(pool.acquire());
+            held.back()->send_buffer(0, buffer, msg_size);
+        }
+        for (auto& conn : held)
+            pool.release(std::move(conn));
+
+        time_transfers([&](int id) {
+            std::unique_ptr<rdma_client_context> conn = pool.acquire();
+            bool ok = conn->send_buffer(id, buffer, msg_size);
+            pool.release(std::move(conn));
+            return ok;
+        }, msg_size, duration, &r);
+
+        std::unique_ptr<rdma_client_context> conn = pool.acquire();
+        conn->invalidate_buffer(buffer, msg_size);
+        pool.release(std::move(conn));
+    }
+    free_pages(buffer, mapped);
+    return r;
+}
+
+/* multi_server: serve from an rdma_server rather than a single-session
+ * context, for clients that open more than one session */
+static bench_result run_case(const bench_case& c, uint16_t tcp_port, transfer_config config, int duration,
+                             session_mode session, bool multi_server)
+{
+    config.num_qps = c.num_qps;
+    config.path_mtu = c.mtu;
+    config.qp_timeout = c.timeout;
+    config.max_outstanding = c.depth;
+
+    /* no verbs resources are open across the fork */
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        if (multi_server)
+            run_multi_server(tcp_port, config);
+        run_server(tcp_port, config);
+    }
+
+    bench_result r = run_client(tcp_port, config, c.msg_size, duration, session);
+
+    int status;
+    if (multi_server && kill(pid, SIGTERM) < 0) {
+        perror("kill");
+        exit(1);
+    }
+    if (waitpid(pid, &status, 0) < 0 ||
+        (multi_server ? !WIFSIGNALED(status) || WTERMSIG(status) != SIGTERM
+                      : !WIFEXITED(status) || WEXITSTATUS(status))) {
+        fprintf(stderr, "benchmark server failed\n");
+        exit(1);
+    }
+    return r;
+}
+
+void parse_arguments(int argc, char **argv, const char **testcases, const char **output_file, int *duration,
+                     bool *compare_pages, bool *compare_sessions, transfer_config *config)
+{
+    if (argc < 2) {
+        printf("usage: %s <testcases csv> [output file] [duration] [device] [server ip] [pages|sessions]\n", argv[0]);
+        exit(1);
+    }
+    *testcases = argv[1];
+    *output_file = argc > 2 ? argv[2] : "rdma_bench.out";
+    *duration = argc > 3 ? atoi(argv[3]) : DEFAULT_DURATION;
+    if (argc > 4)
+        config->device_name = argv[4];
+    if (argc > 5)
+        config->server_ip = argv[5];
+    /* pages: run every case on 4 KiB pages, then on hugepages (RDMA_HUGE_PAGES
+     * or HUGE_PAGE_SIZE), both sides. Large msg_sizes show the difference, see
+     * testing/testcase_3_hugepages */
+    *compare_pages = argc > 6 && !strcmp(argv[6], "pages");
+    /* sessions: run every case with one session, with a new session per
+     * transfer, and with sessions from an rdma_client_pool, against a
+     * multi-client server. Small msg_sizes show the setup cost */
+    *compare_sessions = argc > 6 && !strcmp(argv[6], "sessions");
+}
+
+
+int main(int argc, char *argv[]) try {
+    const char *testcases, *output_file;
+    int duration;
+    bool compare_pages, compare_sessions;
+    transfer_config config;
+
+    /* defaults suit a Soft-RoCE device on this host, so server and client share it */
+    config.device_name = DEFAULT_DEVICE;
+    config.server_ip = DEFAULT_SERVER_IP;
+    /* the sweep measures the NIC; RDMA_SHM=1 measures the same-host path instead */
+    config.shared_memory = false;
+    load_config_env(&config);
+    parse_arguments(argc, argv, &testcases, &output_file, &duration, &compare_pages, &compare_sessions, &config);
+    config.verbose = false;
+    /* the sweep sets depth and MTU itself; don't let the probe retune them */
+    config.tune = false;
+
+    std::vector<bench_case> cases = read_testcases(testcases);
+
+    FILE *out = fopen(output_file, "w");
+    if (!out) {
+        perror("fopen() failed for output file");
+        exit(1);
+    }
+    /* stattool.out columns, then latency percentiles of single transfers,
+     * what backed the client's buffer with what registering it took, and
+     * how the client got its sessions */
+    fprintf(out, "msg_size,num_qps,timeout,mtu,bw_avg,lat_p50_us,lat_p99_us,lat_p999_us,depth,pages,reg_us,session\n");
+
+    std::vector<size_t> page_sizes = { config.huge_page_size };
+    if (compare_pages)
+        page_sizes = { 0, config.huge_page_size ? config.huge_page_size : HUGE_PAGE_SIZE };
+    std::vector<session_mode> sessions = { SESSION_REUSE };
+    if (compare_sessions)
+        sessions = { SESSION_REUSE, SESSION_CONNECT, SESSION_POOL };
+
+    srand(time(NULL));
+    uint16_t tcp_port = TCP_PORT_OFFSET + (rand() % TCP_PORT_RANGE);
+    for (size_t i = 0; i < cases.size(); i++) {
+        const bench_case& c = cases[i];
+        for (size_t p = 0; p < page_sizes.size(); p++) {
+            config.huge_page_size = page_sizes[p];
+            for (size_t m = 0; m < sessions.size(); m++) {
+                uint16_t port = tcp_port + (i * page_sizes.size() + p) * sessions.size() + m;
+                bench_result r = run_case(c, port, config, duration, sessions[m], compare_sessions);
+
+                printf("msg_size %" PRIu64 ", %d QPs, mtu %d, depth %d, %s pages, %s sessions: %.2f Gb/s, "
+                       "%" PRIu64 " transfers, p50 %.1f us, p99 %.1f us, p999 %.1f us, registration %.1f us\n",
+                       c.msg_size, c.num_qps, c.mtu, c.depth, backing_names[r.backing], session_names[sessions[m]],
+                       r.bw_gbits, r.transfers, r.p50_us, r.p99_us, r.p999_us, r.reg_us);
+                fprintf(out, "%" PRIu64 ",%d,%d,%d,%.2f,%.1f,%.1f,%.1f,%d,%s,%.1f,%s\n",
+                        c.msg_size, c.num_qps, c.timeout, c.mtu, r.bw_gbits, r.p50_us, r.p99_us, r.p999_us, c.depth,
+                        backing_names[r.backing], r.reg_us, session_names[sessions[m]]);
+                fflush(out);
+            }
+        }
+    }
+
+    fclose(out);
+    return 0;
+} catch (const rdma_error& e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+}
@@ -1,48 +1,136 @@
 #include "rdma_context.h"
+#include "delta.h"
+#include "object_cache.h"
+#include "stream_compressor.h"
+#include "stream_writer.h"
+
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <linux/fs.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include <zlib.h>
 
 
 static void print_file_request(file_request* req) {
-    printf("file request:\n\trequest_id=%d, rkey=%d, length=%d, addr=%p\n", req->request_id, req->rkey, req->length, (void*)req->addr);
+    printf("file request:\n\trequest_id=%d, rkey=%d, length=%" PRIu64 ", addr=%p\n", req->request_id, req->rkey, req->length, (void*)req->addr);
+}
+
+/* wr_id of the read of the client's checksums; chunk indexes stay below it */
+#define CRC_TABLE_WR_ID ((UINT64_C(1) << 56) - 1)
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_us()
+{
+    return now_ns() / 1000;
+}
+
+static inline uint64_t wr_bytes(const struct ibv_send_wr *wr)
+{
+    uint64_t bytes = 0;
+    for (int i = 0; i < wr->num_sge; i++)
+        bytes += wr->sg_list[i].length;
+    return bytes;
 }
 
-rdma_context::rdma_context(uint16_t tcp_port) : tcp_port(tcp_port) {}
+void load_config_env(transfer_config *config)
+{
+    const char *v;
+    if ((v = getenv("RDMA_DEVICE")))
+        config->device_name = v;
+    if ((v = getenv("RDMA_SERVER_IP")))
+        config->server_ip = v;
+    if ((v = getenv("RDMA_IB_PORT")))
+        config->ib_port = atoi(v);
+    if ((v = getenv("RDMA_GID_INDEX")))
+        config->gid_index = atoi(v);
+    if ((v = getenv("RDMA_MTU")))
+        config->path_mtu = atoi(v);
+    if ((v = getenv("RDMA_CHUNK_SIZE")))
+        config->chunk_size = strtoul(v, NULL, 0);
+    if ((v = getenv("RDMA_DEPTH")))
+        config->max_outstanding = atoi(v);
+    if ((v = getenv("RDMA_MAX_REQUESTS")))
+        config->max_requests = std::max(1, atoi(v));
+    if ((v = getenv("RDMA_QP_TIMEOUT")))
+        config->qp_timeout = atoi(v);
+    if ((v = getenv("RDMA_TUNE")))
+        config->tune = atoi(v);
+    if ((v = getenv("RDMA_VERIFY")))
+        config->verify = atoi(v);
+    if ((v = getenv("RDMA_COMPRESS")))
+        config->compress = atoi(v);
+    if ((v = getenv("RDMA_LINK_GBITS")))
+        config->link_gbits = atof(v);
+    if ((v = getenv("RDMA_WORKERS")))
+        config->num_workers = atoi(v);
+    if ((v = getenv("RDMA_DELTA")))
+        config->delta = atoi(v);
+    if ((v = getenv("RDMA_CACHE_BYTES")))
+        config->cache_bytes = strtoull(v, NULL, 0);
+    if ((v = getenv("RDMA_SHM")))
+        config->shared_memory = atoi(v);
+    if ((v = getenv("RDMA_HUGE_PAGES")))
+        config->huge_page_size = strtoull(v, NULL, 0);
+    if ((v = getenv("RDMA_TCP")))
+        config->tcp = atoi(v);
+    if ((v = getenv("RDMA_TCP_STREAMS")))
+        config->tcp_streams = atoi(v);
+    if ((v = getenv("RDMA_MAX_FILE_SIZE")))
+        config->max_file_size = strtoull(v, NULL, 0);
+}
+
+rdma_context::rdma_context(uint16_t tcp_port, const transfer_config& config) :
+    tcp_port(tcp_port), config(config) {}
 
 rdma_context::~rdma_context()
 {
-    /* cleanup */
-    ibv_destroy_qp(qp);
-    ibv_destroy_cq(cq);
-    ibv_dereg_mr(mr_requests);
-    ibv_dealloc_pd(pd);
-    ibv_close_device(context);
+    /* cleanup; the device itself goes away with the last rdma_context using it */
+    for (struct ibv_qp *q : qps)
+        ibv_destroy_qp(q);
+    if (cq && owns_cq)
+        ibv_destroy_cq(cq);
+    if (mr_requests)
+        ibv_dereg_mr(mr_requests);
+    if (channel)
+        ibv_destroy_comp_channel(channel);
 
     /* we don't need TCP anymore. kill the socket */
-    close(socket_fd);
+    if (socket_fd >= 0)
+        close(socket_fd);
 }
 
-void rdma_context::initialize_verbs(const char *device_name)
+rdma_device::rdma_device(const char *device_name, size_t huge_page_size)
 {
+    METRIC_SCOPE(PHASE_DEVICE_OPEN);
     printf("initializing ibverbs with device: %s\n", device_name);
 
     /* get device list */
     struct ibv_device **device_list = ibv_get_device_list(NULL);
     if (!device_list) {
-        perror("ibv_get_device_list failed");
-        exit(1);
+        throw_errno("ibv_get_device_list failed");
     }
 
     /* select device to work with */
     struct ibv_device *requested_dev = nullptr;
     for (int i = 0; device_list[i]; ++i)
-        if (strcmp(device_list[i]->name, device_name)) {
+        if (!strcmp(device_list[i]->name, device_name)) {
             requested_dev = device_list[i];
             break;
         }
-    if (!requested_dev)
+    if (!requested_dev && device_list[0]) {
+        printf("RDMA device '%s' not found, using '%s'\n", device_name, device_list[0]->name);
         requested_dev = device_list[0];
+    }
     if (!requested_dev) {
-        printf("Unable to find RDMA device '%s'\n", device_name);
-        exit(1);
+        throw_error("Unable to find RDMA device '%s'", device_name);
     }
 
     context = ibv_open_device(requested_dev);
@@ -53,81 +141,231 @@ void rdma_context::initialize_verbs(const char *device_name)
     /* create protection domain (PD) */
     pd = ibv_alloc_pd(context);
     if (!pd) {
-        perror("ibv_alloc_pd() failed");
-        exit(1);
+        throw_errno("ibv_alloc_pd() failed");
     }
     printf("    pd ptr:			%p\n", pd);
 
-    /* allocate a memory region for the file requests. */
-    mr_requests = ibv_reg_mr(pd, requests.begin(), sizeof(file_request) * MAX_NUM_REQUESTS, IBV_ACCESS_LOCAL_WRITE);
-    if (!mr_requests) {
-        perror("ibv_reg_mr() failed for requests");
-        exit(1);
+    if (ibv_query_device(context, &device_attr)) {
+        throw_errno("ibv_query_device() failed");
     }
-    printf("    file request mr ptr:	%p\n", mr_requests);
+    printf("    max_qp_rd_atom: %d, max_qp_init_rd_atom: %d\n", device_attr.max_qp_rd_atom, device_attr.max_qp_init_rd_atom);
+
+    mem_pool = std::make_unique<rdma_mem_pool>(pd, huge_page_size);
+}
+
+rdma_device::~rdma_device()
+{
+    mem_pool->print_stats();
+    mem_pool.reset();
+    ibv_dealloc_pd(pd);
+    ibv_close_device(context);
+}
+
+void rdma_context::initialize_verbs(const char *device_name)
+{
+    attach_device(std::make_shared<rdma_device>(device_name, config.huge_page_size));
+}
+
+void rdma_context::attach_device(std::shared_ptr<rdma_device> dev)
+{
+    device = dev;
+    context = dev->context;
+    pd = dev->pd;
+    device_attr = dev->device_attr;
+
+    if (ibv_query_port(context, config.ib_port, &port_attr)) {
+        throw_errno("ibv_query_port() failed");
+    }
+    printf("    port %d: active mtu %d, max mtu %d\n", config.ib_port, 128 << port_attr.active_mtu, 128 << port_attr.max_mtu);
+}
 
-    /* create completion queue (CQ). We'll use same CQ for both send and receive parts of the QP */
-    cq = ibv_create_cq(context, 2 * MAX_NUM_REQUESTS, NULL, NULL, 0); /* create a CQ with place for two completions per request */
+void rdma_context::create_qps(int num_qps)
+{
+    METRIC_SCOPE(PHASE_QP_CREATE);
+    num_qps = std::max(1, std::min(num_qps, MAX_NUM_QPS));
+
+    /* create completion queue (CQ), unless one was handed to us. We'll use same CQ for both send and receive parts of all QPs */
+    /* place for a send and a receive completion per request, plus one per in-flight read or pushed chunk on each QP */
+    recv_depth = config.max_requests + config.max_outstanding;
+    sq_depth = config.max_requests + config.max_outstanding;
+    if (!cq && config.spin_us >= 0)
+        use_completion_channel(); /* lets waiters sleep once they have spun long enough */
     if (!cq) {
-        perror("ibv_create_cq() failed");
-        exit(1);
+        cq = ibv_create_cq(context, num_qps * 2 * recv_depth, NULL, channel, 0);
+        if (!cq) {
+            throw_errno("ibv_create_cq() failed");
+        }
     }
     printf("    send & recv cq ptr:	%p\n", cq);
 
-    /* create QP */
+    /* create QPs */
     struct ibv_qp_init_attr qp_init_attr;
     memset(&qp_init_attr, 0, sizeof(struct ibv_qp_init_attr));
     qp_init_attr.send_cq = cq;
     qp_init_attr.recv_cq = cq;
     qp_init_attr.qp_type = IBV_QPT_RC; /* we'll use RC transport service, which supports RDMA */
-    qp_init_attr.cap.max_send_wr = MAX_NUM_REQUESTS; /* max of 1 WQE in-flight in SQ per request. that's enough for us */
-    qp_init_attr.cap.max_recv_wr = MAX_NUM_REQUESTS; /* max of 1 WQE in-flight in RQ per request. that's enough for us */
-    qp_init_attr.cap.max_send_sge = 1; /* 1 SGE in each send WQE */
-    qp_init_attr.cap.max_recv_sge = 1; /* 1 SGE in each recv WQE */
-    qp = ibv_create_qp(pd, &qp_init_attr);
-    if (!qp) {
-        perror("ibv_create_qp() failed");
-        exit(1);
+    qp_init_attr.cap.max_send_wr = sq_depth; /* 1 WQE per request, plus the read pipeline */
+    qp_init_attr.cap.max_recv_wr = recv_depth; /* 1 WQE per request, plus one per pushed chunk in flight */
+    qp_init_attr.cap.max_send_sge = std::max(1, std::min(device_attr.max_sge, MAX_SGE)); /* reads may scatter */
+    qp_init_attr.cap.max_recv_sge = 1; /* every receive is one file_request */
+    qp_init_attr.cap.max_inline_data = sizeof(file_request); /* control messages go inline */
+    if (srq) {
+        /* receives are taken from the SRQ; the QPs have no RQ of their own */
+        qp_init_attr.srq = srq;
+        qp_init_attr.cap.max_recv_wr = 0;
+        qp_init_attr.cap.max_recv_sge = 0;
+    }
+    for (int i = 0; i < num_qps; i++) {
+        struct ibv_qp *q = ibv_create_qp(pd, &qp_init_attr);
+        if (!q) {
+            throw_errno("ibv_create_qp() failed");
+        }
+        printf("    qp[%d] ptr:		%p\n", i, q);
+        qps.push_back(q);
+    }
+    qp = qps[0];
+    max_inline = qp_init_attr.cap.max_inline_data;
+    max_sge = qp_init_attr.cap.max_send_sge;
+    sqs.assign(num_qps, send_queue());
+    spin_limit_us = config.spin_us;
+
+    /* receive buffers, none with an SRQ (requests land in the shared receive
+     * pool instead), plus a last one to send from if the QPs can't inline */
+    size_t num_recv_buffers = srq ? 0 : num_qps * recv_depth;
+    if (!num_recv_buffers && max_inline >= sizeof(file_request))
+        return;
+
+    /* allocate a memory region for the file requests. */
+    requests.resize(num_recv_buffers + 1);
+    {
+        METRIC_SCOPE(PHASE_MR_REG);
+        mr_requests = ibv_reg_mr(pd, requests.data(), sizeof(file_request) * requests.size(), IBV_ACCESS_LOCAL_WRITE);
+    }
+    if (!mr_requests) {
+        throw_errno("ibv_reg_mr() failed for requests");
     }
-    printf("    qp ptr:			%p\n", qp);
+    printf("    file request mr ptr:	%p\n", mr_requests);
+}
+
+void rdma_context::use_completion_channel()
+{
+    if (channel)
+        return;
+    channel = ibv_create_comp_channel(context);
+    if (!channel) {
+        throw_errno("ibv_create_comp_channel() failed");
+    }
+    /* callers multiplex it with other fds and must never block on it */
+    fcntl(channel->fd, F_SETFL, fcntl(channel->fd, F_GETFL) | O_NONBLOCK);
+}
+
+void rdma_context::arm_cq()
+{
+    if (int ret = ibv_req_notify_cq(cq, 0)) {
+        errno = ret;
+        throw_errno("ibv_req_notify_cq() failed");
+    }
+}
+
+void rdma_context::consume_cq_events()
+{
+    struct ibv_cq *ev_cq;
+    void *ev_ctx;
+
+    while (!ibv_get_cq_event(channel, &ev_cq, &ev_ctx))
+        ibv_ack_cq_events(ev_cq, 1);
+}
+
+void rdma_context::signal_ready()
+{
+    char ready = 1;
+    send_over_socket(&ready, sizeof(ready));
+}
+
+void rdma_context::wait_ready()
+{
+    char ready;
+    recv_over_socket(&ready, sizeof(ready));
+}
+
+void rdma_context::use_shared_queues(struct ibv_cq *shared_cq, struct ibv_srq *shared_srq)
+{
+    cq = shared_cq;
+    owns_cq = false;
+    srq = shared_srq;
+}
+
+int rdma_context::qp_index(uint32_t qp_num) const
+{
+    for (size_t i = 0; i < qps.size(); i++)
+        if (qps[i]->qp_num == qp_num)
+            return i;
+    return -1;
 }
 
 void rdma_context::send_over_socket(void *buffer, size_t len)
 {
-    int ret = send(socket_fd, buffer, len, 0);
-    if (ret < 0) {
-        perror("send");
-        exit(1);
+    /* send() may write less than asked for; keep going until everything is out */
+    char *p = (char *)buffer;
+    while (len > 0) {
+        ssize_t ret = send(socket_fd, p, len, 0);
+        if (ret < 0) {
+            throw_errno("send");
+        }
+        p += ret;
+        len -= ret;
     }
 }
 
 void rdma_context::recv_over_socket(void *buffer, size_t len)
 {
-    int ret = recv(socket_fd, buffer, len, 0);
-    if (ret < 0) {
-        perror("recv");
-        exit(1);
+    char *p = (char *)buffer;
+    while (len > 0) {
+        ssize_t ret = recv(socket_fd, p, len, 0);
+        if (ret < 0) {
+            throw_errno("recv");
+        }
+        if (ret == 0) {
+            throw_error("recv: connection closed by peer");
+        }
+        p += ret;
+        len -= ret;
     }
 }
 
-void rdma_context::send_connection_establishment_data()
+connection_establishment_data rdma_context::local_connection_establishment_data()
 {
-    /* ok, before we continue we need to get info about the client' QP, and send it info about ours.
-     * namely: QP number, and LID/GID.
-     * we'll use the TCP socket for that */
-
     struct connection_establishment_data my_info = {};
     int ret;
 
     /* For RoCE, GID (IP address) must by used */
     // the third param is the gid table idx. We pass 0 because we want to query
     // our own port
-    ret = ibv_query_gid(context, IB_PORT, 0, &my_info.gid);
+    ret = ibv_query_gid(context, config.ib_port, config.gid_index, &my_info.gid);
     if (ret) {
-        perror("ibv_query_gid() failed");
-        exit(1);
+        throw_errno("ibv_query_gid() failed");
+    }
+    my_info.num_qps = qps.size();
+    for (size_t i = 0; i < qps.size(); i++)
+        my_info.qpn[i] = qps[i]->qp_num;
+    my_info.max_rd_atomic = device_attr.max_qp_rd_atom;
+    my_info.active_mtu = port_attr.active_mtu;
+    if (probe_buf.addr) {
+        my_info.probe_addr = (uintptr_t)probe_buf.addr;
+        my_info.probe_rkey = probe_buf.mr->rkey;
+        my_info.probe_length = PROBE_SIZE;
     }
-    my_info.qpn = qp->qp_num;
+    my_info.host = local_host_identity();
+    return my_info;
+}
+
+void rdma_context::send_connection_establishment_data()
+{
+    /* ok, before we continue we need to get info about the client' QP, and send it info about ours.
+     * namely: QP number, and LID/GID.
+     * we'll use the TCP socket for that */
+
+    struct connection_establishment_data my_info = local_connection_establishment_data();
     send_over_socket(&my_info, sizeof(connection_establishment_data));
     print_connection_establishment_data("local ", my_info);
 }
@@ -152,10 +390,71 @@ void rdma_context::print_connection_establishment_data(const char *type, const c
 
     inet_ntop(AF_INET6, &data.gid, address, sizeof(address));
 
-    printf("%s address:  %s, QPN 0x%06x\n", type, address, data.qpn);
+    printf("%s address:  %s, %d QPs, QPN 0x%06x, max_rd_atomic %d, mtu %d\n", type, address, data.num_qps, data.qpn[0],
+           data.max_rd_atomic, 128 << data.active_mtu);
+}
+
+/* largest ibv_mtu not above bytes */
+static enum ibv_mtu mtu_from_bytes(int bytes)
+{
+    enum ibv_mtu m = IBV_MTU_256;
+    while (m < IBV_MTU_4096 && (128 << (m + 1)) <= bytes)
+        m = (enum ibv_mtu)(m + 1);
+    return m;
 }
 
 void rdma_context::connect_qp(const connection_establishment_data &remote_info)
+{
+    METRIC_SCOPE(PHASE_QP_CONNECT);
+    if (remote_info.num_qps != (int)qps.size()) {
+        throw_error("QP count mismatch: %zu local, %d remote", qps.size(), remote_info.num_qps);
+    }
+
+    /* max in-flight RDMA reads we issue: bounded by our initiator depth and
+     * by what the remote side accepts as responder */
+    rd_depth = std::max(1, std::min(device_attr.max_qp_init_rd_atom, remote_info.max_rd_atomic));
+
+    /* both sides pick the same: the largest MTU active on both ports, under the configured cap */
+    mtu = std::min(port_attr.active_mtu, (enum ibv_mtu)remote_info.active_mtu);
+    if (config.path_mtu)
+        mtu = std::min(mtu, mtu_from_bytes(config.path_mtu));
+    printf("    path mtu %d, %d reads in flight per QP\n", 128 << mtu, rd_depth);
+
+    for (size_t i = 0; i < qps.size(); i++)
+        connect_one_qp(qps[i], remote_info.qpn[i], remote_info);
+
+    post_receives();
+    select_transport(remote_info);
+}
+
+void rdma_context::select_transport(const connection_establishment_data& remote_info)
+{
+    host_identity me = local_host_identity();
+    if (!config.shared_memory || !same_host(me, remote_info.host))
+        return;
+
+    /* under Yama's ptrace_scope 1 only a process we name may read and write
+     * our memory: the peer. Without Yama this fails and isn't needed */
+    if (remote_info.host.pid != me.pid)
+        prctl(PR_SET_PTRACER, remote_info.host.pid, 0, 0, 0);
+
+    std::vector<uint32_t> qp_nums;
+    for (struct ibv_qp *q : qps)
+        qp_nums.push_back(q->qp_num);
+    data_path.reset(new shm_transport(remote_info.host.pid, qp_nums, std::move(data_path)));
+    printf("    peer pid %d is on this host: data through shared memory\n", remote_info.host.pid);
+}
+
+void rdma_context::post_receives()
+{
+    /* now let's populate the receive QPs with recv WQEs. With an SRQ, its owner keeps it stocked */
+    if (!srq)
+        for (size_t i = 0; i + 1 < requests.size(); i++) {
+            post_recv(i);
+        }
+}
+
+void rdma_context::connect_one_qp(struct ibv_qp *qp, int remote_qpn, const connection_establishment_data &remote_info)
 {
     /* this is a multi-phase process, moving the state machine of the QP step by step
      * until we are ready */
@@ -165,52 +464,44 @@ void rdma_context::connect_qp(const connection_establishment_data &remote_info)
     memset(&qp_attr, 0, sizeof(struct ibv_qp_attr));
     qp_attr.qp_state = IBV_QPS_INIT;
     qp_attr.pkey_index = 0;
-    qp_attr.port_num = IB_PORT;
+    qp_attr.port_num = config.ib_port;
     qp_attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ; /* we'll allow client to RDMA write and read on this QP */
     int ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
     if (ret) {
-        perror("ibv_modify_qp() to INIT failed");
-        exit(1);
+        throw_errno("ibv_modify_qp() to INIT failed");
     }
 
     /*QP: state: INIT -> RTR (Ready to Receive) */
     memset(&qp_attr, 0, sizeof(struct ibv_qp_attr));
     qp_attr.qp_state = IBV_QPS_RTR;
-    qp_attr.path_mtu = IBV_MTU_1024;
-    qp_attr.dest_qp_num = remote_info.qpn; /* qp number of the remote side */
+    qp_attr.path_mtu = mtu;
+    qp_attr.dest_qp_num = remote_qpn; /* qp number of the remote side */
     qp_attr.rq_psn      = 0 ;
-    qp_attr.max_dest_rd_atomic = 1; /* max in-flight RDMA reads */
+    qp_attr.max_dest_rd_atomic = device_attr.max_qp_rd_atom; /* max in-flight RDMA reads the remote side may issue to us */
     qp_attr.min_rnr_timer = 12;
     qp_attr.ah_attr.grh.dgid = remote_info.gid; /* GID (L3 address) of the remote side */
-    qp_attr.ah_attr.grh.sgid_index = GID_ID;
+    qp_attr.ah_attr.grh.sgid_index = config.gid_index;
     qp_attr.ah_attr.grh.hop_limit = 1;
     qp_attr.ah_attr.is_global = 1;
     qp_attr.ah_attr.sl = 0;
     qp_attr.ah_attr.src_path_bits = 0;
-    qp_attr.ah_attr.port_num = IB_PORT;
+    qp_attr.ah_attr.port_num = config.ib_port;
     ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
     if (ret) {
-        perror("ibv_modify_qp() to RTR failed");
-        exit(1);
+        throw_errno("ibv_modify_qp() to RTR failed");
     }
 
     /*QP: state: RTR -> RTS (Ready to Send) */
     memset(&qp_attr, 0, sizeof(struct ibv_qp_attr));
     qp_attr.qp_state = IBV_QPS_RTS;
     qp_attr.sq_psn = 0;
-    qp_attr.timeout = 14;
+    qp_attr.timeout = config.qp_timeout;
     qp_attr.retry_cnt = 7; // 7 means infinite
     qp_attr.rnr_retry = 7; // 7 means infinite
-    qp_attr.max_rd_atomic = 16;
+    qp_attr.max_rd_atomic = rd_depth;
     ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC);
     if (ret) {
-        perror("ibv_modify_qp() to RTS failed");
-        exit(1);
-    }
-
-    /* now let's populate the receive QP with recv WQEs */
-    for (int i = 0; i < MAX_NUM_REQUESTS; i++) {
-        post_recv(i);
+        throw_errno("ibv_modify_qp() to RTS failed");
     }
 }
 
@@ -219,7 +510,7 @@ void rdma_context::post_recv(int index)
     struct ibv_recv_wr recv_wr = {}, *bad_wr; /* this is the receive work request (the verb's representation for receive WQE) */
     ibv_sge sgl = {};
 
-    recv_wr.wr_id = index;
+    recv_wr.wr_id = WR_ID(WR_RECV, index >= 0 ? index : 0);
     if (index >= 0) {
         sgl.addr = (uintptr_t)&requests[index];
         sgl.length = sizeof(requests[0]);
@@ -227,14 +518,14 @@ void rdma_context::post_recv(int index)
     }
     recv_wr.sg_list = &sgl;
     recv_wr.num_sge = 1;
-    if (int ret = ibv_post_recv(qp, &recv_wr, &bad_wr)) {
+    if (int ret = ibv_post_recv(index >= 0 ? qps[index / recv_depth] : qp, &recv_wr, &bad_wr)) {
 	errno = ret;
-        perror("ibv_post_recv() failed");
-        exit(1);
+        throw_errno("ibv_post_recv() failed");
     }
 }
 
-void rdma_context::post_rdma_read(void *local_dst, uint32_t len, uint32_t lkey, uint64_t remote_src, uint32_t rkey, uint64_t wr_id)
+void rdma_context::post_rdma_read(void *local_dst, uint32_t len, uint32_t lkey, uint64_t remote_src, uint32_t rkey, uint64_t wr_id,
+                                  int qp_idx, bool force_signal)
 {
     ibv_sge sgl = {
         (uint64_t)(uintptr_t)local_dst,
@@ -242,26 +533,18 @@ void rdma_context::post_rdma_read(void *local_dst, uint32_t len, uint32_t lkey,
         lkey
     };
 
-    ibv_send_wr send_wr = {};
-    ibv_send_wr *bad_send_wr;
-
-    send_wr.opcode = IBV_WR_RDMA_READ;
-    send_wr.wr_id = wr_id;
-    send_wr.sg_list = &sgl;
-    send_wr.num_sge = 1;
-    send_wr.send_flags = IBV_SEND_SIGNALED;
-    send_wr.wr.rdma.remote_addr = remote_src;
-    send_wr.wr.rdma.rkey = rkey;
+    post_rdma_read(&sgl, 1, remote_src, rkey, wr_id, qp_idx, force_signal);
+}
 
-    if (ibv_post_send(qp, &send_wr, &bad_send_wr)) {
-	perror("ibv_post_send() failed");
-	exit(1);
-    }
+void rdma_context::post_rdma_read(const ibv_sge *sgl, int num_sge, uint64_t remote_src, uint32_t rkey, uint64_t wr_id,
+                                  int qp_idx, bool force_signal)
+{
+    data_path->post_read(sgl, num_sge, remote_src, rkey, wr_id, qp_idx, force_signal);
 }
 
 void rdma_context::post_rdma_write(uint64_t remote_dst, uint32_t len, uint32_t rkey,
 		     void *local_src, uint32_t lkey, uint64_t wr_id,
-		     uint32_t *immediate)
+		     uint32_t *immediate, int qp_idx, bool force_signal)
 {
     ibv_sge sgl = {
         (uint64_t)(uintptr_t)local_src,
@@ -269,8 +552,28 @@ void rdma_context::post_rdma_write(uint64_t remote_dst, uint32_t len, uint32_t r
         lkey
     };
 
+    data_path->post_write(&sgl, 1, remote_dst, rkey, wr_id, immediate, qp_idx, force_signal);
+}
+
+void verbs_transport::post_read(const ibv_sge *sgl, int num_sge, uint64_t remote, uint32_t rkey, uint64_t wr_id,
+                                int lane, bool signal)
+{
+    ibv_send_wr send_wr = {};
+
+    send_wr.opcode = IBV_WR_RDMA_READ;
+    send_wr.wr_id = wr_id;
+    send_wr.sg_list = (ibv_sge *)sgl;
+    send_wr.num_sge = num_sge;
+    send_wr.wr.rdma.remote_addr = remote;
+    send_wr.wr.rdma.rkey = rkey;
+
+    ctx->post_send(lane, &send_wr, WR_READ, signal);
+}
+
+void verbs_transport::post_write(const ibv_sge *sgl, int num_sge, uint64_t remote, uint32_t rkey, uint64_t wr_id,
+                                 const uint32_t *immediate, int lane, bool signal)
+{
     ibv_send_wr send_wr = {};
-    ibv_send_wr *bad_send_wr;
 
     if (immediate) {
         send_wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
@@ -279,73 +582,294 @@ void rdma_context::post_rdma_write(uint64_t remote_dst, uint32_t len, uint32_t r
         send_wr.opcode = IBV_WR_RDMA_WRITE;
     }
     send_wr.wr_id = wr_id;
-    send_wr.sg_list = &sgl;
-    send_wr.num_sge = 1;
-    send_wr.send_flags = IBV_SEND_SIGNALED;
-    send_wr.wr.rdma.remote_addr = remote_dst;
+    send_wr.sg_list = (ibv_sge *)sgl;
+    send_wr.num_sge = num_sge;
+    send_wr.wr.rdma.remote_addr = remote;
     send_wr.wr.rdma.rkey = rkey;
 
-    if (ibv_post_send(qp, &send_wr, &bad_send_wr)) {
-	perror("ibv_post_send() failed");
-	exit(1);
-    }
+    ctx->post_send(lane, &send_wr, WR_WRITE, signal);
 }
 
-bool rdma_context::poll_cq() {
-    struct ibv_wc wc;
-    int num_completions;
+void rdma_context::post_send(int qp_idx, struct ibv_send_wr *wr, int kind, bool force_signal)
+{
+    send_queue& sq = sqs[qp_idx];
+    ibv_send_wr *bad_send_wr;
 
-    // Poll the CQ until an event is received
-    while ((num_completions = ibv_poll_cq(cq, 1, &wc)) == 0);
+    /* unsignaled WRs hold their SQ slot until a later signaled one completes.
+     * On a CQ shared with other connections, drain_cq() polls for all of them */
+    while ((int)sq.posted.size() >= sq_depth)
+        wait_completions();
+
+    /* the WR that fills the SQ is always signaled, so a full SQ always drains */
+    int interval = std::max(1, std::min(config.signal_interval, sq_depth));
+    bool signaled = force_signal || ++sq.unsignaled >= interval || (int)sq.posted.size() + 1 >= sq_depth;
+    if (signaled) {
+        wr->send_flags |= IBV_SEND_SIGNALED;
+        sq.unsignaled = 0;
+    }
 
-    if (num_completions < 0) {
-        perror("Error polling CQ");
+    uint64_t wr_id = wr->wr_id;
+    wr->wr_id = WR_ID(kind, wr_id);
+    if (int ret = ibv_post_send(qps[qp_idx], wr, &bad_send_wr)) {
+        errno = ret;
+        throw_errno("ibv_post_send() failed");
     }
+    sq.posted.push_back({ wr_id, kind, signaled });
+    METRIC_ADD(CTR_WRS_POSTED, 1);
+    METRIC_ADD(CTR_WRS_SIGNALED, signaled);
+    if (kind == WR_READ)
+        METRIC_ADD(CTR_BYTES_READ, wr_bytes(wr));
+    else if (kind == WR_WRITE)
+        METRIC_ADD(CTR_BYTES_WRITTEN, wr_bytes(wr));
+    else
+        METRIC_ADD(CTR_MESSAGES_SENT, 1);
+}
 
-    if (wc.status == IBV_WC_SUCCESS) {
-        printf("RDMA Read completed successfully!\n");
-        return true;
+void rdma_context::send_message(const file_request& msg, bool wait)
+{
+    ibv_sge sgl = {
+        (uint64_t)(uintptr_t)&msg,
+        sizeof(msg),
+        0 /* inline data needs no lkey */
+    };
+
+    ibv_send_wr send_wr = {};
+
+    send_wr.opcode = IBV_WR_SEND;
+    send_wr.sg_list = &sgl;
+    send_wr.num_sge = 1;
+    if (sizeof(msg) <= max_inline) {
+        send_wr.send_flags = IBV_SEND_INLINE;
     } else {
-        fprintf(stderr, "RDMA Read failed: %d\n", wc.status);
+        /* no inline support: send out of the last receive buffer, which is
+         * never posted, and wait so the next message may reuse it */
+        requests.back() = msg;
+        sgl.addr = (uintptr_t)&requests.back();
+        sgl.lkey = mr_requests->lkey;
+        wait = true;
+    }
+
+    post_send(0, &send_wr, WR_MESSAGE, wait);
+
+    /* the SEND is the newest WR on qps[0] and signaled: it retires last */
+    while (wait && !sqs[0].posted.empty())
+        wait_completions();
+}
+
+bool rdma_context::try_recv_message(file_request *msg)
+{
+    if (inbox.empty())
+        drain_cq();
+    if (inbox.empty())
         return false;
+
+    *msg = inbox.front();
+    inbox.pop_front();
+    return true;
+}
+
+void rdma_context::recv_message(file_request *msg)
+{
+    while (!try_recv_message(msg))
+        wait_completions();
+}
+
+int rdma_context::poll_cq(struct ibv_wc *wc, int num_entries)
+{
+    if (pending_wcs.empty())
+        drain_cq();
+
+    int n = 0;
+    while (n < num_entries && !pending_wcs.empty()) {
+        wc[n++] = pending_wcs.front();
+        pending_wcs.pop_front();
+    }
+    return n;
+}
+
+int rdma_context::drain_cq()
+{
+    struct ibv_wc wc[CQ_POLL_BATCH];
+    int num_completions = ibv_poll_cq(cq, CQ_POLL_BATCH, wc);
+    if (num_completions < 0) {
+        throw_errno("Error polling CQ");
+    }
+    for (int i = 0; i < num_completions; i++)
+        process_completion(wc[i]);
+    METRIC_ADD(CTR_CQES, num_completions);
+    return num_completions + data_path->poll(pending_wcs);
+}
+
+void rdma_context::process_completion(const struct ibv_wc& wc)
+{
+    if (wc.status != IBV_WC_SUCCESS) {
+        METRIC_ADD(CTR_ERRORS, 1);
+        completion_error(wc);
+        return;
+    }
+
+    uint64_t id = WR_USER_ID(wc.wr_id);
+    if (WR_KIND(wc.wr_id) == WR_RECV) {
+        if (wc.opcode == IBV_WC_RECV) {
+            /* a control message: queue it and give the buffer back right away */
+            inbox.push_back(requests[id]);
+            METRIC_ADD(CTR_MESSAGES_RECEIVED, 1);
+            post_recv(id);
+        } else {
+            /* a write with immediate; its receive is reposted by the data path */
+            struct ibv_wc data = wc;
+            data.wr_id = id;
+            pending_wcs.push_back(data);
+        }
+        return;
+    }
+
+    /* retire every WR of the QP up to this signaled one, in posting order */
+    int q = qp_index(wc.qp_num);
+    if (q < 0) {
+        throw_error("completion on unknown QP 0x%06x", wc.qp_num);
+    }
+    send_queue& sq = sqs[q];
+    while (!sq.posted.empty()) {
+        posted_wr wr = sq.posted.front();
+        sq.posted.pop_front();
+        if (wr.kind == WR_READ || wr.kind == WR_WRITE) {
+            struct ibv_wc data = {};
+            data.wr_id = wr.wr_id;
+            data.status = IBV_WC_SUCCESS;
+            data.opcode = wr.kind == WR_READ ? IBV_WC_RDMA_READ : IBV_WC_RDMA_WRITE;
+            data.qp_num = wc.qp_num;
+            pending_wcs.push_back(data);
+        }
+        if (wr.signaled)
+            break;
+    }
+}
+
+void rdma_context::completion_error(const struct ibv_wc& wc)
+{
+    throw_error("work completion failed: kind %d, wr_id %" PRIu64 ", qp 0x%06x, status %s",
+                WR_KIND(wc.wr_id), WR_USER_ID(wc.wr_id), wc.qp_num, ibv_wc_status_str(wc.status));
+}
+
+void rdma_context::wait_reads(int count)
+{
+    while (count > 0) {
+        struct ibv_wc wc[MAX_OUTSTANDING_READS];
+        int n = poll_cq(wc, std::min(count, MAX_OUTSTANDING_READS));
+        if (!n)
+            wait_completions();
+        for (int i = 0; i < n; i++)
+            if (wc[i].opcode == IBV_WC_RDMA_READ)
+                count--;
+    }
+}
+
+void rdma_context::wait_completions()
+{
+    /* under load the next completion shows up while we spin */
+    uint64_t start = now_us();
+    do {
+        if (drain_cq()) {
+            spin_limit_us = config.spin_us;
+            return;
+        }
+    } while (!channel || (int64_t)(now_us() - start) < spin_limit_us);
+
+    /* idle: sleep until the CQ raises an event. A CQE that raced the
+     * arming is caught by the poll right after it */
+    arm_cq();
+    if (drain_cq())
+        return;
+    struct pollfd pfd = { channel->fd, POLLIN, 0 };
+    uint64_t slept = now_us();
+    {
+        METRIC_SCOPE(PHASE_CQ_SLEEP);
+        while (poll(&pfd, 1, -1) < 0) {
+            if (errno != EINTR) {
+                throw_errno("poll() on completion channel failed");
+            }
+        }
     }
+    consume_cq_events();
+
+    /* short sleeps would have been cheaper spun through; long ones mean
+     * the load is light and spinning is wasted */
+    if ((int64_t)(now_us() - slept) < config.spin_us)
+        spin_limit_us = config.spin_us;
+    else
+        spin_limit_us /= 2;
+    drain_cq();
 }
 
 ////////////////////////////////////////////////////////////////////////
 //////////////////////////// SERVER CONTEXT ////////////////////////////
 ////////////////////////////////////////////////////////////////////////
 
-rdma_server_context::rdma_server_context(uint16_t tcp_port) :
-    rdma_context(tcp_port)
+rdma_server_context::rdma_server_context(uint16_t tcp_port, const transfer_config& config) :
+    rdma_context(tcp_port, config)
 {
     /* Create a TCP connection to exchange InfiniBand parameters */
     tcp_connection();
 
     /* Open up some InfiniBand resources */
-    initialize_verbs(IB_DEVICE_NAME);
+    initialize_verbs(config.device_name);
 
-    /* exchange InfiniBand parameters with the server */
+    /* exchange InfiniBand parameters with the server. The client picks the number of QPs */
     connection_establishment_data client_info = recv_connection_establishment_data();
+    create_qps(client_info.num_qps);
     send_connection_establishment_data();
 
     /* now need to connect the QP to the client's QP. */
     connect_qp(client_info);
+
+    /* the client keeps its probe buffer until we are ready */
+    if (config.tune)
+        probe_path(client_info);
+
+    /* from here on, messages go over the QP; TCP was only needed for bootstrap */
+    signal_ready();
 }
 
+rdma_server_context::rdma_server_context(int socket_fd, std::shared_ptr<rdma_device> dev, const transfer_config& config) :
+    rdma_context(0, config)
+{
+    this->socket_fd = socket_fd;
+    attach_device(dev);
+}
+
+
 rdma_server_context::~rdma_server_context()
 {
-    ibv_dereg_mr(mr_file);
-    free(file);
-    close(listen_fd);
+    release_file();
+    if (listen_fd >= 0)
+        close(listen_fd);
+}
+
+void rdma_server_context::release_file()
+{
+    if (out_fd >= 0) {
+        if (mr_file)
+            ibv_dereg_mr(mr_file);
+        if (file)
+            munmap(file, file_length);
+        close(out_fd);
+        out_fd = -1;
+    }
+    device->mem_pool->put(file_buf);
+    file_buf = registered_buffer();
+    mr_file = nullptr;
+    file = nullptr;
+    file_length = 0;
 }
 
 void rdma_server_context::tcp_connection()
 {
+    METRIC_SCOPE(PHASE_TCP_CONNECT);
     /* setup a TCP connection for initial negotiation with client */
     int lfd = socket(AF_INET, SOCK_STREAM, 0);
     if (lfd < 0) {
-        perror("socket");
-        exit(1);
+        throw_errno("socket");
     }
     listen_fd = lfd;
 
@@ -357,75 +881,862 @@ void rdma_server_context::tcp_connection()
 
     int one = 1;
     if (setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
-        perror("SO_REUSEADDR");
-        exit(1);
+        throw_errno("SO_REUSEADDR");
     }
 
     if (bind(lfd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in)) < 0) {
-        perror("bind");
-        exit(1);
+        throw_errno("bind");
     }
 
     if (listen(lfd, 1)) {
-        perror("listen");
-        exit(1);
+        throw_errno("listen");
     }
 
     printf("Server waiting on port %d. Client can connect\n", tcp_port);
 
     int sfd = accept(lfd, NULL, NULL);
     if (sfd < 0) {
-        perror("accept");
-        exit(1);
+        throw_errno("accept");
     }
     printf("client connected successfully\n");
     socket_fd = sfd;
 }
 
 
-void rdma_server_context::receive_file()  {
+bool rdma_server_context::receive_file()  {
+
+
+    file_request req;
+    recv_message(&req);
+    if (req.request_id == -1)
+        return false;
+    if (req.type == REQ_DIRECTORY) {
+        /* only rdma_server keeps an object cache */
+        req.length = 0;
+        send_message(req);
+        return true;
+    }
+    METRIC_SCOPE(PHASE_TRANSFER);
+    request_id = req.request_id;
+
+    if (req.flags & FILE_REQUEST_STREAM) {
+        receive_stream(req);
+        return true;
+    }
+    if (req.flags & FILE_REQUEST_DELTA) {
+        receive_delta(req);
+        return true;
+    }
+    if (req.flags & FILE_REQUEST_BATCH) {
+        receive_batch(req);
+        return true;
+    }
+
+    begin_receive(req);
+    if (push_mode) {
+        /* tell the client where to write */
+        file_request target = req;
+        target.type = REQ_PUSH_TARGET;
+        target.addr = (uint64_t)file;
+        target.rkey = mr_file ? mr_file->rkey : 0;
+        target.num_slots = config.max_outstanding;
+        send_message(target);
+    }
+    drive_receive();
+    finish_receive();
+
+    /* let the client know it may release its buffer */
+    req.type = REQ_ACK;
+    if (corrupt)
+        req.flags |= FILE_ACK_CORRUPT;
+    send_message(req);
+    return true;
+}
+
+void rdma_server_context::drive_receive()
+{
+    while (!receive_done()) {
+        struct ibv_wc wc[MAX_OUTSTANDING_READS];
+        int n = poll_cq(wc, MAX_OUTSTANDING_READS);
+        if (!n)
+            wait_completions();
+        for (int i = 0; i < n; i++)
+            handle_data_completion(wc[i]);
+        take_transfer_messages();
+        post_reads();
+        verify_chunks();
+    }
+}
+
+void rdma_server_context::receive_stream(const file_request& req)
+{
+    if (config.verbose)
+        print_file_request((file_request *)&req);
+
+    /* the client's ring: we read from its slots into ours, which the
+     * writer's O_DIRECT writes need aligned */
+    if (!req.slot_size || req.slot_size % DIRECT_IO_ALIGN || req.slot_size > STREAM_MAX_SLOT_SIZE) {
+        throw_error("request %d: invalid stream slot size %u", req.request_id, req.slot_size);
+    }
+    if (!req.num_slots || req.num_slots > STREAM_MAX_SLOTS) {
+        throw_error("request %d: invalid stream slot count %u", req.request_id, req.num_slots);
+    }
+    if (req.length > config.max_file_size) {
+        throw_error("request %d: %" PRIu64 " bytes, more than the %" PRIu64 " allowed", req.request_id, req.length,
+                    config.max_file_size);
+    }
+
+    uint64_t slot_size = req.slot_size;
+    int num_slots = std::max(1, config.stream_slots);
+    uint64_t num_segments = (req.length + slot_size - 1) / slot_size;
+
+    registered_buffer ring = device->mem_pool->get(slot_size * num_slots);
+    std::vector<int> free_slots;
+    for (int i = num_slots - 1; i >= 0; i--)
+        free_slots.push_back(i);
+    std::vector<uint64_t> slot_segment(num_slots); /* segment being read into / written from each slot */
+
+    stream_writer writer(output_path(req).c_str());
+
+    int window = std::max(1, std::min(config.max_outstanding, rd_depth));
+    qp_stats.assign(qps.size(), {});
+    uint64_t announced = 0; /* segments the client has put in its ring */
+    uint64_t next_segment = 0; /* next segment to read */
+    uint64_t written = 0;
+    std::vector<int> reaped;
+    /* checksums of the segments announced, by client slot */
+    std::vector<uint32_t> segment_crc(req.num_slots);
+    bool stream_corrupt = false;
+    /* bytes to read and, for a deflated segment, its size once inflated, by client slot */
+    std::vector<uint32_t> segment_wire(segment_crc.size()), segment_raw(segment_crc.size());
+    /* deflated segments are inflated into the twin of their slot, and written from there */
+    registered_buffer plain_ring;
+    if (req.flags & FILE_REQUEST_COMPRESS)
+        plain_ring = device->mem_pool->get(slot_size * num_slots);
+
+    while (written < num_segments) {
+        /* the client fills its ring in order, so announcements are cumulative */
+        file_request msg;
+        while (try_recv_message(&msg))
+            if (msg.type == REQ_STREAM_DATA) {
+                if (msg.addr >= num_segments || msg.length > slot_size || msg.slot_size > slot_size) {
+                    throw_error("request %d: invalid stream segment %" PRIu64 " of %" PRIu64 " bytes",
+                                req.request_id, msg.addr, msg.length);
+                }
+                announced = std::max(announced, msg.addr + 1);
+                segment_crc[msg.addr % segment_crc.size()] = msg.crc;
+                segment_wire[msg.addr % segment_wire.size()] = msg.length;
+                segment_raw[msg.addr % segment_raw.size()] = msg.slot_size;
+            }
+
+        /* slots that reached the disk can take new reads */
+        reaped.clear();
+        writer.reap(reaped);
+        free_slots.insert(free_slots.end(), reaped.begin(), reaped.end());
+        written += reaped.size();
+
+        while (next_segment < announced && !free_slots.empty()) {
+            int q = next_qp;
+            if (qp_stats[q].reads_in_flight >= window)
+                break;
+            next_qp = (next_qp + 1) % qps.size();
+
+            int slot = free_slots.back();
+            free_slots.pop_back();
+            slot_segment[slot] = next_segment;
+
+            uint32_t len = segment_wire[next_segment % segment_wire.size()];
+            post_rdma_read(
+                ring.addr + slot * slot_size,                           // local_dst
+                len,                                                    // len
+                ring.mr->lkey,                                          // lkey
+                req.addr + (next_segment % req.num_slots) * slot_size,  // remote_src: client ring slot
+                req.rkey,                                               // rkey
+                slot,                                                   // wr_id
+                q,                                                      // qp_idx
+                true);                                                  // each slot is handled on its own
+            qp_stats[q].reads_in_flight++;
+            next_segment++;
+        }
+
+        /* no waiting on the CQ here: the writer thread frees slots too */
+        struct ibv_wc wc[MAX_OUTSTANDING_READS];
+        int n = poll_cq(wc, MAX_OUTSTANDING_READS);
+        for (int i = 0; i < n; i++) {
+            if (wc[i].opcode != IBV_WC_RDMA_READ)
+                continue;
+            int slot = wc[i].wr_id;
+            uint64_t segment = slot_segment[slot];
+            uint64_t offset = segment * slot_size;
+            uint32_t len = std::min<uint64_t>(slot_size, req.length - offset);
+            qp_stats[qp_index(wc[i].qp_num)].reads_in_flight--;
+
+            char *data = ring.addr + slot * slot_size;
+            if (uint32_t raw_len = segment_raw[segment % segment_raw.size()]) {
+                char *plain = plain_ring.addr + slot * slot_size;
+                uLongf plain_len = slot_size;
+                if (uncompress((Bytef *)plain, &plain_len, (const Bytef *)data, segment_wire[segment % segment_wire.size()]) != Z_OK ||
+                    plain_len != len || raw_len != len) {
+                    fprintf(stderr, "request %d: segment %" PRIu64 " doesn't inflate to %u bytes\n", req.request_id, segment, len);
+                    stream_corrupt = true;
+                }
+                data = plain;
+            }
+
+            /* check it before the client may reuse its slot, while it is still in cache */
+            if ((req.flags & FILE_REQUEST_CRC) && crc32c(0, data, len) != segment_crc[segment % segment_crc.size()]) {
+                fprintf(stderr, "request %d: CRC mismatch in segment %" PRIu64 "\n", req.request_id, segment);
+                stream_corrupt = true;
+            }
+
+            /* the client may refill its slot now; ours goes to disk */
+            file_request free_msg = {};
+            free_msg.type = REQ_STREAM_FREE;
+            free_msg.request_id = req.request_id;
+            free_msg.addr = segment;
+            send_message(free_msg);
+
+            writer.submit(slot, data, offset, len);
+        }
+    }
+
+    writer.finish(req.length);
+    device->mem_pool->put(ring);
+    device->mem_pool->put(plain_ring);
+    file_length = req.length;
+    if (config.verbose)
+        printf("streamed %" PRIu64 " bytes in %" PRIu64 " segments\n", req.length, num_segments);
+
+    file_request ack = req;
+    ack.type = REQ_ACK;
+    if (stream_corrupt)
+        ack.flags |= FILE_ACK_CORRUPT;
+    send_message(ack);
+}
+
+void rdma_server_context::receive_delta(const file_request& req)
+{
+    if (config.verbose)
+        print_file_request((file_request *)&req);
+
+    uint32_t block = req.slot_size;
+    if (!block) {
+        throw_error("invalid delta block size 0");
+    }
+    uint64_t start = now_ns();
+
+    /* the previous version, if we kept one, and where the new one goes */
+    std::string path = std::string(config.output_dir ? config.output_dir : ".") + "/" + delta_basis_name(req);
+    int basis_fd = config.output_dir ? open(path.c_str(), O_RDONLY) : -1;
+    uint64_t basis_length = 0;
+    char *basis = nullptr;
+    if (basis_fd >= 0) {
+        struct stat st;
+        if (fstat(basis_fd, &st)) {
+            throw_errno("fstat() in server failed for previous version");
+        }
+        basis_length = st.st_size;
+    }
+    if (basis_length) {
+        basis = (char *)mmap(NULL, basis_length, PROT_READ, MAP_SHARED, basis_fd, 0);
+        if (basis == MAP_FAILED) {
+            throw_errno("mmap() in server failed for previous version");
+        }
+    }
+
+    /* its signatures, for the client to read */
+    uint64_t num_blocks = basis_length / block;
+    registered_buffer sigs = device->mem_pool->get(std::max<uint64_t>(num_blocks * sizeof(block_signature), 1));
+    compute_signatures(basis, basis_length, block, (block_signature *)sigs.addr);
+    uint64_t sign_ns = now_ns() - start;
+
+    file_request msg = {};
+    msg.request_id = req.request_id;
+    msg.type = REQ_DELTA_SIGNATURES;
+    msg.addr = (uint64_t)sigs.addr;
+    msg.rkey = sigs.mr->rkey;
+    msg.length = num_blocks * sizeof(block_signature);
+    msg.slot_size = block;
+    send_message(msg);
+
+    /* the client answers with where it found those blocks */
+    file_request plan_msg;
+    recv_message(&plan_msg);
+    if (plan_msg.type != REQ_DELTA_PLAN || plan_msg.request_id != req.request_id) {
+        throw_error("unexpected reply %u to the signatures of request %d", plan_msg.type, req.request_id);
+    }
+    registered_buffer plan = device->mem_pool->get(std::max<uint64_t>(plan_msg.length, 1));
+    if (plan_msg.length) {
+        post_rdma_read(plan.addr, plan_msg.length, plan.mr->lkey, plan_msg.addr, plan_msg.rkey, 0, 0, true);
+        wait_reads(1);
+    }
+    device->mem_pool->put(sigs);
+
+    const delta_copy *copies = (const delta_copy *)plan.addr;
+    size_t num_copies = plan_msg.length / sizeof(delta_copy);
+    uint64_t end = 0, copied = 0;
+    for (size_t i = 0; i < num_copies; i++) {
+        const delta_copy& c = copies[i];
+        if (c.offset < end || c.offset + c.length > req.length || c.basis_offset + c.length > basis_length) {
+            throw_error("request %d: delta plan out of bounds", req.request_id);
+        }
+        end = c.offset + c.length;
+        copied += c.length;
+    }
+
+    /* everything between the copies is read from the client */
+    read_ranges.clear();
+    end = 0;
+    for (size_t i = 0; i <= num_copies; i++) {
+        uint64_t gap_end = i < num_copies ? copies[i].offset : req.length;
+        for (; end < gap_end; end += config.chunk_size)
+            read_ranges.push_back({ end, (uint32_t)std::min<uint64_t>(config.chunk_size, gap_end - end) });
+        if (i < num_copies)
+            end = copies[i].offset + copies[i].length;
+    }
+
+    release_file();
+    bool reflinked = false;
+    std::string tmp_path = path + ".delta";
+    if (!config.output_dir) {
+        /* no old copy to start from, so no copies either: a plain read into memory */
+        file_buf = device->mem_pool->get(req.length + 1);
+        file = file_buf.addr;
+        mr_file = file_buf.mr;
+        file[req.length] = '\0';
+        file_length = req.length;
+    } else {
+        /* built next to the old version, which stays intact until the new one is complete */
+        out_fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            throw_errno("open() in server failed for delta output file");
+        }
+        /* btrfs and XFS share the old extents; blocks that didn't move are then in place already */
+        if (num_copies)
+            reflinked = !ioctl(out_fd, FICLONE, basis_fd);
+        if (ftruncate(out_fd, req.length)) {
+            throw_errno("ftruncate() in server failed for delta output file");
+        }
+
+        /* copies go in before the mapping is registered: a reflink under
+         * pinned pages would leave the reads landing in stale ones */
+        for (size_t i = 0; i < num_copies; i++) {
+            const delta_copy& c = copies[i];
+            if (reflinked && c.basis_offset == c.offset)
+                continue;
+            for (uint64_t done = 0; done < c.length; ) {
+                loff_t in = c.basis_offset + done, out = c.offset + done;
+                ssize_t n = copy_file_range(basis_fd, &in, out_fd, &out, c.length - done, 0);
+                if (n <= 0) /* no in-kernel copy between these files */
+                    n = pwrite(out_fd, basis + c.basis_offset + done, c.length - done, c.offset + done);
+                if (n <= 0) {
+                    throw_errno("copy in server failed for delta output file");
+                }
+                done += n;
+            }
+        }
+
+        file_length = req.length;
+        map_out_fd(req.length);
+    }
+
+    ranged = true;
+    start_receive(req);
+    drive_receive();
+
+    /* the copies came from the old version, not the client: check all of it */
+    if (req.flags & FILE_REQUEST_CRC) {
+        ranged = false;
+        for (uint64_t chunk = 0; chunk * chunk_bytes < req.length; chunk++)
+            unverified.push_back(chunk);
+        verify_chunks();
+    }
+    uint64_t literal = req.length - copied;
+    finish_receive();
+    device->mem_pool->put(plan);
+
+    if (config.output_dir) {
+        release_file();
+        file_length = req.length;
+        if (!corrupt && rename(tmp_path.c_str(), path.c_str())) {
+            throw_errno("rename() in server failed for delta output file");
+        }
+        if (corrupt)
+            unlink(tmp_path.c_str());
+    }
+    if (basis)
+        munmap(basis, basis_length);
+    if (basis_fd >= 0)
+        close(basis_fd);
+
+    if (config.verbose)
+        printf("delta: read %" PRIu64 " of %" PRIu64 " bytes, %" PRIu64 " from the previous version (%s), "
+               "%.3f ms signing, %.3f ms total\n", literal, req.length, copied,
+               reflinked ? "reflinked" : "copied", sign_ns / 1e6, (now_ns() - start) / 1e6);
+
+    file_request ack = req;
+    ack.type = REQ_ACK;
+    if (corrupt)
+        ack.flags |= FILE_ACK_CORRUPT;
+    send_message(ack);
+}
+
+std::string rdma_server_context::delta_basis_name(const file_request& req)
+{
+    file_request msg;
+    recv_message(&msg);
+    if (msg.type != REQ_DELTA_BASIS || msg.request_id != req.request_id) {
+        throw_error("unexpected message %u instead of the basis of delta request %d", msg.type, req.request_id);
+    }
+    if (!msg.length || msg.length > NAME_MAX) {
+        throw_error("request %d: invalid delta basis name length %" PRIu64, req.request_id, msg.length);
+    }
+
+    registered_buffer buf = device->mem_pool->get(msg.length);
+    post_rdma_read(buf.addr, msg.length, buf.mr->lkey, msg.addr, msg.rkey, 0, 0, true);
+    wait_reads(1);
+    std::string name(buf.addr, msg.length);
+    device->mem_pool->put(buf);
+
+    /* ids restart with every session, names don't; but they stay in output_dir */
+    if (name.find('/') != std::string::npos || name.find('\0') != std::string::npos || name == "." || name == "..") {
+        throw_error("request %d: invalid delta basis name", req.request_id);
+    }
+    return name;
+}
+
+void rdma_server_context::receive_batch(const file_request& req)
+{
+    if (config.verbose)
+        print_file_request((file_request *)&req);
+    uint64_t start = now_ns();
+
+    uint32_t num_files = req.num_slots;
+    if (req.slot_size > req.length || (uint64_t)num_files * sizeof(batch_entry) > req.slot_size) {
+        throw_error("request %d: invalid batch manifest", req.request_id);
+    }
+
+    /* the packed data is read like any file */
+    file_request data = req;
+    data.addr += req.slot_size;
+    data.length -= req.slot_size;
+
+    release_file();
+    manifest = device->mem_pool->get(std::max<uint32_t>(req.slot_size, 1));
+    file_buf = device->mem_pool->get(data.length + 1);
+    file = file_buf.addr;
+    mr_file = file_buf.mr;
+    file[data.length] = '\0';
+    file_length = data.length;
+
+    /* the manifest comes along with the first chunk, unless there is none */
+    if (data.length && max_sge >= 2) {
+        manifest_bytes = req.slot_size;
+    } else if (req.slot_size) {
+        post_rdma_read(manifest.addr, req.slot_size, manifest.mr->lkey, req.addr, req.rkey, 0, 0, true);
+        wait_reads(1);
+    }
+    start_receive(data);
+    drive_receive();
+    finish_receive();
+
+    /* unpack, once the whole batch checked out */
+    const batch_entry *entries = (const batch_entry *)manifest.addr;
+    const char *names = manifest.addr + num_files * sizeof(batch_entry);
+    uint64_t names_bytes = req.slot_size - num_files * sizeof(batch_entry);
+    for (uint32_t i = 0; i < num_files && !corrupt; i++) {
+        const batch_entry& e = entries[i];
+        const char *name = names + e.name_offset;
+        if (e.name_offset >= names_bytes || !memchr(name, '\0', names_bytes - e.name_offset) || !*name ||
+            strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..") || e.offset + e.length > data.length) {
+            fprintf(stderr, "request %d: invalid batch entry %u\n", req.request_id, i);
+            corrupt = true;
+            break;
+        }
+        if (!config.output_dir)
+            continue;
+
+        std::string path = std::string(config.output_dir) + "/" + name;
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw_errno("open() in server failed for batch file");
+        }
+        for (uint64_t done = 0; done < e.length; ) {
+            ssize_t n = write(fd, file + e.offset + done, e.length - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                throw_errno("write() in server failed for batch file");
+            }
+            done += n;
+        }
+        close(fd);
+    }
+    device->mem_pool->put(manifest);
+    manifest = registered_buffer();
+
+    if (config.verbose) {
+        double secs = (now_ns() - start) / 1e9;
+        printf("batch: %u files, %" PRIu64 " bytes in %.3f ms, %.0f files/s%s\n", num_files, data.length, secs * 1e3,
+               secs > 0 ? num_files / secs : 0.0, config.output_dir ? ", unpacked" : "");
+    }
+
+    file_request ack = req;
+    ack.type = REQ_ACK;
+    if (corrupt)
+        ack.flags |= FILE_ACK_CORRUPT;
+    send_message(ack);
+}
+
+void rdma_server_context::begin_receive(const file_request& req)
+{
+    if (config.verbose)
+        print_file_request((file_request *)&req);
+
+    /* the length is the client's word; don't size anything by it unchecked */
+    if (req.length > config.max_file_size) {
+        throw_error("request %d: %" PRIu64 " bytes, more than the %" PRIu64 " allowed", req.request_id, req.length,
+                    config.max_file_size);
+    }
+
+    release_file();
+
+    if (config.output_dir) {
+        map_output_file(req);
+        start_receive(req);
+        return;
+    }
+
+    /* registered destination buffer, recycled from earlier transfers when possible */
+    file_buf = device->mem_pool->get(req.length + 1);
+    file = file_buf.addr;
+    mr_file = file_buf.mr;
+    file[req.length] = '\0';
+    file_length = req.length;
+
+    start_receive(req);
+}
+
+std::string rdma_server_context::output_path(const file_request& req) const
+{
+    return std::string(config.output_dir ? config.output_dir : ".") + "/" + output_prefix + std::to_string(req.request_id);
+}
+
+void rdma_server_context::map_output_file(const file_request& req)
+{
+    std::string path = output_path(req);
 
+    out_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        throw_errno("open() in server failed for output file");
+    }
+    file_length = req.length;
+    if (config.verbose)
+        printf("receiving into %s\n", path.c_str());
+    map_out_fd(req.length);
+}
 
-    file_request *req = (file_request*) malloc(sizeof(file_request));
-    recv_over_socket(req, sizeof(file_request));
+void rdma_server_context::map_out_fd(uint64_t length)
+{
+    if (!length)
+        return;
 
-    file = (char*) malloc(req->length+1);
+    /* reserve the blocks up front so the mapping can't SIGBUS on a full disk */
+    int ret = posix_fallocate(out_fd, 0, length);
+    if (ret == EOPNOTSUPP || ret == EINVAL)
+        ret = ftruncate(out_fd, length) ? errno : 0;
+    if (ret) {
+        errno = ret;
+        throw_errno("fallocate() in server failed for output file");
+    }
 
-    print_file_request(req);
+    file = (char *)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+    if (file == MAP_FAILED) {
+        file = nullptr;
+        throw_errno("mmap() in server failed for output file");
+    }
 
-    /* register a memory region for the input / output images. */
-    mr_file = ibv_reg_mr(pd, file, req->length, IBV_ACCESS_REMOTE_READ| IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    /* the RDMA reads land in the page cache of the output file directly */
+    {
+        METRIC_SCOPE(PHASE_MR_REG);
+        mr_file = ibv_reg_mr(pd, file, length, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    }
     if (!mr_file) {
-        perror("ibv_reg_mr() in server failed for file");
-        exit(1);
+        throw_errno("ibv_reg_mr() in server failed for output file");
+    }
+}
+
+void rdma_server_context::finish_receive()
+{
+    device->mem_pool->put(crc_table);
+    crc_table = registered_buffer();
+    ranged = false;
+    read_ranges.clear();
+    manifest_bytes = 0;
+    if (config.verbose && (cur_req.flags & FILE_REQUEST_CRC))
+        printf("    CRC32C (%s) of %" PRIu64 " blocks: %s\n", crc32c_impl(),
+               (cur_req.length + cur_req.crc_block - 1) / cur_req.crc_block, corrupt ? "MISMATCH" : "ok");
+    if (config.verbose && qps.size() > 1)
+        for (size_t i = 0; i < qps.size(); i++)
+            printf("    qp[%zu]: %" PRIu64 " chunks, %" PRIu64 " bytes\n", i,
+                   qp_stats[i].chunks_completed, qp_stats[i].bytes_completed);
+}
+
+void rdma_server_context::probe_path(const connection_establishment_data& client_info)
+{
+    METRIC_SCOPE(PHASE_PROBE);
+    uint32_t length = std::min<uint32_t>(client_info.probe_length, PROBE_SIZE);
+    if (length < PROBE_CHUNK)
+        return;
+    registered_buffer buf = device->mem_pool->get(length);
+
+    /* round trip: one small read at a time, best of a few */
+    uint64_t rtt_ns = UINT64_MAX;
+    for (int i = 0; i < PROBE_PINGS; i++) {
+        uint64_t start = now_ns();
+        post_rdma_read(buf.addr, 64, buf.mr->lkey, client_info.probe_addr, client_info.probe_rkey, i, 0, true);
+        wait_reads(1);
+        rtt_ns = std::min(rtt_ns, now_ns() - start);
+    }
+
+    /* bandwidth: the whole buffer with the widest window we may use */
+    int window = std::max(1, std::min(config.max_outstanding, rd_depth));
+    int num_chunks = length / PROBE_CHUNK;
+    uint64_t start = now_ns();
+    for (int posted = 0, done = 0; done < num_chunks; ) {
+        while (posted < num_chunks && posted - done < window) {
+            bool must_signal = posted - done + 1 >= window || posted + 1 == num_chunks;
+            post_rdma_read(buf.addr + (uint64_t)posted * PROBE_CHUNK, PROBE_CHUNK, buf.mr->lkey,
+                           client_info.probe_addr + (uint64_t)posted * PROBE_CHUNK, client_info.probe_rkey,
+                           posted, 0, must_signal);
+            posted++;
+        }
+        wait_reads(1);
+        done++;
+    }
+    double bytes_per_ns = (double)num_chunks * PROBE_CHUNK / std::max<uint64_t>(1, now_ns() - start);
+    device->mem_pool->put(buf);
+
+    /* keep twice the bandwidth-delay product in flight: big enough chunks to
+     * fill the window, and no more reads than that takes */
+    double bdp = bytes_per_ns * rtt_ns;
+    uint64_t chunk = TUNE_MIN_CHUNK;
+    while (chunk < TUNE_MAX_CHUNK && chunk * window < 2 * bdp)
+        chunk <<= 1;
+    int depth = std::max(2, std::min(window, (int)((2 * bdp + chunk - 1) / chunk)));
+    config.chunk_size = chunk;
+    config.max_outstanding = depth;
+    printf("path probe: rtt %.1f us, %.2f Gb/s, bdp %.0f KB -> chunk %" PRIu64 " KB, %d reads in flight\n",
+           rtt_ns / 1e3, bytes_per_ns * 8, bdp / 1024, chunk >> 10, depth);
+}
+
+void rdma_server_context::start_receive(const file_request& req)
+{
+    cur_req = req;
+    push_mode = req.flags & FILE_REQUEST_PUSH;
+    chunk_bytes = push_mode ? req.slot_size : config.chunk_size;
+    if (!chunk_bytes) {
+        throw_error("invalid chunk size 0");
+    }
+    crc_table_ready = false;
+    unverified.clear();
+    corrupt = false;
+    if (req.flags & FILE_REQUEST_CRC) {
+        /* every chunk must cover whole checksum blocks */
+        if (!req.crc_block || (push_mode && chunk_bytes % req.crc_block)) {
+            throw_error("invalid CRC block size %u for chunks of %" PRIu64, req.crc_block, chunk_bytes);
+        }
+        chunk_bytes = (chunk_bytes + req.crc_block - 1) / req.crc_block * req.crc_block;
+    }
+    num_chunks = (req.length + chunk_bytes - 1) / chunk_bytes;
+    next_chunk = 0;
+    bytes_completed = 0;
+    if (ranged) {
+        /* whatever isn't read is in place already */
+        num_chunks = read_ranges.size();
+        bytes_completed = req.length;
+        for (const auto& range : read_ranges)
+            bytes_completed -= range.second;
+    }
+    qp_stats.assign(qps.size(), {});
+    next_qp = 0;
+
+    post_reads();
+}
+
+void rdma_server_context::post_reads()
+{
+    if (push_mode)
+        return;
+
+    int window = std::max(1, std::min(config.max_outstanding, rd_depth));
+    int num_qps = qps.size();
+
+    /* hand out chunks round-robin to every QP that has room in its window;
+     * stop once a full sweep finds all of them busy */
+    int idle_sweep = 0;
+    while (next_chunk < num_chunks && idle_sweep < num_qps) {
+        int q = next_qp;
+        next_qp = (next_qp + 1) % num_qps;
+        if (qp_stats[q].reads_in_flight >= window) {
+            idle_sweep++;
+            continue;
+        }
+        idle_sweep = 0;
+
+        uint64_t offset;
+        uint32_t len;
+        chunk_extent(next_chunk, &offset, &len);
+
+        /* we wait when the window is full or the last chunk is out, so
+         * those reads must complete visibly */
+        bool must_signal = qp_stats[q].reads_in_flight + 1 >= window || next_chunk + 1 == num_chunks;
+        if (next_chunk == 0 && manifest_bytes) {
+            ibv_sge sgl[2] = {
+                { (uint64_t)(uintptr_t)manifest.addr, manifest_bytes, manifest.mr->lkey },
+                { (uint64_t)(uintptr_t)file, len, mr_file->lkey },
+            };
+            post_rdma_read(sgl, 2, cur_req.addr - manifest_bytes, cur_req.rkey, next_chunk, q, must_signal);
+            next_chunk++;
+            qp_stats[q].reads_in_flight++;
+            continue;
+        }
+        post_rdma_read(
+            file + offset,              // local_dst
+            len,                        // len
+            mr_file->lkey,              // lkey
+            cur_req.addr + offset,      // remote_src
+            cur_req.rkey,               // rkey
+            next_chunk,                 // wr_id
+            q,                          // qp_idx
+            must_signal);               // force_signal
+        next_chunk++;
+        qp_stats[q].reads_in_flight++;
+    }
+}
+
+void rdma_server_context::handle_data_completion(const struct ibv_wc& wc)
+{
+    uint64_t chunk;
+    if (wc.opcode == IBV_WC_RDMA_READ && wc.wr_id == CRC_TABLE_WR_ID) {
+        crc_table_ready = true;
+        qp_stats[0].reads_in_flight--;
+        return;
+    }
+    if (wc.opcode == IBV_WC_RDMA_READ)
+        chunk = wc.wr_id;
+    else if (wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM && push_mode)
+        chunk = ntohl(wc.imm_data);
+    else
+        return;
+
+    int q = qp_index(wc.qp_num);
+    if (q < 0) {
+        throw_error("data completion on unknown QP 0x%06x", wc.qp_num);
+    }
+
+    uint64_t offset;
+    uint32_t len;
+    chunk_extent(chunk, &offset, &len);
+    bytes_completed += len;
+    if (push_mode)
+        post_recv(wc.wr_id); /* the write consumed a receive; give it back */
+    else
+        qp_stats[q].reads_in_flight--;
+    qp_stats[q].chunks_completed++;
+    qp_stats[q].bytes_completed += len;
+    /* ranges don't line up with checksum blocks; receive_delta() checks it all at the end */
+    if ((cur_req.flags & FILE_REQUEST_CRC) && !ranged)
+        unverified.push_back(chunk);
+}
+
+void rdma_server_context::chunk_extent(uint64_t chunk, uint64_t *offset, uint32_t *len) const
+{
+    if (ranged) {
+        *offset = read_ranges[chunk].first;
+        *len = read_ranges[chunk].second;
+        return;
     }
+    /* the last chunk may be short */
+    *offset = chunk * chunk_bytes;
+    *len = std::min<uint64_t>(chunk_bytes, cur_req.length - *offset);
+}
 
-    post_rdma_read(
-        file,               // local_src
-        req->length,  // len
-        mr_file->lkey,      // lkey
-        req->addr,    // remote_dst
-        req->rkey,    // rkey
-        1);          // wr_id
+void rdma_server_context::take_transfer_messages()
+{
+    while (!inbox.empty() && inbox.front().type == REQ_CRC_TABLE) {
+        file_request msg = inbox.front();
+        inbox.pop_front();
+        if (msg.request_id != cur_req.request_id || crc_table.addr) {
+            fprintf(stderr, "unexpected checksums for request %d\n", msg.request_id);
+            continue;
+        }
+        /* one entry per block of what we read, which verify_chunks() indexes */
+        uint32_t block = cur_req.crc_block;
+        if (!(cur_req.flags & FILE_REQUEST_CRC) || !block ||
+            msg.length != (cur_req.length + block - 1) / block * sizeof(uint32_t)) {
+            throw_error("request %d: checksum table of %" PRIu64 " bytes does not match %" PRIu64 " bytes in blocks of %u",
+                        msg.request_id, msg.length, cur_req.length, block);
+        }
+
+        /* on qps[0], where it counts against the read window like a chunk */
+        crc_table = device->mem_pool->get(msg.length);
+        post_rdma_read(crc_table.addr, msg.length, crc_table.mr->lkey, msg.addr, msg.rkey, CRC_TABLE_WR_ID, 0, true);
+        qp_stats[0].reads_in_flight++;
+    }
+}
 
-    bool done = poll_cq();
-    if (!done) {
-        perror("server: poll_cq returned false\n");
+void rdma_server_context::verify_chunks()
+{
+    if (!crc_table_ready)
+        return;
+
+    const uint32_t *expected = (const uint32_t *)crc_table.addr;
+    uint32_t block = cur_req.crc_block;
+    for (uint64_t chunk : unverified) {
+        uint64_t offset = chunk * chunk_bytes;
+        uint64_t end = std::min<uint64_t>(offset + chunk_bytes, cur_req.length);
+        for (; offset < end; offset += block) {
+            uint32_t len = std::min<uint64_t>(block, end - offset);
+            if (crc32c(0, file + offset, len) != expected[offset / block] && !corrupt) {
+                fprintf(stderr, "request %d: CRC mismatch in block at offset %" PRIu64 "\n", cur_req.request_id, offset);
+                corrupt = true;
+            }
+        }
     }
+    unverified.clear();
 }
 
 ////////////////////////////////////////////////////////////////////////
 //////////////////////////// CLIENT CONTEXT ////////////////////////////
 ////////////////////////////////////////////////////////////////////////
 
-rdma_client_context::rdma_client_context(uint16_t tcp_port) :
-    rdma_context(tcp_port)
+rdma_client_context::rdma_client_context(uint16_t tcp_port, const transfer_config& config) :
+    rdma_context(tcp_port, config)
 {
     /* Create a TCP connection to exchange InfiniBand parameters */
     tcp_connection();
 
     /* Open up some InfiniBand resources */
-    initialize_verbs(IB_DEVICE_NAME);
+    initialize_verbs(config.device_name);
+
+    connect_to_server();
+}
+
+rdma_client_context::rdma_client_context(uint16_t tcp_port, std::shared_ptr<rdma_device> dev, const transfer_config& config) :
+    rdma_context(tcp_port, config)
+{
+    tcp_connection();
+    attach_device(dev);
+    connect_to_server();
+}
+
+void rdma_client_context::connect_to_server()
+{
+    create_qps(config.num_qps);
+
+    /* something for the server to probe the path with; pooled, so cheap to offer */
+    probe_buf = device->mem_pool->get(PROBE_SIZE);
 
     /* exchange InfiniBand parameters with the client */
     send_connection_establishment_data();
@@ -434,73 +1745,837 @@ rdma_client_context::rdma_client_context(uint16_t tcp_port) :
     /* now need to connect the QP to the client's QP. */
     connect_qp(server_info);
 
+    /* the server must have its receives posted before our first SEND, and
+     * has finished probing by then */
+    wait_ready();
+    device->mem_pool->put(probe_buf);
+    probe_buf = registered_buffer();
+    connected = true;
 }
 
 rdma_client_context::~rdma_client_context()
 {
+    end_session();
+    device->mem_pool->put(directory_copy);
+}
+
+void rdma_client_context::end_session()
+{
+    if (!connected)
+        return;
+    connected = false;
+
+    /* the QP must live until the SEND is out */
+    file_request bye = {};
+    bye.request_id = -1;
+    bye.type = REQ_FILE;
+    try {
+        send_message(bye, true);
+    } catch (const rdma_error& e) {
+        /* called from destructors: the connection is gone, nobody to tell */
+        fprintf(stderr, "ending the session: %s\n", e.what());
+    }
 }
 
 void rdma_client_context::tcp_connection()
 {
+    METRIC_SCOPE(PHASE_TCP_CONNECT);
     /* first we'll connect to server via a TCP socket to exchange InfiniBand parameters */
     int sfd;
     sfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sfd < 0) {
-        perror("socket");
-        exit(1);
+        throw_errno("socket");
     }
 
     struct sockaddr_in server_addr;
-    server_addr.sin_addr.s_addr = inet_addr(IP);
+    server_addr.sin_addr.s_addr = inet_addr(config.server_ip);
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(tcp_port);
 
-    if (connect(sfd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in)) < 0) {
-        perror("connect");
-        exit(1);
+    /* the server may still be starting up (e.g. forked by rdma_bench): retry refusals for a while */
+    int attempts = 0;
+    while (connect(sfd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in)) < 0) {
+        if (errno != ECONNREFUSED || ++attempts >= CONNECT_RETRIES) {
+            throw_errno("connect");
+        }
+        METRIC_ADD(CTR_RETRIES, 1);
+        usleep(100000);
     }
 
-    printf("TCP connection established with server %s successfully\n", IP);
+    printf("TCP connection established with server %s successfully\n", config.server_ip);
     socket_fd = sfd;
 }
 
 
-bool rdma_client_context::send_file(int file_id, char *filename)  {
+int rdma_client_context::take_request_id()
+{
+    /* -1 ends the session, so skip it when the ids wrap */
+    int file_id = next_request_id++;
+    if (next_request_id == -1)
+        next_request_id = 0;
+    return file_id;
+}
+
+int rdma_client_context::send_file(const char *filename)
+{
+    int file_id = take_request_id();
+    return send_file(file_id, filename) ? file_id : -1;
+}
+
+bool rdma_client_context::send_file(int file_id, const char *filename)  {
 
+    const char *slash = strrchr(filename, '/');
+    delta_name = slash ? slash + 1 : filename;
 
-    char * buffer = 0;
-    long length;
+    uint64_t length = 0;
     FILE * f = fopen (filename, "rb");
 
-    if (f)
+    if (!f) {
+        perror("fopen");
+        return false;
+    }
+    fseeko (f, 0, SEEK_END);
+    length = ftello (f);
+    fseeko (f, 0, SEEK_SET);
+
+    if (config.zero_copy && length) {
+        bool sent = send_file_mapped(file_id, fileno(f), length);
+        fclose (f);
+        return sent;
+    }
+    if (config.streaming && config.compress) {
+        bool sent = send_file_compressed(file_id, fileno(f), length);
+        fclose (f);
+        return sent;
+    }
+    if (config.streaming) {
+        bool sent = send_file_streamed(file_id, fileno(f), length);
+        fclose (f);
+        return sent;
+    }
+
+    /* read straight into a registered pool buffer */
+    registered_buffer buf = device->mem_pool->get(std::max<uint64_t>(length, 1));
+    if (fread (buf.addr, 1, length, f) != length) {
+        perror("fread");
+        fclose (f);
+        device->mem_pool->put(buf);
+        return false;
+    }
+    fclose (f);
+
+    bool sent = send_registered(file_id, buf.addr, length, buf.mr);
+    device->mem_pool->put(buf);
+    return sent;
+}
+
+bool rdma_client_context::send_file_mapped(int file_id, int fd, uint64_t length)
+{
+    void *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap() in client failed for file");
+        return false;
+    }
+
+    /* the server only ever reads it, so a read-only registration of the page cache is enough */
+    struct ibv_mr *mr;
     {
-      fseek (f, 0, SEEK_END);
-      length = ftell (f);
-      fseek (f, 0, SEEK_SET);
-      int res = posix_memalign((void**)&buffer, 4096, length);
-      if (buffer)
-      {
-        fread (buffer, 1, length, f);
-      }
-      fclose (f);
-    }
-    struct ibv_mr *mr_file = ibv_reg_mr(pd, buffer, length, IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE);
-    if (!mr_file) {
-        perror("ibv_reg_mr() in client failed for file");
-        exit(1);
+        METRIC_SCOPE(PHASE_MR_REG);
+        mr = ibv_reg_mr(pd, map, length, IBV_ACCESS_REMOTE_READ);
+    }
+    if (!mr) {
+        throw_errno("ibv_reg_mr() in client failed for mapped file");
+    }
+
+    bool sent = send_registered(file_id, map, length, mr);
+
+    ibv_dereg_mr(mr);
+    munmap(map, length);
+    return sent;
+}
+
+bool rdma_client_context::send_file_streamed(int file_id, int fd, uint64_t length)
+{
+    METRIC_SCOPE(PHASE_TRANSFER);
+    /* slots are read by the server as-is; keep them page aligned */
+    uint64_t slot_size = (std::max<uint32_t>(config.stream_slot_size, 4096) + 4095) & ~4095ULL;
+    int num_slots = std::max(1, config.stream_slots);
+    uint64_t num_segments = (length + slot_size - 1) / slot_size;
+
+    registered_buffer ring = device->mem_pool->get(slot_size * num_slots);
+    std::vector<bool> slot_busy(num_slots);
+
+    struct file_request req = {};
+    req.request_id = file_id;
+    req.type = REQ_FILE;
+    req.flags = FILE_REQUEST_STREAM | (config.verify ? FILE_REQUEST_CRC : 0);
+    req.rkey = ring.mr->rkey;
+    req.length = length;
+    req.addr = (uint64_t) ring.addr;
+    req.slot_size = slot_size;
+    req.num_slots = num_slots;
+    send_message(req);
+    if (config.verbose)
+        print_file_request(&req);
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t next_segment = 0;
+    bool acked = false;
+    bool intact = true;
+    while (!acked) {
+        /* segment i always goes to slot i % num_slots, so the server can find it */
+        while (next_segment < num_segments && !slot_busy[next_segment % num_slots]) {
+            int slot = next_segment % num_slots;
+            uint64_t offset = next_segment * slot_size;
+            size_t len = std::min<uint64_t>(slot_size, length - offset);
+
+            for (size_t done = 0; done < len; ) {
+                ssize_t ret = pread(fd, ring.addr + slot * slot_size + done, len - done, offset + done);
+                if (ret <= 0) {
+                    throw_errno("pread");
+                }
+                done += ret;
+            }
+            /* don't let the page cache keep what is already staged */
+            posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+
+            slot_busy[slot] = true;
+            file_request data = {};
+            data.type = REQ_STREAM_DATA;
+            data.request_id = file_id;
+            data.addr = next_segment;
+            data.length = len;
+            /* just read, so still in cache */
+            if (config.verify)
+                data.crc = crc32c(0, ring.addr + slot * slot_size, len);
+            send_message(data);
+            next_segment++;
+        }
+
+        file_request msg;
+        recv_message(&msg);
+        if (msg.type == REQ_STREAM_FREE)
+            slot_busy[msg.addr % num_slots] = false;
+        else if (msg.type == REQ_ACK) {
+            acked = true;
+            intact = check_ack(msg);
+        }
+    }
+
+    device->mem_pool->put(ring);
+    return intact;
+}
+
+bool rdma_client_context::send_file_compressed(int file_id, int fd, uint64_t length)
+{
+    METRIC_SCOPE(PHASE_TRANSFER);
+    /* same ring as send_file_streamed(); a deflated segment always fits its slot */
+    uint64_t slot_size = (std::max<uint32_t>(config.stream_slot_size, 4096) + 4095) & ~4095ULL;
+    int num_slots = std::max(1, config.stream_slots);
+    uint64_t num_segments = (length + slot_size - 1) / slot_size;
+
+    registered_buffer ring = device->mem_pool->get(slot_size * num_slots);
+    std::vector<bool> slot_busy(num_slots);  /* submitted, until the server has read it */
+    std::vector<bool> slot_ready(num_slots); /* filled, not announced yet */
+    std::vector<stream_compressor::segment> slot_seg(num_slots);
+
+    struct file_request req = {};
+    req.request_id = file_id;
+    req.type = REQ_FILE;
+    req.flags = FILE_REQUEST_STREAM | FILE_REQUEST_COMPRESS | (config.verify ? FILE_REQUEST_CRC : 0);
+    req.rkey = ring.mr->rkey;
+    req.length = length;
+    req.addr = (uint64_t) ring.addr;
+    req.slot_size = slot_size;
+    req.num_slots = num_slots;
+    send_message(req);
+    if (config.verbose)
+        print_file_request(&req);
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    stream_compressor compressor(fd, config.compress_threads, COMPRESS_LEVEL, config.verify);
+
+    /* policy input: what deflating has achieved so far, and how fast the
+     * server has been taking segments off the wire */
+    bool compressing = true, decided = false;
+    uint64_t raw_bytes = 0, deflated_bytes = 0, deflate_ns = 0;
+    uint64_t freed = 0, freed_wire = 0, first_announce = 0;
+    uint64_t total_wire = 0;
+
+    uint64_t next_segment = 0, next_announce = 0;
+    std::vector<stream_compressor::segment> reaped;
+    bool acked = false;
+    bool intact = true;
+    while (!acked) {
+        /* segment i always goes to slot i % num_slots, so the server can find it */
+        while (next_segment < num_segments && !slot_busy[next_segment % num_slots]) {
+            int slot = next_segment % num_slots;
+            uint64_t offset = next_segment * slot_size;
+            uint32_t len = std::min<uint64_t>(slot_size, length - offset);
+            slot_busy[slot] = true;
+            compressor.submit(next_segment, slot, ring.addr + slot * slot_size, slot_size, offset, len, compressing);
+            next_segment++;
+        }
+
+        reaped.clear();
+        compressor.reap(reaped);
+        for (const stream_compressor::segment& seg : reaped) {
+            slot_seg[seg.slot] = seg;
+            slot_ready[seg.slot] = true;
+            if (seg.deflate_ns) {
+                raw_bytes += seg.raw_len;
+                deflated_bytes += seg.wire_len;
+                deflate_ns += seg.deflate_ns;
+            }
+        }
+
+        /* workers finish out of order, but announcements are cumulative */
+        while (next_announce < next_segment && slot_ready[next_announce % num_slots]) {
+            int slot = next_announce % num_slots;
+            const stream_compressor::segment& seg = slot_seg[slot];
+            slot_ready[slot] = false;
+            /* don't let the page cache keep what is already staged */
+            posix_fadvise(fd, next_announce * slot_size, seg.raw_len, POSIX_FADV_DONTNEED);
+
+            file_request data = {};
+            data.type = REQ_STREAM_DATA;
+            data.request_id = file_id;
+            data.addr = next_announce;
+            data.length = seg.wire_len;
+            data.slot_size = seg.compressed ? seg.raw_len : 0;
+            data.crc = seg.crc;
+            send_message(data);
+            if (!first_announce)
+                first_announce = now_ns();
+            total_wire += seg.wire_len;
+            next_announce++;
+        }
+
+        file_request msg;
+        if (compressor.busy()) {
+            /* segments are still being deflated: don't sleep on the CQ */
+            if (!try_recv_message(&msg)) {
+                compressor.wait(COMPRESS_WAIT_US);
+                continue;
+            }
+        } else {
+            recv_message(&msg);
+        }
+
+        if (msg.type == REQ_STREAM_FREE) {
+            slot_busy[msg.addr % num_slots] = false;
+            freed++;
+            freed_wire += slot_seg[msg.addr % num_slots].wire_len;
+            if (compressing && !decided && freed >= COMPRESS_SAMPLE) {
+                decided = true;
+                compressing = compression_pays(raw_bytes, deflated_bytes, deflate_ns, freed_wire, now_ns() - first_announce);
+            }
+        } else if (msg.type == REQ_ACK) {
+            acked = true;
+            intact = check_ack(msg);
+        }
+    }
+
+    device->mem_pool->put(ring);
+    if (config.verbose)
+        printf("%" PRIu64 " bytes sent as %" PRIu64 " (x%.2f)\n", length, total_wire, total_wire ? (double)length / total_wire : 1.0);
+    return intact;
+}
+
+bool rdma_client_context::compression_pays(uint64_t raw_bytes, uint64_t deflated_bytes, uint64_t deflate_ns,
+                                           uint64_t wire_bytes, uint64_t wire_ns)
+{
+    /* all rates in bytes per ns. The transfer goes at the link rate without
+     * compression, and with it at the lesser of ratio x link and what the
+     * workers can deflate */
+    double ratio = deflated_bytes ? (double)raw_bytes / deflated_bytes : 1.0;
+    double link = config.link_gbits > 0 ? config.link_gbits / 8 : (double)wire_bytes / std::max<uint64_t>(wire_ns, 1);
+    double deflate = (double)raw_bytes / std::max<uint64_t>(deflate_ns, 1) * std::max(1, config.compress_threads);
+    double gain = std::min(ratio * link, deflate) / std::max(link, 1e-9);
+    bool pays = gain >= COMPRESS_MIN_GAIN;
+    if (config.verbose)
+        printf("compression: ratio %.2f, deflate %.2f Gb/s, link %.2f Gb/s%s: x%.2f, %s\n", ratio, deflate * 8, link * 8,
+               config.link_gbits > 0 ? "" : " (measured)", gain, pays ? "keeping it" : "off for the rest of the transfer");
+    return pays;
+}
+
+int rdma_client_context::send_directory(const char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror("opendir");
+        return -1;
+    }
+    std::vector<batch_file> small;
+    std::vector<std::string> large;
+    while (struct dirent *de = readdir(dir)) {
+        std::string file_path = std::string(path) + "/" + de->d_name;
+        struct stat st;
+        if (stat(file_path.c_str(), &st) || !S_ISREG(st.st_mode))
+            continue;
+        if ((uint64_t)st.st_size < config.chunk_size)
+            small.push_back({ file_path, de->d_name, (uint64_t)st.st_size });
+        else
+            large.push_back(file_path);
+    }
+    closedir(dir);
+    std::sort(small.begin(), small.end(), [](const batch_file& a, const batch_file& b) { return a.name < b.name; });
+
+    int sent = 0;
+    std::vector<batch_file> batch;
+    uint64_t batch_bytes = 0;
+    for (size_t i = 0; i <= small.size(); i++) {
+        bool full = i == small.size() || batch.size() == BATCH_MAX_FILES || batch_bytes + small[i].length > BATCH_BYTES;
+        if (full && !batch.empty()) {
+            if (send_batch(take_request_id(), batch))
+                sent += batch.size();
+            batch.clear();
+            batch_bytes = 0;
+        }
+        if (i < small.size()) {
+            batch.push_back(small[i]);
+            batch_bytes += small[i].length;
+        }
+    }
+    for (const std::string& file_path : large)
+        if (send_file(file_path.c_str()) >= 0)
+            sent++;
+    return sent;
+}
+
+bool rdma_client_context::send_batch(int file_id, const std::vector<batch_file>& files)
+{
+    METRIC_SCOPE(PHASE_TRANSFER);
+    uint64_t start = now_ns();
+
+    /* the manifest is padded so the data behind it starts aligned */
+    uint64_t names_bytes = 0, data_bytes = 0;
+    for (const batch_file& f : files) {
+        names_bytes += f.name.size() + 1;
+        data_bytes += f.length;
+    }
+    uint64_t manifest_bytes = (files.size() * sizeof(batch_entry) + names_bytes + 63) / 64 * 64;
+    registered_buffer region = device->mem_pool->get(manifest_bytes + data_bytes);
+    memset(region.addr, 0, manifest_bytes);
+
+    batch_entry *entries = (batch_entry *)region.addr;
+    char *names = region.addr + files.size() * sizeof(batch_entry);
+    char *data = region.addr + manifest_bytes;
+    uint64_t offset = 0, name_offset = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        const batch_file& f = files[i];
+        entries[i].offset = offset;
+        entries[i].length = f.length;
+        entries[i].name_offset = name_offset;
+        memcpy(names + name_offset, f.name.c_str(), f.name.size() + 1);
+        name_offset += f.name.size() + 1;
+
+        /* read straight into place; packing costs nothing beyond the read */
+        int fd = open(f.path.c_str(), O_RDONLY);
+        uint64_t done = 0;
+        while (fd >= 0 && done < f.length) {
+            ssize_t n = read(fd, data + offset + done, f.length - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        if (fd >= 0)
+            close(fd);
+        if (done < f.length) {
+            fprintf(stderr, "%s: cannot read %" PRIu64 " bytes\n", f.path.c_str(), f.length);
+            device->mem_pool->put(region);
+            return false;
+        }
+        offset += f.length;
+    }
+
+    crc_block = 0;
+    if (config.verify && data_bytes) {
+        crc_block = CRC_BLOCK_SIZE;
+        crc_table = device->mem_pool->get((data_bytes + crc_block - 1) / crc_block * sizeof(uint32_t));
+    }
+
+    struct file_request req = {};
+    req.request_id = file_id;
+    req.type = REQ_FILE;
+    req.rkey = region.mr->rkey;
+    req.addr = (uint64_t)region.addr;
+    req.length = manifest_bytes + data_bytes;
+    req.flags = FILE_REQUEST_BATCH | (crc_block ? FILE_REQUEST_CRC : 0);
+    req.slot_size = manifest_bytes;
+    req.num_slots = files.size();
+    req.crc_block = crc_block;
+    send_message(req);
+    if (config.verbose)
+        print_file_request(&req);
+
+    /* the checksums cover the data, not the manifest */
+    if (crc_block) {
+        checksum_blocks(data, data_bytes, 0, data_bytes);
+        send_checksums(file_id, data_bytes);
+    }
+
+    struct file_request ack;
+    recv_message(&ack);
+    bool sent = ack.type == REQ_ACK && ack.request_id == file_id && check_ack(ack);
+    device->mem_pool->put(crc_table);
+    crc_table = registered_buffer();
+    device->mem_pool->put(region);
+
+    double secs = (now_ns() - start) / 1e9;
+    if (config.verbose)
+        printf("batch transfer: %zu files, %" PRIu64 " bytes in %.3f ms, %.2f MB/s, %.0f files/s\n", files.size(),
+               data_bytes, secs * 1e3, secs > 0 ? data_bytes / secs / 1e6 : 0.0, secs > 0 ? files.size() / secs : 0.0);
+    return sent;
+}
+
+bool rdma_client_context::send_buffer(int file_id, void *buffer, uint64_t length)
+{
+    delta_name.clear();
+    struct ibv_mr *mr = device->mem_pool->lookup(buffer, std::max<uint64_t>(length, 1));
+    return send_registered(file_id, buffer, length, mr);
+}
+
+bool rdma_client_context::send_buffer(int file_id, void *buffer, uint64_t length, const char *name)
+{
+    delta_name = name;
+    struct ibv_mr *mr = device->mem_pool->lookup(buffer, std::max<uint64_t>(length, 1));
+    return send_registered(file_id, buffer, length, mr);
+}
+
+void rdma_client_context::invalidate_buffer(void *buffer, uint64_t length)
+{
+    device->mem_pool->invalidate(buffer, std::max<uint64_t>(length, 1));
+}
+
+bool rdma_client_context::send_registered(int file_id, void *buffer, uint64_t length, struct ibv_mr *mr)
+{
+    if (config.verbose)
+        printf("%" PRIu64 " bytes will be sent\n", length);
+
+    METRIC_SCOPE(PHASE_TRANSFER);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* checksum blocks must tile the chunks we push */
+    crc_block = 0;
+    if (config.verify && length) {
+        crc_block = config.push && config.chunk_size % CRC_BLOCK_SIZE ? config.chunk_size : CRC_BLOCK_SIZE;
+        crc_table = device->mem_pool->get((length + crc_block - 1) / crc_block * sizeof(uint32_t));
+    }
+
+    /* nothing names an old copy on the server: send it all */
+    bool delta = config.delta && !delta_name.empty();
+    if (config.delta && !delta && config.verbose)
+        printf("delta: buffer %d has no name, sending all of it\n", file_id);
+
+    bool sent;
+    if (config.push) {
+        sent = send_pushed(file_id, buffer, length, mr);
+    } else {
+        struct file_request req = {};
+        req.request_id = file_id;
+        req.type = REQ_FILE;
+        req.rkey = mr->rkey;
+        req.length = length;
+        req.addr = (uint64_t) buffer;
+        req.flags = crc_block ? FILE_REQUEST_CRC : 0;
+        req.crc_block = crc_block;
+        if (delta) {
+            req.flags |= FILE_REQUEST_DELTA;
+            req.slot_size = config.delta_block;
+        }
+
+        send_message(req);
+
+        if (config.verbose)
+            print_file_request(&req);
+
+        /* the server reads nothing before it knows what it already has */
+        uint64_t literal = length, plan_ns = 0;
+        if (delta) {
+            uint64_t plan_start = now_ns();
+            if (!send_delta_plan(file_id, (const char *)buffer, length, &literal)) {
+                device->mem_pool->put(crc_table);
+                crc_table = registered_buffer();
+                device->mem_pool->put(delta_basis);
+                delta_basis = registered_buffer();
+                return false;
+            }
+            plan_ns = now_ns() - plan_start;
+        }
+
+        /* the server is reading already; checksum meanwhile */
+        if (crc_block) {
+            checksum_blocks((const char *)buffer, length, 0, length);
+            send_checksums(file_id, length);
+        }
+
+        /* the server reads the buffer directly; wait for its ack before releasing it */
+        struct file_request ack;
+        recv_message(&ack);
+        sent = ack.type == REQ_ACK && ack.request_id == file_id && check_ack(ack);
+
+        if (delta && config.verbose) {
+            /* what sending it all would have cost, at the rate the changes went out at */
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            double literal_secs = secs - plan_ns / 1e9;
+            printf("delta: sent %" PRIu64 " of %" PRIu64 " bytes (%.1f%% saved), %.3f ms matching blocks", literal, length,
+                   length ? 100.0 * (length - literal) / length : 0.0, plan_ns / 1e6);
+            if (literal && literal_secs > 0)
+                printf(", ~%.3f ms saved", (length / (literal / literal_secs) - secs) * 1e3);
+            printf("\n");
+        }
+        device->mem_pool->put(delta_basis);
+        delta_basis = registered_buffer();
+        device->mem_pool->put(delta_plan);
+        delta_plan = registered_buffer();
     }
-    printf("buf content that will be sent: %s\n", buffer);
+    device->mem_pool->put(crc_table);
+    crc_table = registered_buffer();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (config.verbose)
+        printf("%s transfer: %" PRIu64 " bytes in %.3f ms, %.2f MB/s\n", config.push ? "push" : "pull",
+           length, secs * 1e3, secs > 0 ? length / secs / 1e6 : 0.0);
+
+    return sent;
+}
 
-    struct file_request req;
-    req.request_id = 1;
-    req.rkey = mr_file->rkey;
+bool rdma_client_context::send_pushed(int file_id, void *buffer, uint64_t length, struct ibv_mr *mr)
+{
+    struct file_request req = {};
+    req.request_id = file_id;
+    req.type = REQ_FILE;
+    req.flags = FILE_REQUEST_PUSH | (crc_block ? FILE_REQUEST_CRC : 0);
     req.length = length;
-    req.addr = (uint64_t) buffer;
+    req.slot_size = config.chunk_size;
+    req.crc_block = crc_block;
+    send_message(req);
+    if (config.verbose)
+        print_file_request(&req);
+
+    /* the server answers with its registered landing buffer */
+    struct file_request target;
+    recv_message(&target);
+    if (target.type != REQ_PUSH_TARGET || target.request_id != file_id) {
+        fprintf(stderr, "unexpected reply %u to push request %d\n", target.type, file_id);
+        return false;
+    }
+
+    /* every write with immediate consumes one of the server's receives on that QP */
+    int window = std::max<int>(1, std::min<int>(config.max_outstanding, target.num_slots));
+    int num_qps = qps.size();
+    uint64_t num_chunks = (length + config.chunk_size - 1) / config.chunk_size;
+    uint64_t next_chunk = 0, completed = 0;
+    std::vector<int> in_flight(num_qps);
+    int q = 0;
+
+    while (completed < num_chunks) {
+        for (int idle = 0; next_chunk < num_chunks && idle < num_qps; q = (q + 1) % num_qps) {
+            if (in_flight[q] >= window) {
+                idle++;
+                continue;
+            }
+            idle = 0;
+
+            uint64_t offset = next_chunk * config.chunk_size;
+            uint32_t len = std::min<uint64_t>(config.chunk_size, length - offset);
+            uint32_t imm = htonl(next_chunk); /* tells the server which chunk landed */
+            bool must_signal = in_flight[q] + 1 >= window || next_chunk + 1 == num_chunks;
+            post_rdma_write(
+                target.addr + offset,           // remote_dst
+                len,                            // len
+                target.rkey,                    // rkey
+                (char *)buffer + offset,        // local_src
+                mr->lkey,                       // lkey
+                next_chunk,                     // wr_id
+                &imm,                           // immediate
+                q,                              // qp_idx
+                must_signal);                   // force_signal
+            in_flight[q]++;
+            next_chunk++;
+
+            /* the NIC sends it meanwhile */
+            if (crc_block)
+                checksum_blocks((const char *)buffer, length, offset, offset + len);
+        }
+
+        struct ibv_wc wc[MAX_OUTSTANDING_READS];
+        int n = poll_cq(wc, MAX_OUTSTANDING_READS);
+        if (!n)
+            wait_completions();
+        for (int i = 0; i < n; i++) {
+            if (wc[i].opcode != IBV_WC_RDMA_WRITE)
+                continue;
+            in_flight[qp_index(wc[i].qp_num)]--;
+            completed++;
+        }
+    }
+
+    if (crc_block)
+        send_checksums(file_id, length);
 
-    send_over_socket(&req, sizeof(file_request));
+    struct file_request ack;
+    recv_message(&ack);
+    return ack.type == REQ_ACK && ack.request_id == file_id && check_ack(ack);
+
+}
 
-    print_file_request(&req);
+bool rdma_client_context::send_delta_plan(int file_id, const char *buffer, uint64_t length, uint64_t *literal)
+{
+    /* the server signs its copy of that name, not whatever came under file_id before */
+    delta_basis = device->mem_pool->get(delta_name.size());
+    memcpy(delta_basis.addr, delta_name.data(), delta_name.size());
+    file_request basis_msg = {};
+    basis_msg.request_id = file_id;
+    basis_msg.type = REQ_DELTA_BASIS;
+    basis_msg.addr = (uint64_t)delta_basis.addr;
+    basis_msg.rkey = delta_basis.mr->rkey;
+    basis_msg.length = delta_name.size();
+    send_message(basis_msg);
+
+    file_request sigs_msg;
+    recv_message(&sigs_msg);
+    if (sigs_msg.type != REQ_DELTA_SIGNATURES || sigs_msg.request_id != file_id) {
+        fprintf(stderr, "unexpected reply %u to delta request %d\n", sigs_msg.type, file_id);
+        return false;
+    }
 
+    uint64_t num_blocks = sigs_msg.length / sizeof(block_signature);
+    registered_buffer sigs = device->mem_pool->get(std::max<uint64_t>(sigs_msg.length, 1));
+    if (sigs_msg.length) {
+        post_rdma_read(sigs.addr, sigs_msg.length, sigs.mr->lkey, sigs_msg.addr, sigs_msg.rkey, 0, 0, true);
+        wait_reads(1);
+    }
+    std::vector<delta_copy> copies = match_blocks(buffer, length, sigs_msg.slot_size,
+                                                  (const block_signature *)sigs.addr, num_blocks);
+    device->mem_pool->put(sigs);
+
+    *literal = length;
+    for (const delta_copy& c : copies)
+        *literal -= c.length;
+
+    delta_plan = device->mem_pool->get(std::max<uint64_t>(copies.size() * sizeof(delta_copy), 1));
+    if (!copies.empty())
+        memcpy(delta_plan.addr, copies.data(), copies.size() * sizeof(delta_copy));
+
+    file_request msg = {};
+    msg.request_id = file_id;
+    msg.type = REQ_DELTA_PLAN;
+    msg.addr = (uint64_t)delta_plan.addr;
+    msg.rkey = delta_plan.mr->rkey;
+    msg.length = copies.size() * sizeof(delta_copy);
+    send_message(msg);
     return true;
+}
+
+void rdma_client_context::checksum_blocks(const char *buffer, uint64_t length, uint64_t offset, uint64_t end)
+{
+    uint32_t *table = (uint32_t *)crc_table.addr;
+    for (; offset < end; offset += crc_block)
+        table[offset / crc_block] = crc32c(0, buffer + offset, std::min<uint64_t>(crc_block, length - offset));
+}
+
+void rdma_client_context::send_checksums(int file_id, uint64_t length)
+{
+    file_request msg = {};
+    msg.request_id = file_id;
+    msg.type = REQ_CRC_TABLE;
+    msg.addr = (uint64_t)crc_table.addr;
+    msg.rkey = crc_table.mr->rkey;
+    msg.length = (length + crc_block - 1) / crc_block * sizeof(uint32_t);
+    msg.crc_block = crc_block;
+    send_message(msg);
+}
+
+bool rdma_client_context::check_ack(const file_request& ack)
+{
+    object_id = ack.flags & FILE_ACK_OBJECT ? ack.addr : 0;
+    if (!(ack.flags & FILE_ACK_CORRUPT))
+        return true;
+    fprintf(stderr, "request %d: the server received corrupted data\n", ack.request_id);
+    return false;
+}
+
+bool rdma_client_context::get_object(uint64_t id, registered_buffer *buf, uint64_t *length)
+{
+    if (!directory_known) {
+        file_request msg = {};
+        msg.type = REQ_DIRECTORY;
+        send_message(msg);
+        recv_message(&directory);
+        if (directory.type != REQ_DIRECTORY) {
+            fprintf(stderr, "unexpected reply %u to directory request\n", directory.type);
+            return false;
+        }
+        directory_known = true;
+        if (directory.length)
+            directory_copy = device->mem_pool->get(directory.length);
+    }
+    if (!directory.length) {
+        fprintf(stderr, "the server keeps no object cache\n");
+        return false;
+    }
+
+    const object_entry *entries = (const object_entry *)directory_copy.addr;
+    size_t num_entries = directory.length / sizeof(object_entry);
+    for (int attempt = 0; attempt < OBJECT_GET_ATTEMPTS; attempt++) {
+        /* one read for the whole directory: a lookup is a single round trip */
+        post_rdma_read(directory_copy.addr, directory.length, directory_copy.mr->lkey,
+                       directory.addr, directory.rkey, 0, 0, true);
+        wait_reads(1);
+
+        size_t slot = num_entries;
+        bool changing = false;
+        for (size_t i = 0; i < num_entries; i++) {
+            object_entry e;
+            memcpy(&e, &entries[i], sizeof(e));
+            if (e.version & 1)
+                changing = true;
+            else if (e.addr && e.id == id)
+                slot = i;
+        }
+        if (slot == num_entries) {
+            /* not there, unless it is being written right now */
+            if (changing)
+                continue;
+            METRIC_ADD(CTR_CACHE_MISSES, 1);
+            return false;
+        }
 
+        object_entry e = entries[slot];
+        *buf = device->mem_pool->get(std::max<uint64_t>(e.length, 1));
+        /* the object in chunk_size reads striped over the QPs, a window at a time */
+        uint64_t chunk = config.chunk_size;
+        for (uint64_t offset = 0; offset < e.length; ) {
+            int posted = 0;
+            for (; posted < (int)qps.size() && offset < e.length; posted++, offset += chunk)
+                post_rdma_read(buf->addr + offset, std::min(chunk, e.length - offset), buf->mr->lkey,
+                               e.addr + offset, e.rkey, 0, posted, true);
+            wait_reads(posted);
+        }
+
+        /* a slot rewritten while we read means the object may have been
+         * evicted under us; the CRC catches a torn read either way */
+        object_entry now;
+        post_rdma_read(&directory_copy.addr[slot * sizeof(object_entry)], sizeof(object_entry),
+                       directory_copy.mr->lkey, directory.addr + slot * sizeof(object_entry), directory.rkey, 0, 0, true);
+        wait_reads(1);
+        memcpy(&now, &entries[slot], sizeof(now));
+        if (now.version == e.version && crc32c(0, buf->addr, e.length) == e.crc) {
+            *length = e.length;
+            METRIC_ADD(CTR_CACHE_HITS, 1);
+            return true;
+        }
+        device->mem_pool->put(*buf);
+        *buf = registered_buffer();
+    }
+    fprintf(stderr, "object %" PRIu64 " kept changing during %d attempts\n", id, OBJECT_GET_ATTEMPTS);
+    return false;
 }
@@ -3,118 +3,547 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <inttypes.h>
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <infiniband/verbs.h>
 
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <infiniband/verbs.h>
 
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <deque>
 
 
 
 #include "settings.h"
+#include "mem_pool.h"
+#include "rdma_error.h"
+#include "transport.h"
+#include "metrics.h"
+#include "crc32c.h"
 
 
 
 /* Data to exchange between client and server for communication */
 struct connection_establishment_data {
     ibv_gid gid;
-    int qpn;
+    int num_qps;
+    int qpn[MAX_NUM_QPS]; /* qpn[0] carries control traffic, all of them carry data */
+    int max_rd_atomic; /* max RDMA reads this side can serve as responder (max_qp_rd_atom) */
+    int active_mtu; /* enum ibv_mtu active on this side's port */
+    /* client: registered scratch buffer the server may read to probe the path (0 length: none) */
+    uint64_t probe_addr;
+    uint32_t probe_rkey;
+    uint32_t probe_length;
+    host_identity host; /* same host: the data path may bypass the NIC (see shm_transport) */
 };
 
+/* Kinds of control messages, all carried in a file_request. Once the QPs are
+ * connected they travel as inline RDMA SENDs on qps[0] */
+enum request_type {
+    REQ_FILE = 0,       /* client -> server: read length bytes at (addr, rkey) */
+    REQ_ACK,            /* server -> client: request_id has been received */
+    REQ_STREAM_DATA,    /* client -> server: stream segment addr (its ring slot) holds length bytes */
+    REQ_STREAM_FREE,    /* server -> client: stream segment addr was read, its slot may be refilled */
+    REQ_PUSH_TARGET,    /* server -> client: write the file to (addr, rkey), num_slots writes in flight per QP */
+    REQ_CRC_TABLE,      /* client -> server: the CRC32C of each crc_block bytes of request_id is at (addr, rkey), length bytes */
+    REQ_DELTA_SIGNATURES, /* server -> client: a block_signature of each slot_size bytes of its old copy is at (addr, rkey), length bytes */
+    REQ_DELTA_PLAN,     /* client -> server: the delta_copy ranges to take from the old copy are at (addr, rkey), length bytes */
+    REQ_DIRECTORY,      /* client -> server: where is the object directory? server -> client: at (addr, rkey), length bytes (0: no cache) */
+    REQ_DELTA_BASIS,    /* client -> server: the name of request_id in the server's output dir, the old copy to diff against, is at (addr, rkey), length bytes */
+};
+
+/* REQ_FILE flags */
+#define FILE_REQUEST_STREAM 0x1 /* (addr, rkey) is a ring of num_slots x slot_size fed by REQ_STREAM_DATA */
+#define FILE_REQUEST_PUSH 0x2 /* client writes slot_size chunks with immediate = chunk index, server doesn't read */
+#define FILE_REQUEST_CRC 0x4 /* checksums follow in a REQ_CRC_TABLE, or with each REQ_STREAM_DATA */
+#define FILE_REQUEST_COMPRESS 0x8 /* stream segments may be deflated, see REQ_STREAM_DATA slot_size */
+#define FILE_REQUEST_DELTA 0x10 /* only read what the server's old copy (named by a REQ_DELTA_BASIS) lacks, in blocks of slot_size; see delta.h */
+#define FILE_REQUEST_BATCH 0x20 /* (addr, rkey) holds num_slots files: a slot_size byte manifest, then their data */
+
+/* One file of a batch. The manifest is an array of these followed by the
+ * NUL-terminated names */
+struct batch_entry
+{
+    uint64_t offset;      /* of the data, from the end of the manifest */
+    uint32_t length;
+    uint32_t name_offset; /* from the end of the entries */
+};
+
+/* REQ_ACK flags, on top of those of the request */
+#define FILE_ACK_CORRUPT 0x100 /* some of the data didn't match its checksum */
+#define FILE_ACK_OBJECT 0x200 /* the server caches the file as object addr, see get_object() */
+
+/* Every wr_id we post carries the kind of work request in its top byte, so
+ * completions (failed ones included, whose opcode is undefined) can be told
+ * apart. The low 56 bits are the caller's id */
+enum wr_kind {
+    WR_RECV = 1,  /* receive buffer index */
+    WR_MESSAGE,   /* control message SEND */
+    WR_READ,      /* RDMA read, caller's id */
+    WR_WRITE,     /* RDMA write (with immediate), caller's id */
+};
+#define WR_ID(kind, id) (((uint64_t)(kind) << 56) | (id))
+#define WR_KIND(wr_id) ((int)((wr_id) >> 56))
+#define WR_USER_ID(wr_id) ((uint64_t)(wr_id) & ((UINT64_C(1) << 56) - 1))
+
 struct file_request
 {
     int request_id; /* Returned to the client via RDMA write immediate value; use -1 to terminate */
     int rkey;
-    int length;
+    uint64_t length;
     uint64_t addr;
+    uint32_t type; /* request_type */
+    uint32_t flags;
+    uint32_t slot_size; /* streaming: ring slot size; push: chunk size; stream data: inflated size if deflated, else 0;
+                         * delta: block size */
+    uint32_t num_slots; /* streaming: ring slots; push target: write credits per QP */
+    uint32_t crc_block; /* FILE_REQUEST_CRC: bytes per checksum, dividing the chunk size of a push */
+    uint32_t crc; /* stream data: CRC32C of the segment */
+};
+
+/* Device-wide verbs resources. Opened once per process and shared by every
+ * connection (rdma_context) created on top of it */
+struct rdma_device
+{
+    struct ibv_context *context = nullptr;
+    struct ibv_pd *pd = nullptr;
+    struct ibv_device_attr device_attr; /* capabilities of the opened device */
+    std::unique_ptr<rdma_mem_pool> mem_pool; /* registered transfer buffers on pd */
+
+    /* huge_page_size: pages of the pool's buffers, see alloc_pages() */
+    explicit rdma_device(const char *device_name, size_t huge_page_size = HUGE_PAGE_SIZE);
+    ~rdma_device();
 };
 
+/* Tunables of the transfer engine. Defaults come from settings.h */
+struct transfer_config
+{
+    uint32_t chunk_size = CHUNK_SIZE; /* bytes per RDMA read */
+    int max_outstanding = MAX_OUTSTANDING_READS; /* max reads in flight per QP, clamped to rd_depth */
+    int num_qps = NUM_QPS; /* QPs to stripe chunks across, up to MAX_NUM_QPS */
+    int num_workers = NUM_WORKERS; /* pinned threads with a connection each, see worker_pool */
+    bool use_srq = false; /* server: receive through a shared SRQ/CQ instead of per-connection queues */
+    bool zero_copy = false; /* client: register an mmap of the source file instead of reading it into a buffer */
+    const char *output_dir = nullptr; /* server: RDMA-read straight into mmap'd files in this directory */
+    uint64_t max_file_size = MAX_FILE_SIZE; /* server: refuse requests for larger files */
+    bool streaming = false; /* client: stage the file through a bounded ring instead of registering all of it */
+    bool push = false; /* client: RDMA-write the file into a buffer the server advertises, instead of being read */
+    uint32_t stream_slot_size = STREAM_SLOT_SIZE;
+    int stream_slots = STREAM_SLOTS;
+    int signal_interval = SIGNAL_INTERVAL; /* ask for a completion on one send WR in this many */
+    int spin_us = POLL_SPIN_US; /* busy-poll this long before sleeping on the CQ; -1 never sleeps */
+    const char *device_name = IB_DEVICE_NAME;
+    const char *server_ip = IP; /* client: where the server listens */
+    int ib_port = IB_PORT;
+    int gid_index = GID_ID;
+    int max_requests = MAX_NUM_REQUESTS; /* control messages in flight per QP */
+    int path_mtu = PATH_MTU; /* cap in bytes on the negotiated MTU, 0 for none */
+    int qp_timeout = QP_TIMEOUT; /* local ACK timeout exponent: 4.096us * 2^qp_timeout */
+    bool tune = TUNE_TRANSFERS; /* server: probe the path and fit chunk_size and max_outstanding to it */
+    bool verify = VERIFY_TRANSFERS; /* client: send CRC32Cs of the data for the server to check */
+    bool compress = false; /* client, streaming: deflate segments on worker threads while they pay off */
+    int compress_threads = COMPRESS_THREADS;
+    double link_gbits = 0; /* client: path rate the compression policy assumes, 0 to measure it */
+    bool delta = false; /* client, pull: only send the blocks the server's previous copy lacks */
+    uint32_t delta_block = DELTA_BLOCK_SIZE;
+    uint64_t cache_bytes = OBJECT_CACHE_BYTES; /* multi-client server: keep received files for GETs, 0 for none */
+    bool shared_memory = SHARED_MEMORY_TRANSFERS; /* copy through shared memory with a peer on the same host */
+    size_t huge_page_size = HUGE_PAGE_SIZE; /* pool buffers on hugepages of this size, 0 for 4 KiB pages */
+    bool tcp = false; /* move files over TCP streams instead of verbs; implied on hosts without an RDMA device */
+    int tcp_streams = TCP_STREAMS; /* client, TCP: parallel data connections, up to TCP_MAX_STREAMS */
+    bool verbose = true; /* print every request and transfer */
+};
+
+/* Override config fields from RDMA_* environment variables, so deployments
+ * can change what settings.h compiles in without rebuilding: RDMA_DEVICE,
+ * RDMA_SERVER_IP, RDMA_IB_PORT, RDMA_GID_INDEX, RDMA_MTU, RDMA_CHUNK_SIZE,
+ * RDMA_DEPTH, RDMA_MAX_REQUESTS, RDMA_QP_TIMEOUT, RDMA_TUNE, RDMA_VERIFY,
+ * RDMA_COMPRESS, RDMA_LINK_GBITS, RDMA_WORKERS, RDMA_DELTA, RDMA_CACHE_BYTES,
+ * RDMA_SHM, RDMA_HUGE_PAGES, RDMA_TCP, RDMA_TCP_STREAMS and RDMA_MAX_FILE_SIZE */
+void load_config_env(transfer_config *config);
+
+
 
 
 class rdma_context
 {
 protected:
     uint16_t tcp_port;
-    int socket_fd; /* Connected socket for TCP connection */
+    int socket_fd = -1; /* Connected socket for TCP connection */
+    transfer_config config;
 
-    /* InfiniBand/verbs resources */
+    /* InfiniBand/verbs resources. context, pd and device_attr are borrowed from device */
+    std::shared_ptr<rdma_device> device;
     struct ibv_context *context = nullptr;
     struct ibv_pd *pd = nullptr;
-    struct ibv_qp *qp = nullptr;
+    struct ibv_qp *qp = nullptr; /* == qps[0] */
+    std::vector<struct ibv_qp *> qps; /* all QPs of the session, sharing one CQ */
     struct ibv_cq *cq = nullptr;
-
-    std::array<file_request, MAX_NUM_REQUESTS> requests; /* Array of outstanding requests received from the network */
+    bool owns_cq = true; /* false when cq is shared with other connections */
+    struct ibv_srq *srq = nullptr; /* shared receive queue, if not using our own RQs */
+    struct ibv_comp_channel *channel = nullptr; /* CQ event channel, for callers that sleep on cq */
+    struct ibv_device_attr device_attr; /* capabilities of the opened device */
+    struct ibv_port_attr port_attr; /* state of config.ib_port */
+    int rd_depth = 1; /* negotiated max_rd_atomic: RDMA reads we may keep in flight */
+    enum ibv_mtu mtu = IBV_MTU_1024; /* negotiated path MTU */
+    registered_buffer probe_buf; /* client: advertised for the server's path probe */
+
+    /* Receive buffers for requests from the network. Each QP owns recv_depth
+     * of them: buffer i is always posted on qps[i / recv_depth]. Every receive
+     * WQE is request-sized, so any of them can take a SEND as well as an
+     * RDMA write with immediate */
+    std::vector<file_request> requests;
+    int recv_depth = 0;
     struct ibv_mr *mr_requests = nullptr; /* Memory region for RPC requests */
+    uint32_t max_inline = 0; /* inline data the QPs actually support */
+    int max_sge = 1; /* scatter/gather entries the send WQEs take */
+
+    /* Control messages received but not consumed yet, and data completions
+     * polled but not handed to poll_cq() callers yet */
+    std::deque<file_request> inbox;
+    std::deque<struct ibv_wc> pending_wcs;
+
+    /* Completion engine. Only some send WRs are signaled; since an RC QP
+     * completes its WRs in order, a signaled completion retires every WR
+     * posted before it on that QP too, and poll_cq() reports those as if
+     * they had completed on their own */
+    struct posted_wr {
+        uint64_t wr_id; /* caller's id */
+        int kind;       /* wr_kind */
+        bool signaled;
+    };
+    struct send_queue {
+        std::deque<posted_wr> posted; /* WRs not known to be complete, oldest first */
+        int unsignaled = 0; /* posted since the last signaled one */
+    };
+    std::vector<send_queue> sqs; /* one per QP */
+    int sq_depth = 0;
+    int spin_limit_us = 0; /* current spin budget, adapted to how long waits last */
+
+    /* Moves the data of post_rdma_read()/post_rdma_write(): the QPs, or
+     * shared memory once connect_qp() finds the peer on this host */
+    friend class verbs_transport;
+    std::unique_ptr<transport> data_path = std::unique_ptr<transport>(new verbs_transport(this));
+    void select_transport(const connection_establishment_data& remote_info);
 
     void initialize_verbs(const char *device_name);
+    /* Like initialize_verbs(), on a device already opened by someone else */
+    void attach_device(std::shared_ptr<rdma_device> dev);
+    /* Create the shared CQ and num_qps RC QPs on it */
+    void create_qps(int num_qps);
+    /* Make create_qps() put the QPs on an existing CQ and SRQ owned by someone else */
+    void use_shared_queues(struct ibv_cq *shared_cq, struct ibv_srq *shared_srq);
+    /* Make create_qps() attach a completion channel to its CQ */
+    void use_completion_channel();
+    /* Request an event on the channel for the next completion */
+    void arm_cq();
+    /* Consume the events already raised on the channel */
+    void consume_cq_events();
+    /* Index into qps of the QP with the given number, or -1 */
+    int qp_index(uint32_t qp_num) const;
     void send_over_socket(void *buffer, size_t len);
     void recv_over_socket(void *buffer, size_t len);
+    connection_establishment_data local_connection_establishment_data();
     void send_connection_establishment_data();
     connection_establishment_data recv_connection_establishment_data();
     static void print_connection_establishment_data(const char *type, const connection_establishment_data& data);
     void connect_qp(const connection_establishment_data& remote_info);
-
-    /* Post a receive buffer of the given index (from the requests array) to the receive queue */
+    void connect_one_qp(struct ibv_qp *qp, int remote_qpn, const connection_establishment_data& remote_info);
+    /* Post every receive buffer to its QP. With an SRQ, its owner keeps it stocked */
+    void post_receives();
+    /* Wait for count RDMA read completions, ignoring anything else */
+    void wait_reads(int count);
+
+    /* Tell the peer our receives are posted; the other side waits for it
+     * before sending its first message */
+    void signal_ready();
+    void wait_ready();
+
+    /* Post a receive buffer of the given index (from the requests array) to the receive queue of its QP */
     void post_recv(int index = -1);
 
-    /* Helper function to post an asynchronous RDMA Read request */
+    /* Control plane: file_request messages as (inline, when possible) SENDs
+     * on qps[0]. With wait, return only once the SEND has completed */
+    void send_message(const file_request& msg, bool wait = false);
+    /* Take the next received message, polling the CQ once if none is queued */
+    bool try_recv_message(file_request *msg);
+    void recv_message(file_request *msg);
+
+    /* Helper functions to post asynchronous RDMA reads and writes. The engine
+     * signals one WR in config.signal_interval; pass force_signal for a WR
+     * whose completion the caller is going to wait for */
     void post_rdma_read(void *local_dst, uint32_t len, uint32_t lkey,
-                        uint64_t remote_src, uint32_t rkey, uint64_t wr_id);
+                        uint64_t remote_src, uint32_t rkey, uint64_t wr_id,
+                        int qp_idx = 0, bool force_signal = false);
+    /* One read of contiguous remote memory, scattered over up to max_sge local buffers */
+    void post_rdma_read(const ibv_sge *sgl, int num_sge, uint64_t remote_src, uint32_t rkey, uint64_t wr_id,
+                        int qp_idx = 0, bool force_signal = false);
     void post_rdma_write(uint64_t remote_dst, uint32_t len, uint32_t rkey,
 			 void *local_src, uint32_t lkey, uint64_t wr_id,
-			 uint32_t *immediate = NULL);
-    bool poll_cq();
+			 uint32_t *immediate = NULL, int qp_idx = 0, bool force_signal = false);
+    void post_send(int qp_idx, struct ibv_send_wr *wr, int kind, bool force_signal);
+
+    /* Return up to num_entries data completions without blocking: RDMA reads
+     * and writes, and receives of writes with immediate, with the caller's
+     * wr_id. Received messages go to the inbox instead */
+    int poll_cq(struct ibv_wc *wc, int num_entries);
+    /* Poll one batch of CQEs and process them. Returns the number polled */
+    virtual int drain_cq();
+    /* Account one CQE: queue messages and data completions, retire send WRs */
+    void process_completion(const struct ibv_wc& wc);
+    /* A work completion failed; throws rdma_error unless overridden */
+    virtual void completion_error(const struct ibv_wc& wc);
+    /* Block until the CQ yields something: busy-poll up to the spin budget,
+     * then sleep on the completion channel (if there is one) */
+    void wait_completions();
 
 public:
-    explicit rdma_context(uint16_t tcp_port);
-    ~rdma_context();
+    explicit rdma_context(uint16_t tcp_port, const transfer_config& config = transfer_config());
+    virtual ~rdma_context();
 };
 
 /* Abstract server class for RPC and remote queue servers */
-class rdma_server_context : public rdma_context
+class rdma_server_context : public rdma_context, public file_receiver
 {
 private:
-    int listen_fd; /* Listening socket for TCP connection */
+    int listen_fd = -1; /* Listening socket for TCP connection */
+
+protected:
+    /* state of the in-progress receive, see start_receive() */
+    file_request cur_req;
+    uint64_t chunk_bytes = 0; /* chunk size of the current transfer */
+    bool push_mode = false; /* the client writes the chunks, we only count arrivals */
+    /* delta: the chunks are these (offset, length) ranges, not all of cur_req */
+    bool ranged = false;
+    std::vector<std::pair<uint64_t, uint32_t>> read_ranges;
+    /* batch: the manifest_bytes in front of cur_req.addr go to manifest,
+     * scattered off the read of the first chunk */
+    registered_buffer manifest;
+    uint32_t manifest_bytes = 0;
+    uint64_t num_chunks = 0;
+    uint64_t next_chunk = 0; /* next chunk index to post */
+    uint64_t bytes_completed = 0;
+
+    /* per-QP completion tracking */
+    struct per_qp_stats {
+        int reads_in_flight = 0;
+        uint64_t chunks_completed = 0;
+        uint64_t bytes_completed = 0;
+    };
+    std::vector<per_qp_stats> qp_stats;
+    int next_qp = 0; /* round-robin cursor for striping */
 
 public:
-    explicit rdma_server_context(uint16_t tcp_port);
+    explicit rdma_server_context(uint16_t tcp_port, const transfer_config& config = transfer_config());
+    /* Server side of an already accepted connection, sharing dev. The caller
+     * drives the handshake and the receive engine (see rdma_server) */
+    rdma_server_context(int socket_fd, std::shared_ptr<rdma_device> dev, const transfer_config& config);
 
     ~rdma_server_context();
-    void receive_file();
-    char *file;
+    /* Receive the next file of the session. Returns false when the client
+     * ended the session */
+    bool receive_file() override;
+    uint64_t received_length() const override { return file_length; }
+    int request_id = -1; /* of the last file received */
+    char *file = nullptr;
+    uint64_t file_length = 0;
 
 protected:
     void tcp_connection();
 
-    struct ibv_mr *mr_file;
+    /* Time small and bulk reads of the client's probe buffer, and size
+     * config.chunk_size and config.max_outstanding to the measured
+     * bandwidth-delay product */
+    void probe_path(const connection_establishment_data& client_info);
+
+    /* Pipelined read engine: the remote buffer described by req is split into
+     * config.chunk_size reads, and up to min(config.max_outstanding, rd_depth)
+     * of them are kept in flight on each QP until the whole buffer has landed
+     * in file. Chunks are striped round-robin over the QPs with free window
+     * slots, and land directly at their offset regardless of completion order */
+    void start_receive(const file_request& req);
+    void post_reads();
+    void chunk_extent(uint64_t chunk, uint64_t *offset, uint32_t *len) const;
+    /* Poll, post and verify until the started receive is done */
+    void drive_receive();
+    /* Account a completed read, or a pushed chunk announced by its immediate */
+    void handle_data_completion(const struct ibv_wc& wc);
+    bool receive_done() const
+    {
+        return bytes_completed == cur_req.length && (!(cur_req.flags & FILE_REQUEST_CRC) || (crc_table_ready && unverified.empty()));
+    }
+
+    /* Integrity (FILE_REQUEST_CRC): the client checksums while we read, and
+     * sends a REQ_CRC_TABLE when done. Chunks that land are queued and
+     * checked once the table has been read as well */
+    registered_buffer crc_table;
+    bool crc_table_ready = false;
+    std::vector<uint64_t> unverified; /* chunks landed but not checked */
+    bool corrupt = false; /* of the current transfer */
+    /* Handle the messages the client sends during a transfer */
+    void take_transfer_messages();
+    /* Check the queued chunks, if the table is here. Call after post_reads(),
+     * so the checking overlaps with the reads in flight */
+    void verify_chunks();
+
+    /* Allocate and register the destination buffer for req and start reading */
+    void begin_receive(const file_request& req);
+    /* Report per-QP stats of the completed receive */
+    void finish_receive();
+    void release_file();
+
+    registered_buffer file_buf; /* backs file, from the device's mem_pool */
+    struct ibv_mr *mr_file = nullptr;
+
+    /* zero-copy receive (config.output_dir): file is a shared mapping of out_fd */
+    std::string output_prefix = "file_"; /* files are named <output_dir>/<output_prefix><request_id>, deltas as the client names them */
+    int out_fd = -1;
+    std::string output_path(const file_request& req) const;
+    void map_output_file(const file_request& req);
+    /* Size out_fd to length, map it and register the mapping as file */
+    void map_out_fd(uint64_t length);
+
+    /* Streaming receive: memory stays at config.stream_slots slots whatever
+     * the file size. Segments announced by the client are RDMA-read into free
+     * slots, and a stream_writer drains completed slots to disk */
+    void receive_stream(const file_request& req);
+
+    /* Delta receive (FILE_REQUEST_DELTA): sign the previous version, the
+     * file of output_dir the client names, then build the new one in a clone of it (a reflink where
+     * the filesystem has them, so unchanged extents stay shared), copying
+     * the blocks that moved and reading only the rest from the client. The
+     * result replaces the old file once complete and verified */
+    void receive_delta(const file_request& req);
+    /* Read the name the client sends for request req, checked to be a file of output_dir */
+    std::string delta_basis_name(const file_request& req);
+
+    /* Batch receive (FILE_REQUEST_BATCH): read the packed files like one
+     * file, manifest included, then unpack them into output_dir */
+    void receive_batch(const file_request& req);
 };
 
 /* Abstract client class for RPC and remote queue parts of the exercise */
-class rdma_client_context : public rdma_context
+class rdma_client_context : public rdma_context, public file_sender
 {
 private:
 
 public:
-    explicit rdma_client_context(uint16_t tcp_port);
+    explicit rdma_client_context(uint16_t tcp_port, const transfer_config& config = transfer_config());
+    /* Connect on a device already opened by someone else (see rdma_client_pool) */
+    rdma_client_context(uint16_t tcp_port, std::shared_ptr<rdma_device> dev, const transfer_config& config);
 
+    /* Ends the session */
     ~rdma_client_context();
 
-    bool send_file(int file_id, char *filename);
+    /* A connected client is a session: it carries any number of files, each
+     * under its own request_id, until it is destroyed. This one numbers them
+     * itself, returning the id used or -1 on failure */
+    int send_file(const char *filename) override;
+    bool send_file(int file_id, const char *filename) override;
+    /* Send a caller-owned buffer. Its registration is cached by address range,
+     * so repeated sends of the same memory skip ibv_reg_mr. Call
+     * invalidate_buffer() before freeing or reusing that memory elsewhere */
+    bool send_buffer(int file_id, void *buffer, uint64_t length) override;
+    /* The same, under name in the server's output dir. Delta transfers
+     * (config.delta) need a name: the server diffs against its file of that
+     * name, and sends of files use their base name */
+    bool send_buffer(int file_id, void *buffer, uint64_t length, const char *name);
+    void invalidate_buffer(void *buffer, uint64_t length);
+    /* Send the regular files of a directory. Those smaller than a chunk go
+     * packed into batches, one request and one registered region each, and
+     * the server unpacks them into its output dir under their own names; the
+     * rest are sent one by one. Returns the number of files sent, or -1 */
+    int send_directory(const char *path);
+
+    /* GET object id (the object_id an upload was acked with, by this or
+     * any other client) from the object cache of a multi-client server,
+     * with one-sided reads of its directory and the object. On a hit, the
+     * object is in *buf, a pool buffer the caller hands back with
+     * put_object(). False on a miss */
+    bool get_object(uint64_t id, registered_buffer *buf, uint64_t *length);
+    void put_object(const registered_buffer& buf) { device->mem_pool->put(buf); }
+    /* The id the server caches the last file sent under, 0 if it doesn't */
+    uint64_t object_id = 0;
 
 protected:
+    int next_request_id = 1;
+    bool connected = false; /* the server expects an end of session message */
+    int take_request_id();
+
+    /* object cache directory of the server, once asked for */
+    file_request directory = {};
+    bool directory_known = false;
+    registered_buffer directory_copy;
+
+    /* Tell the server the session is over, once */
+    void end_session();
+
     void tcp_connection();
+    /* Create and connect the QPs once the socket and device are up */
+    void connect_to_server();
+
+    /* Register a read-only mmap of the file and send it without copying */
+    bool send_file_mapped(int file_id, int fd, uint64_t length);
+    /* Page the file through a ring of registered slots the server reads from */
+    bool send_file_streamed(int file_id, int fd, uint64_t length);
+    /* Streaming, with segments read and deflated by worker threads while
+     * earlier ones are on the wire, for links slower than the CPUs */
+    bool send_file_compressed(int file_id, int fd, uint64_t length);
+    /* Policy, from the first COMPRESS_SAMPLE segments: is the transfer
+     * faster deflated, given the ratio and deflate rate seen so far and the
+     * link rate (configured, or the rate the wire bytes went out at)? */
+    bool compression_pays(uint64_t raw_bytes, uint64_t deflated_bytes, uint64_t deflate_ns,
+                          uint64_t wire_bytes, uint64_t wire_ns);
+    /* Hand a registered buffer to the server and wait until it has read it,
+     * or write it to the server in push mode */
+    bool send_registered(int file_id, void *buffer, uint64_t length, struct ibv_mr *mr);
+    bool send_pushed(int file_id, void *buffer, uint64_t length, struct ibv_mr *mr);
+
+    struct batch_file {
+        std::string path;
+        std::string name;
+        uint64_t length;
+    };
+    /* Read files into one region behind their manifest and send it as one request */
+    bool send_batch(int file_id, const std::vector<batch_file>& files);
+
+    /* Delta (config.delta): name the server's old copy, read its
+     * signatures, find its blocks in buffer and send where they are. Name
+     * and plan stay registered until the ack. Returns the bytes the server
+     * has to read */
+    std::string delta_name; /* of what is being sent; set by every send_file() and send_buffer() */
+    registered_buffer delta_basis;
+    registered_buffer delta_plan;
+    bool send_delta_plan(int file_id, const char *buffer, uint64_t length, uint64_t *literal);
+
+    /* Integrity (config.verify): the CRC32C of every crc_block bytes of the
+     * file being sent, for the server to read */
+    registered_buffer crc_table;
+    uint32_t crc_block = 0;
+    /* Checksum the blocks of buffer in [offset, end); offset is block aligned */
+    void checksum_blocks(const char *buffer, uint64_t length, uint64_t offset, uint64_t end);
+    void send_checksums(int file_id, uint64_t length);
+    /* Take the server's ack of a file: note its object_id, and tell whether
+     * the server found the data intact, reporting it if not */
+    bool check_ack(const file_request& ack);
 };
 
 
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+
+/* A failure of the transfer engine: a verbs or socket call, the connection,
+ * a peer breaking the protocol. Thrown rather than exiting, so applications
+ * that embed transfers can fail one and carry on; the command line tools
+ * print it and exit */
+class rdma_error : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/* printf-style */
+[[noreturn]] __attribute__((format(printf, 1, 2))) inline void throw_error(const char *fmt, ...)
+{
+    char msg[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    throw rdma_error(msg);
+}
+
+/* "what: strerror(errno)", as perror() would print it */
+[[noreturn]] inline void throw_errno(const char *what)
+{
+    throw rdma_error(std::string(what) + ": " + strerror(errno));
+}
@@ -0,0 +1,34 @@
+#include "rdma_pool.h"
+
+rdma_client_pool::rdma_client_pool(uint16_t tcp_port, int size, const transfer_config& config) :
+    tcp_port(tcp_port), config(config)
+{
+    /* one device context, PD and buffer pool behind all connections */
+    device = std::make_shared<rdma_device>(config.device_name, config.huge_page_size);
+
+    for (int i = 0; i < size; i++)
+        conns.push_back(std::make_unique<rdma_client_context>(tcp_port, device, config));
+    created = size;
+    printf("client pool: %d connections ready\n", size);
+}
+
+std::unique_ptr<rdma_client_context> rdma_client_pool::acquire()
+{
+    if (conns.empty()) {
+        created++;
+        if (config.verbose)
+            printf("client pool: empty, opening connection #%d\n", created);
+        return std::make_unique<rdma_client_context>(tcp_port, device, config);
+    }
+
+    /* the most recently used one has the warmest caches */
+    std::unique_ptr<rdma_client_context> conn = std::move(conns.back());
+    conns.pop_back();
+    return conn;
+}
+
+void rdma_client_pool::release(std::unique_ptr<rdma_client_context> conn)
+{
+    if (conn)
+        conns.push_back(std::move(conn));
+}
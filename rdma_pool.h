@@ -0,0 +1,31 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "rdma_context.h"
+
+/* Client connections to one server, opened ahead of time. Each is a complete
+ * session (socket, CQ, connected QPs, posted receives) on one shared device,
+ * so a new logical transfer that takes one from the pool starts without any
+ * verbs setup. Connections go back to the pool after use and stay
+ * connected. The server must serve several clients at once (server multi
+ * or srq) */
+class rdma_client_pool
+{
+public:
+    rdma_client_pool(uint16_t tcp_port, int size, const transfer_config& config = transfer_config());
+
+    /* An idle connection, or a new one when all are taken */
+    std::unique_ptr<rdma_client_context> acquire();
+    void release(std::unique_ptr<rdma_client_context> conn);
+
+    size_t idle() const { return conns.size(); }
+
+private:
+    uint16_t tcp_port;
+    transfer_config config;
+    std::shared_ptr<rdma_device> device;
+    std::vector<std::unique_ptr<rdma_client_context>> conns; /* idle, most recently used last */
+    int created = 0;
+};
@@ -0,0 +1,656 @@
+#include "rdma_server.h"
+
+#include <errno.h>
+
+#define MAX_EPOLL_EVENTS 64
+
+////////////////////////////////////////////////////////////////////////
+//////////////////////////// SHARED QUEUES /////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+shared_queues::shared_queues(std::shared_ptr<rdma_device> dev) :
+    device(dev)
+{
+    struct ibv_srq_init_attr srq_init_attr = {};
+    srq_init_attr.attr.max_wr = std::min(SRQ_SIZE, dev->device_attr.max_srq_wr);
+    srq_init_attr.attr.max_sge = 1;
+    srq = ibv_create_srq(dev->pd, &srq_init_attr);
+    if (!srq) {
+        throw_errno("ibv_create_srq() failed");
+    }
+    printf("    srq ptr:			%p, %d entries\n", srq, srq_init_attr.attr.max_wr);
+
+    /* every shared CQ reports to this one channel, so one fd wakes the server for all */
+    channel = ibv_create_comp_channel(dev->context);
+    if (!channel) {
+        throw_errno("ibv_create_comp_channel() failed");
+    }
+    fcntl(channel->fd, F_SETFL, fcntl(channel->fd, F_GETFL) | O_NONBLOCK);
+
+    /* one registration for the receive buffers of all connections */
+    {
+        METRIC_SCOPE(PHASE_MR_REG);
+        mr_recv_buffers = ibv_reg_mr(dev->pd, recv_buffers.begin(), sizeof(recv_buffers), IBV_ACCESS_LOCAL_WRITE);
+    }
+    if (!mr_recv_buffers) {
+        throw_errno("ibv_reg_mr() failed for shared receive buffers");
+    }
+    for (int i = 0; i < (int)srq_init_attr.attr.max_wr; i++)
+        post_recv(i);
+}
+
+shared_queues::~shared_queues()
+{
+    ibv_destroy_srq(srq);
+    ibv_dereg_mr(mr_recv_buffers);
+    for (cq_slot& slot : cqs)
+        ibv_destroy_cq(slot.cq);
+    ibv_destroy_comp_channel(channel);
+}
+
+struct ibv_cq *shared_queues::acquire_cq(int entries)
+{
+    for (cq_slot& slot : cqs)
+        if (slot.capacity - slot.used >= entries) {
+            slot.used += entries;
+            return slot.cq;
+        }
+
+    /* every shared CQ is full: add one. Any of them may get all SRQ receives */
+    int cqe = std::min(SHARED_CQ_SIZE, device->device_attr.max_cqe);
+    struct ibv_cq *cq = ibv_create_cq(device->context, cqe, NULL, channel, 0);
+    if (!cq) {
+        throw_errno("ibv_create_cq() failed");
+    }
+    if (int ret = ibv_req_notify_cq(cq, 0)) {
+        errno = ret;
+        throw_errno("ibv_req_notify_cq() failed");
+    }
+    cq_slot slot = { cq, cqe - SRQ_SIZE, entries };
+    if (slot.capacity < entries) {
+        throw_error("shared CQ of %d entries cannot fit a connection needing %d", cqe, entries);
+    }
+    cqs.push_back(slot);
+    printf("    shared cq #%zu ptr:	%p\n", cqs.size(), cq);
+    return cq;
+}
+
+void shared_queues::release_cq(struct ibv_cq *cq, int entries)
+{
+    for (cq_slot& slot : cqs)
+        if (slot.cq == cq)
+            slot.used -= entries;
+}
+
+void shared_queues::add_qps(const std::vector<struct ibv_qp *>& qps, rdma_server_connection *owner)
+{
+    for (struct ibv_qp *qp : qps)
+        qp_owner[qp->qp_num] = owner;
+}
+
+void shared_queues::remove_qps(const std::vector<struct ibv_qp *>& qps)
+{
+    for (struct ibv_qp *qp : qps)
+        qp_owner.erase(qp->qp_num);
+}
+
+rdma_server_connection *shared_queues::owner(uint32_t qp_num) const
+{
+    auto it = qp_owner.find(qp_num);
+    return it == qp_owner.end() ? nullptr : it->second;
+}
+
+void shared_queues::post_recv(int index)
+{
+    struct ibv_recv_wr recv_wr = {}, *bad_wr;
+    ibv_sge sgl = {};
+
+    recv_wr.wr_id = WR_ID(WR_RECV, index);
+    sgl.addr = (uintptr_t)&recv_buffers[index];
+    sgl.length = sizeof(recv_buffers[0]);
+    sgl.lkey = mr_recv_buffers->lkey;
+    recv_wr.sg_list = &sgl;
+    recv_wr.num_sge = 1;
+    if (int ret = ibv_post_srq_recv(srq, &recv_wr, &bad_wr)) {
+        errno = ret;
+        throw_errno("ibv_post_srq_recv() failed");
+    }
+}
+
+int shared_queues::poll()
+{
+    struct ibv_wc wc[CQ_POLL_BATCH];
+    int total = 0;
+
+    for (cq_slot& slot : cqs) {
+        int n = ibv_poll_cq(slot.cq, CQ_POLL_BATCH, wc);
+        if (n < 0) {
+            throw_errno("Error polling CQ");
+        }
+        for (int i = 0; i < n; i++) {
+            /* completions of QPs already torn down have no owner anymore */
+            rdma_server_connection *conn = owner(wc[i].qp_num);
+            bool recv = WR_KIND(wc[i].wr_id) == WR_RECV;
+            int index = WR_USER_ID(wc[i].wr_id);
+            if (conn && recv && wc[i].status == IBV_WC_SUCCESS) {
+                conn->deliver_message(recv_buffers[index]);
+            } else if (conn) {
+                try {
+                    conn->handle_completion(wc[i]);
+                } catch (const rdma_error& e) {
+                    conn->fail(e.what());
+                }
+            }
+
+            /* receive buffers go straight back to the common pool */
+            if (recv)
+                post_recv(index);
+        }
+        total += n;
+    }
+    return total;
+}
+
+void shared_queues::handle_cq_events()
+{
+    struct ibv_cq *ev_cq;
+    void *ev_ctx;
+
+    /* the caller polls every CQ right after, so re-arming first loses nothing */
+    while (!ibv_get_cq_event(channel, &ev_cq, &ev_ctx)) {
+        ibv_ack_cq_events(ev_cq, 1);
+        if (int ret = ibv_req_notify_cq(ev_cq, 0)) {
+            errno = ret;
+            throw_errno("ibv_req_notify_cq() failed");
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+////////////////////////////// CONNECTION //////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+rdma_server_connection::rdma_server_connection(int socket_fd, std::shared_ptr<rdma_device> dev, const transfer_config& config,
+                                               shared_queues *shared, object_cache *cache) :
+    rdma_server_context(socket_fd, dev, config), shared(shared), cache(cache)
+{
+    output_prefix = "client" + std::to_string(socket_fd) + "_file_";
+}
+
+rdma_server_connection::~rdma_server_connection()
+{
+    if (shared && cq) {
+        shared->remove_qps(qps);
+        shared->release_cq(cq, cq_entries);
+    }
+}
+
+void rdma_server_connection::handle_input()
+{
+    while (st != CLOSED) {
+        /* past the handshake the client has nothing to say on the socket;
+         * read only to notice it hanging up */
+        char scratch[64];
+        bool handshake = st == WAIT_CONNECTION_DATA;
+        ssize_t ret = handshake ? recv(socket_fd, in + in_len, sizeof(in) - in_len, 0)
+                                : recv(socket_fd, scratch, sizeof(scratch), 0);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            perror("recv");
+            st = CLOSED;
+            return;
+        }
+        if (ret == 0) {
+            st = CLOSED;
+            return;
+        }
+
+        if (!handshake)
+            continue;
+        in_len += ret;
+        if (in_len == sizeof(in)) {
+            in_len = 0;
+            handle_message();
+        }
+    }
+}
+
+void rdma_server_connection::handle_message()
+{
+    connection_establishment_data client_info;
+    memcpy(&client_info, in, sizeof(client_info));
+    print_connection_establishment_data("remote", client_info);
+
+    if (shared) {
+        /* worst case on the CQ: every send WQE of every QP completes at once */
+        int num_qps = std::max(1, std::min(client_info.num_qps, MAX_NUM_QPS));
+        cq_entries = num_qps * (config.max_requests + config.max_outstanding);
+        use_shared_queues(shared->acquire_cq(cq_entries), shared->srq);
+    } else {
+        use_completion_channel();
+    }
+
+    /* same steps as the blocking rdma_server_context constructor */
+    create_qps(client_info.num_qps);
+    if (shared) {
+        shared->add_qps(qps, this);
+        /* waiting for a non-inline ack would mean polling CQs other clients share */
+        if (max_inline < sizeof(file_request)) {
+            fprintf(stderr, "client fd %d: device cannot inline control messages, needed with an SRQ\n", socket_fd);
+            st = CLOSED;
+            return;
+        }
+    } else {
+        arm_cq();
+    }
+    connection_establishment_data my_info = local_connection_establishment_data();
+    queue_output(&my_info, sizeof(my_info));
+    print_connection_establishment_data("local ", my_info);
+    connect_qp(client_info);
+
+    /* receives are posted: the client may start sending requests */
+    char ready = 1;
+    queue_output(&ready, sizeof(ready));
+    st = WAIT_REQUEST;
+}
+
+void rdma_server_connection::handle_request(const file_request& req)
+{
+    if (req.request_id == -1) {
+        st = CLOSED;
+        return;
+    }
+    if (req.type == REQ_DIRECTORY) {
+        file_request reply = req;
+        reply.addr = cache ? cache->directory_addr() : 0;
+        reply.rkey = cache ? cache->directory_rkey() : 0;
+        reply.length = cache ? cache->directory_length() : 0;
+        send_message(reply);
+        return;
+    }
+    if (req.type != REQ_FILE || (req.flags & (FILE_REQUEST_STREAM | FILE_REQUEST_PUSH | FILE_REQUEST_DELTA | FILE_REQUEST_BATCH))) {
+        /* streaming needs a disk stage, push a landing advert, delta a
+         * signature exchange and batches an unpacking step per connection;
+         * only the single-client server does those */
+        fprintf(stderr, "client fd %d: unsupported request type %u flags 0x%x\n", socket_fd, req.type, req.flags);
+        st = CLOSED;
+        return;
+    }
+    begin_receive(req);
+    st = TRANSFERRING;
+}
+
+void rdma_server_connection::progress()
+{
+    if (st == WAIT_CONNECTION_DATA || st == CLOSED)
+        return;
+
+    if (!shared) {
+        struct ibv_wc wc[CQ_POLL_BATCH];
+        int n = ibv_poll_cq(cq, CQ_POLL_BATCH, wc);
+        if (n < 0) {
+            perror("Error polling CQ");
+            st = CLOSED;
+            return;
+        }
+        for (int i = 0; i < n; i++)
+            handle_completion(wc[i]);
+    }
+
+    while (st == WAIT_REQUEST || st == TRANSFERRING) {
+        if (st == WAIT_REQUEST) {
+            if (inbox.empty())
+                return;
+            file_request req = inbox.front();
+            inbox.pop_front();
+            handle_request(req);
+            continue;
+        }
+
+        take_transfer_messages();
+        post_reads();
+        /* reads through shared memory are done as soon as posted, with no CQE */
+        if (data_path->poll(pending_wcs))
+            take_data_completions();
+        verify_chunks();
+        if (!receive_done())
+            return;
+        finish_receive();
+        if (config.verbose)
+            printf("client fd %d: file received: %" PRIu64 " bytes\n", socket_fd, file_length);
+        file_request ack = cur_req;
+        ack.type = REQ_ACK;
+        if (corrupt)
+            ack.flags |= FILE_ACK_CORRUPT;
+        /* request ids are the client's, and restart with each session: the
+         * object gets one of ours, which the client needs for GETs. The
+         * transfer is done, so the file can turn read-only before the ack,
+         * which only names objects the cache took */
+        uint64_t object_id = cache && !corrupt && file_buf.addr ? cache->new_id() : 0;
+        if (object_id && cache->insert(object_id, file_buf, file_length)) {
+            file_buf = registered_buffer();
+            mr_file = nullptr;
+            file = nullptr;
+            ack.flags |= FILE_ACK_OBJECT;
+            ack.addr = object_id;
+        }
+        release_file();
+        send_message(ack);
+        st = WAIT_REQUEST;
+    }
+}
+
+void rdma_server_connection::handle_completion(const struct ibv_wc& wc)
+{
+    if (st == CLOSED)
+        return;
+
+    /* messages on a private receive queue go to the inbox; reads (including
+     * the unsignaled ones this completion retires) come back as data */
+    process_completion(wc);
+    take_data_completions();
+}
+
+void rdma_server_connection::take_data_completions()
+{
+    while (!pending_wcs.empty()) {
+        struct ibv_wc data = pending_wcs.front();
+        pending_wcs.pop_front();
+        if (st == TRANSFERRING)
+            handle_data_completion(data);
+    }
+}
+
+void rdma_server_connection::completion_error(const struct ibv_wc& wc)
+{
+    /* one broken client must not take the server down: drop just this connection */
+    fail((std::string("work completion failed: ") + ibv_wc_status_str(wc.status)).c_str());
+}
+
+int rdma_server_connection::drain_cq()
+{
+    if (!shared)
+        return rdma_server_context::drain_cq();
+
+    /* our own completions come back through handle_completion(); once we
+     * failed they are dropped, so nothing we wait for can arrive anymore */
+    if (st == CLOSED) {
+        throw_error("client fd %d: connection closed", socket_fd);
+    }
+    return shared->poll() + data_path->poll(pending_wcs);
+}
+
+void rdma_server_connection::fail(const char *why)
+{
+    if (st == CLOSED)
+        return;
+    fprintf(stderr, "client fd %d: %s\n", socket_fd, why);
+    st = CLOSED;
+
+    /* reads may still be landing in our buffers: stop the QPs before those
+     * go back to the pool. Their flushed completions find no owner */
+    struct ibv_qp_attr attr = {};
+    attr.qp_state = IBV_QPS_ERR;
+    for (struct ibv_qp *q : qps)
+        ibv_modify_qp(q, &attr, IBV_QP_STATE);
+}
+
+void rdma_server_connection::handle_cq_events()
+{
+    /* progress() polls right after, so re-arming after the events loses nothing */
+    consume_cq_events();
+    arm_cq();
+}
+
+void rdma_server_connection::queue_output(const void *buffer, size_t len)
+{
+    out.append((const char *)buffer, len);
+    handle_output();
+}
+
+void rdma_server_connection::handle_output()
+{
+    while (!out.empty()) {
+        ssize_t ret = send(socket_fd, out.data(), out.size(), MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            perror("send");
+            st = CLOSED;
+            return;
+        }
+        out.erase(0, ret);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+///////////////////////////// EVENT LOOP ///////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+rdma_server::rdma_server(uint16_t tcp_port, const transfer_config& config) :
+    tcp_port(tcp_port), config(config)
+{
+    /* Open the device once; every connection borrows its context and PD */
+    device = std::make_shared<rdma_device>(config.device_name, config.huge_page_size);
+    if (config.use_srq)
+        shared = std::make_unique<shared_queues>(device);
+    if (config.cache_bytes && !config.output_dir)
+        cache = std::make_unique<object_cache>(device->mem_pool.get(), device->pd, config.cache_bytes);
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        throw_errno("epoll_create1");
+    }
+
+    if (shared) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = shared->channel_fd();
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev)) {
+            throw_errno("epoll_ctl");
+        }
+    }
+
+    tcp_listen();
+}
+
+rdma_server::~rdma_server()
+{
+    connections.clear();
+    shared.reset();
+    close(epoll_fd);
+    close(listen_fd);
+}
+
+void rdma_server::tcp_listen()
+{
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        throw_errno("socket");
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(struct sockaddr_in));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(tcp_port);
+
+    int one = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
+        throw_errno("SO_REUSEADDR");
+    }
+    /* with workers, each has its own listening socket on the port and the
+     * kernel spreads incoming connections over them */
+    if (config.num_workers != 1 && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+        throw_errno("SO_REUSEPORT");
+    }
+
+    if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in)) < 0) {
+        throw_errno("bind");
+    }
+
+    if (listen(listen_fd, SOMAXCONN)) {
+        throw_errno("listen");
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+        throw_errno("epoll_ctl");
+    }
+
+    printf("Server waiting on port %d. Clients can connect\n", tcp_port);
+}
+
+void rdma_server::accept_clients()
+{
+    while (true) {
+        int sfd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (sfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            return;
+        }
+
+        try {
+            connections[sfd] = std::make_unique<rdma_server_connection>(sfd, device, config, shared.get(), cache.get());
+        } catch (const rdma_error& e) {
+            /* the half-built context closed the socket */
+            fprintf(stderr, "client fd %d: %s\n", sfd, e.what());
+            connections.erase(sfd);
+            continue;
+        }
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = sfd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sfd, &ev)) {
+            perror("epoll_ctl");
+            connections.erase(sfd);
+            continue;
+        }
+        connections[sfd]->epoll_events = ev.events;
+        printf("client fd %d connected, %zu clients\n", sfd, connections.size());
+    }
+}
+
+void rdma_server::update_events(rdma_server_connection *conn)
+{
+    struct epoll_event ev = {};
+
+    /* a private CQ appears with the QPs, once the handshake is in */
+    if (!conn->channel_registered && conn->channel_fd() >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.fd = conn->channel_fd();
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev)) {
+            throw_errno("epoll_ctl");
+        }
+        channel_owner[ev.data.fd] = conn->fd();
+        conn->channel_registered = true;
+    }
+
+    /* requests come over the QPs; the socket is only watched for hangups */
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    if (conn->wants_output())
+        ev.events |= EPOLLOUT;
+    ev.data.fd = conn->fd();
+
+    if (ev.events == conn->epoll_events)
+        return;
+    conn->epoll_events = ev.events;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd(), &ev)) {
+        throw_errno("epoll_ctl");
+    }
+}
+
+void rdma_server::serve(rdma_server_connection *conn, const std::function<void()>& fn)
+{
+    try {
+        fn();
+    } catch (const rdma_error& e) {
+        conn->fail(e.what());
+    }
+}
+
+void rdma_server::close_connection(int fd)
+{
+    rdma_server_connection *conn = connections[fd].get();
+    if (conn->channel_registered) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->channel_fd(), NULL);
+        channel_owner.erase(conn->channel_fd());
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    connections.erase(fd);
+    printf("client fd %d disconnected, %zu clients\n", fd, connections.size());
+}
+
+void rdma_server::run()
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    while (true) {
+        /* busy-poll while transfers are in flight, sleep in epoll otherwise;
+         * completion channels wake us for new requests */
+        bool busy = false;
+        for (auto& c : connections)
+            busy |= c.second->get_state() == rdma_server_connection::TRANSFERRING;
+
+        /* evicted objects are freed once their grace period is over */
+        int timeout = cache ? cache->reap() : -1;
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, busy ? 0 : timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("epoll_wait");
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                accept_clients();
+                continue;
+            }
+            if (shared && fd == shared->channel_fd()) {
+                shared->handle_cq_events();
+                continue;
+            }
+            auto ch = channel_owner.find(fd);
+            if (ch != channel_owner.end()) {
+                rdma_server_connection *conn = connections[ch->second].get();
+                serve(conn, [conn] { conn->handle_cq_events(); });
+                continue;
+            }
+
+            auto it = connections.find(fd);
+            if (it == connections.end())
+                continue;
+            rdma_server_connection *conn = it->second.get();
+
+            uint32_t ev = events[i].events;
+            serve(conn, [conn, ev] {
+                if (ev & EPOLLOUT)
+                    conn->handle_output();
+                if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    conn->handle_input();
+            });
+        }
+
+        if (shared)
+            shared->poll();
+
+        /* drive every transfer, then drop dead connections and refresh interest sets */
+        for (auto it = connections.begin(); it != connections.end(); ) {
+            rdma_server_connection *conn = it->second.get();
+            int fd = it->first;
+            ++it;
+
+            serve(conn, [conn] { conn->progress(); });
+            if (conn->get_state() == rdma_server_connection::CLOSED)
+                close_connection(fd);
+            else
+                update_events(conn);
+        }
+    }
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <sys/epoll.h>
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+#include "rdma_context.h"
+#include "object_cache.h"
+
+class rdma_server_connection;
+
+/* Receive-side resources shared by all connections of rdma_server in SRQ
+ * mode: one SRQ stocked from a common pool of registered request buffers,
+ * and a few CQs that connections are packed onto, all reporting to one
+ * completion channel. Completions are demultiplexed back to their
+ * connection by qp_num */
+class shared_queues
+{
+public:
+    explicit shared_queues(std::shared_ptr<rdma_device> dev);
+    ~shared_queues();
+
+    struct ibv_srq *srq = nullptr;
+
+    /* Reserve room for entries completions on some shared CQ, creating a new
+     * CQ if all existing ones are full */
+    struct ibv_cq *acquire_cq(int entries);
+    void release_cq(struct ibv_cq *cq, int entries);
+
+    void add_qps(const std::vector<struct ibv_qp *>& qps, rdma_server_connection *owner);
+    void remove_qps(const std::vector<struct ibv_qp *>& qps);
+    rdma_server_connection *owner(uint32_t qp_num) const;
+
+    /* Hand receive buffer index back to the SRQ */
+    void post_recv(int index);
+
+    /* Poll every shared CQ once and dispatch the completions to their
+     * connections. Returns the number polled */
+    int poll();
+
+    /* The completion channel fd became readable: consume its events and re-arm */
+    int channel_fd() const { return channel->fd; }
+    void handle_cq_events();
+
+private:
+    std::shared_ptr<rdma_device> device;
+
+    struct cq_slot {
+        struct ibv_cq *cq;
+        int capacity; /* entries left for connections; SRQ_SIZE is reserved for receives */
+        int used;
+    };
+    std::vector<cq_slot> cqs;
+    struct ibv_comp_channel *channel = nullptr;
+
+    std::unordered_map<uint32_t, rdma_server_connection *> qp_owner;
+
+    std::array<file_request, SRQ_SIZE> recv_buffers; /* common pool behind the SRQ */
+    struct ibv_mr *mr_recv_buffers = nullptr;
+};
+
+/* One client of rdma_server: the server side of an rdma_context plus the
+ * state of its non-blocking handshake. The handshake is assembled from
+ * whatever the socket has available so no client can stall the others;
+ * after that, requests and acks are SENDs on the QPs as in the blocking
+ * rdma_server_context flow, and the socket only tells us the client left */
+class rdma_server_connection : public rdma_server_context
+{
+public:
+    enum state {
+        WAIT_CONNECTION_DATA, /* reading the client's connection_establishment_data */
+        WAIT_REQUEST,         /* QPs are connected, waiting for the next file_request */
+        TRANSFERRING,         /* RDMA reads of the current file are in flight */
+        CLOSED,               /* peer went away or failed; to be destroyed */
+    };
+
+    /* shared is non-null in SRQ mode; received files go to cache, if any */
+    rdma_server_connection(int socket_fd, std::shared_ptr<rdma_device> dev, const transfer_config& config,
+                           shared_queues *shared = nullptr, object_cache *cache = nullptr);
+    ~rdma_server_connection();
+
+    /* Socket is readable: consume as much of the handshake as is available,
+     * or notice the client hung up */
+    void handle_input();
+    /* Socket is writable: flush queued output */
+    void handle_output();
+    /* Poll the private CQ, if any, serve received requests, keep the read
+     * window full and ack the transfer once all chunks are in */
+    void progress();
+    /* Account one completion of this connection's QPs */
+    void handle_completion(const struct ibv_wc& wc);
+    /* A request that arrived through the shared receive pool */
+    void deliver_message(const file_request& msg) { inbox.push_back(msg); }
+    /* The private completion channel fd became readable: consume its events and re-arm */
+    void handle_cq_events();
+
+    /* Drop this client after an error of its own; the server carries on */
+    void fail(const char *why);
+
+    int fd() const { return socket_fd; }
+    int channel_fd() const { return channel ? channel->fd : -1; }
+    state get_state() const { return st; }
+    bool wants_output() const { return !out.empty(); }
+
+    uint32_t epoll_events = 0; /* interest set currently registered by rdma_server */
+    bool channel_registered = false; /* channel_fd() was added to the epoll set */
+
+protected:
+    void completion_error(const struct ibv_wc& wc) override;
+    /* With a shared CQ, poll it for every client through shared_queues: a
+     * full SQ or any other wait must not eat completions of the others */
+    int drain_cq() override;
+
+private:
+    state st = WAIT_CONNECTION_DATA;
+    shared_queues *shared;
+    object_cache *cache;
+    int cq_entries = 0; /* reserved on the shared CQ */
+
+    /* partially received connection data */
+    char in[sizeof(connection_establishment_data)];
+    size_t in_len = 0;
+    std::string out; /* queued bytes the socket did not take yet */
+
+    void handle_message();
+    void handle_request(const file_request& req);
+    /* Account the data completions process_completion() queued */
+    void take_data_completions();
+    void queue_output(const void *buffer, size_t len);
+};
+
+/* Long-running server: accepts any number of clients on one listening socket
+ * and drives their handshakes and transfers from a single epoll loop. All
+ * connections share one rdma_device (device context and PD). To use more
+ * cores, run one rdma_server per worker_pool worker, with config.num_workers
+ * set: each then listens on the port with SO_REUSEPORT and serves the
+ * clients the kernel hands it on its own device context */
+class rdma_server
+{
+public:
+    explicit rdma_server(uint16_t tcp_port, const transfer_config& config = transfer_config());
+    ~rdma_server();
+
+    /* Serve clients forever */
+    void run();
+
+private:
+    uint16_t tcp_port;
+    transfer_config config;
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    std::shared_ptr<rdma_device> device;
+    std::unique_ptr<shared_queues> shared; /* SRQ mode only */
+    std::unique_ptr<object_cache> cache; /* config.cache_bytes, unless files go to config.output_dir */
+    std::unordered_map<int, std::unique_ptr<rdma_server_connection>> connections; /* by socket fd */
+    std::unordered_map<int, int> channel_owner; /* completion channel fd -> socket fd */
+
+    void tcp_listen();
+    void accept_clients();
+    void update_events(rdma_server_connection *conn);
+    /* Run fn for conn, closing just that connection if it throws */
+    void serve(rdma_server_connection *conn, const std::function<void()>& fn);
+    void close_connection(int fd);
+};
@@ -6,16 +6,24 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <deque>
 #include <memory>
 #include "rdma_context.h"
+#include "rdma_server.h"
+#include "async_transfer.h"
+#include "tcp_transfer.h"
+#include "worker_pool.h"
 
 #define TCP_PORT_OFFSET 23456
 #define TCP_PORT_RANGE 1000
 
-void parse_arguments(int argc, char **argv, uint16_t *tcp_port)
+#define ASYNC_RECEIVES 4 /* receives the async mode keeps submitted */
+#define ASYNC_BUFFER_SIZE (64UL << 20) /* largest file it takes */
+
+void parse_arguments(int argc, char **argv, uint16_t *tcp_port, bool *multi_client, bool *use_async, transfer_config *config)
 {
     if (argc < 1) {
-        printf("usage: %s [tcp port]\n", argv[0]);
+        printf("usage: %s [tcp port] [single|multi|srq|async] [output dir]\n", argv[0]);
         exit(1);
     }
 
@@ -24,32 +32,136 @@ void parse_arguments(int argc, char **argv, uint16_t *tcp_port)
     } else {
         *tcp_port = atoi(argv[1]);
     }
+
+    /* single: receive one file from one client and exit.
+     * multi: keep serving any number of concurrent clients.
+     * srq: like multi, with all clients sharing one SRQ and a few CQs.
+     *   Both spread clients over RDMA_WORKERS pinned threads.
+     * async: like single, with several receives submitted at once, each
+     *   into a buffer of its own (see serve_async) */
+    *multi_client = argc > 2 && (!strcmp(argv[2], "multi") || !strcmp(argv[2], "srq"));
+    config->use_srq = argc > 2 && !strcmp(argv[2], "srq");
+    *use_async = argc > 2 && !strcmp(argv[2], "async");
+
+    /* with an output dir, files are RDMA-read straight into mmap'd files there */
+    if (argc > 3)
+        config->output_dir = argv[3];
+}
+
+/* Serve one client with ASYNC_RECEIVES receives in flight, each future
+ * resubmitted with its buffer once it is ready. A file larger than a buffer
+ * fails its own receive (and the client's send) and the session goes on,
+ * until the client ends it */
+static void serve_async(uint16_t tcp_port, const transfer_config& config)
+{
+    rdma_async_server server(tcp_port, config);
+    printf("waiting to receive files...\n");
+
+    std::deque<std::pair<char *, std::future<received_file>>> receives;
+    std::vector<std::unique_ptr<char[]>> buffers;
+    for (int i = 0; i < ASYNC_RECEIVES; i++) {
+        buffers.emplace_back(new char[ASYNC_BUFFER_SIZE]);
+        receives.emplace_back(buffers.back().get(), server.submit_receive(buffers.back().get(), ASYNC_BUFFER_SIZE));
+    }
+
+    /* files arrive in submission order, so the oldest future is the next one ready */
+    bool ended = false;
+    while (!receives.empty()) {
+        char *buffer = receives.front().first;
+        std::future<received_file> f = std::move(receives.front().second);
+        receives.pop_front();
+        try {
+            received_file r = f.get();
+            printf("request %d: %" PRIu64 " bytes received\n", r.request_id, r.length);
+        } catch (const transfer_failed& e) {
+            fprintf(stderr, "%s\n", e.what());
+        } catch (const rdma_error& e) {
+            /* the session is over, and with it every receive still waiting */
+            if (!ended)
+                printf("%s\n", e.what());
+            ended = true;
+            continue;
+        }
+        receives.emplace_back(buffer, server.submit_receive(buffer, ASYNC_BUFFER_SIZE));
+    }
 }
 
 
 
-int main(int argc, char *argv[]) {
+int main(int argc, char *argv[]) try {
 
     uint16_t tcp_port;
+    bool multi_client, use_async;
+    transfer_config config;
 
-    parse_arguments(argc, argv, &tcp_port);
+    load_config_env(&config);
+    parse_arguments(argc, argv, &tcp_port, &multi_client, &use_async, &config);
     if (!tcp_port) {
         srand(time(NULL));
         tcp_port = TCP_PORT_OFFSET + (rand() % TCP_PORT_RANGE); /* to avoid conflicts with other users of the machine */
     }
 
-    auto server = std::make_unique<rdma_server_context>(tcp_port);
+    bool tcp = tcp_transfers(config);
+    if (tcp && (multi_client || use_async)) {
+        printf("%s needs RDMA; serving one client over TCP\n", argv[2]);
+        multi_client = use_async = false;
+    }
+
+    if (multi_client && config.num_workers != 1) {
+        /* RDMA_WORKERS: one server loop per pinned worker, sharing only the port */
+        worker_pool workers(config.device_name, config.num_workers);
+        workers.run([&](int worker) {
+            /* the loops don't return, so the others would never see a failed one out */
+            try {
+                rdma_server server(tcp_port, config);
+                server.run();
+            } catch (const rdma_error& e) {
+                fprintf(stderr, "worker %d: %s\n", worker, e.what());
+                exit(1);
+            }
+        });
+        return 0;
+    }
+
+    /* everything below runs on this thread; keep it and its buffers near the NIC */
+    if (!tcp)
+        run_near_nic(config.device_name);
+
+    if (multi_client) {
+        rdma_server server(tcp_port, config);
+        server.run();
+        return 0;
+    }
+
+    if (use_async) {
+        serve_async(tcp_port, config);
+        metrics_report();
+        printf("exiting...\n");
+        return 0;
+    }
+
+    std::unique_ptr<file_receiver> server;
+    if (tcp)
+        server = std::make_unique<tcp_server_context>(tcp_port, config);
+    else
+        server = std::make_unique<rdma_server_context>(tcp_port, config);
     if (!server) {
         printf("Error creating server context.\n");
         exit(1);
     }
     printf("waiting to receive file...\n");
 
-    server->receive_file();
-
-    printf("file received: %s\n", server->file);
+    /* the client may send any number of files before ending the session */
+    while (server->receive_file())
+        if (config.verbose)
+            printf("file received: %" PRIu64 " bytes\n", server->received_length());
 
+    server.reset();
+    metrics_report();
     printf("exiting...\n");
 
     return 0;
+} catch (const rdma_error& e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
 }
@@ -9,4 +9,133 @@
 
 #define MAX_NUM_REQUESTS 10
 
+/* cap on the path MTU in bytes; the QPs use the largest active MTU both
+ * ports support up to it (0: no cap). Local ACK timeout exponent of the QPs */
+#define PATH_MTU 0
+#define QP_TIMEOUT 14
 
+/* path probe run by the server right after connecting: PROBE_PINGS single
+ * small reads for the round trip, then PROBE_SIZE bytes read in
+ * PROBE_CHUNK chunks for the bandwidth. Chunk size is then tuned within
+ * [TUNE_MIN_CHUNK, TUNE_MAX_CHUNK] so the read window covers twice the
+ * bandwidth-delay product */
+#define TUNE_TRANSFERS 1
+#define PROBE_PINGS 8
+#define PROBE_SIZE (8 << 20)
+#define PROBE_CHUNK (256 << 10)
+#define TUNE_MIN_CHUNK (64 << 10)
+#define TUNE_MAX_CHUNK (4 << 20)
+
+/* client: times a refused connect is retried, 100ms apart */
+#define CONNECT_RETRIES 50
+
+/* server: largest file a client may ask it to receive, in memory or in
+ * output_dir; larger requests fail without anything being allocated */
+#define MAX_FILE_SIZE (64ULL << 30)
+
+/* size of a single RDMA read issued by the receive pipeline */
+#define CHUNK_SIZE (1 << 20)
+/* max RDMA reads kept in flight; clamped to the negotiated read depth */
+#define MAX_OUTSTANDING_READS 16
+
+/* RC QPs a transfer is striped across; the server follows the client's choice */
+#define NUM_QPS 1
+#define MAX_NUM_QPS 16
+
+/* scatter/gather entries per send WQE, if the device has that many */
+#define MAX_SGE 16
+
+/* threads pinned near the HCA that a multi-client server, or a client
+ * sending a list of files, spreads its connections over; each has its own
+ * device context, QPs, CQs and buffers. 0: one per CPU local to the HCA */
+#define NUM_WORKERS 1
+
+/* multi-client server in SRQ mode: receive buffers in the shared pool, and
+ * entries per shared CQ (more CQs are created as connections fill them up) */
+#define SRQ_SIZE 256
+#define SHARED_CQ_SIZE 4096
+
+/* registered buffer pool: power-of-two size classes from 2^MEM_POOL_MIN_SHIFT
+ * to 2^MEM_POOL_MAX_SHIFT bytes, keeping at most MEM_POOL_MAX_CACHED bytes
+ * registered while idle. MR_CACHE_SIZE registrations of caller buffers are kept */
+#define MEM_POOL_MIN_SHIFT 12
+#define MEM_POOL_MAX_SHIFT 30
+#define MEM_POOL_MAX_CACHED (1UL << 30)
+#define MR_CACHE_SIZE 64
+
+/* pages of pool buffers (see alloc_pages): those of at least HUGE_PAGE_SIZE
+ * bytes come from reserved hugetlb pages of that size, those of at least
+ * THP_PAGE_SIZE from transparent hugepages. 0 keeps every buffer on 4 KiB
+ * pages; (1UL << 30) asks for 1 GiB pages */
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define THP_PAGE_SIZE (2UL << 20)
+
+/* streaming transfers: each side stages the file through a ring of
+ * STREAM_SLOTS registered slots of STREAM_SLOT_SIZE bytes */
+#define STREAM_SLOT_SIZE (4 << 20)
+#define STREAM_SLOTS 8
+/* bounds on the client's ring the server accepts */
+#define STREAM_MAX_SLOT_SIZE (1U << 30)
+#define STREAM_MAX_SLOTS 1024
+
+/* integrity: the client checksums every CRC_BLOCK_SIZE bytes it sends with
+ * CRC32C (each segment when streaming), and the server checks every chunk
+ * against them as its read completes */
+#define VERIFY_TRANSFERS 1
+#define CRC_BLOCK_SIZE (64 << 10)
+
+/* delta transfers (opt in): the server signs its previous copy of a file in
+ * blocks of DELTA_BLOCK_SIZE, and the client only sends what doesn't match */
+#define DELTA_BLOCK_SIZE (16 << 10)
+
+/* directory transfers: files smaller than a chunk travel packed into
+ * batches of up to BATCH_BYTES and BATCH_MAX_FILES, one request each */
+#define BATCH_BYTES (8 << 20)
+#define BATCH_MAX_FILES 4096
+
+/* object cache of the multi-client server: received files stay registered,
+ * up to OBJECT_CACHE_BYTES in OBJECT_CACHE_SLOTS directory entries. An
+ * evicted object stays readable for OBJECT_CACHE_GRACE_MS before its rkey
+ * is revoked, so clients that looked it up just before don't fault */
+#define OBJECT_CACHE_BYTES (1UL << 30)
+#define OBJECT_CACHE_SLOTS 1024
+#define OBJECT_CACHE_GRACE_MS 1000
+#define OBJECT_GET_ATTEMPTS 8 /* client: lookups racing an update before a GET gives up */
+
+/* peers on one host move data with process_vm_readv/writev instead of
+ * through the NIC; RDMA_SHM=0 keeps them on verbs */
+#define SHARED_MEMORY_TRANSFERS 1
+
+/* TCP transfers (RDMA_TCP=1, or no RDMA device on the host): files are
+ * striped in chunks over TCP_STREAMS connections, TCP_MAX_STREAMS at most.
+ * Buffers go out with MSG_ZEROCOPY in sends of at least TCP_ZEROCOPY_MIN
+ * bytes; below that, pinning the pages costs more than copying them */
+#define TCP_STREAMS 4
+#define TCP_MAX_STREAMS 64
+#define TCP_ZEROCOPY_MIN (64 << 10)
+
+/* compression (opt in, streaming sends): COMPRESS_THREADS workers deflate
+ * segments at zlib level COMPRESS_LEVEL. Once the server has taken
+ * COMPRESS_SAMPLE segments, the client keeps compressing only if that makes
+ * the transfer at least COMPRESS_MIN_GAIN times faster. While workers are
+ * busy, the client waits for them in steps of COMPRESS_WAIT_US */
+#define COMPRESS_THREADS 4
+#define COMPRESS_LEVEL 1
+#define COMPRESS_SAMPLE 4
+#define COMPRESS_MIN_GAIN 1.1
+#define COMPRESS_WAIT_US 100
+
+/* completion engine: one send WR in SIGNAL_INTERVAL asks for a completion
+ * (plus those a caller waits on), CQEs are polled CQ_POLL_BATCH at a time,
+ * and a waiter busy-polls up to POLL_SPIN_US microseconds before sleeping
+ * on the completion channel */
+#define SIGNAL_INTERVAL 8
+#define CQ_POLL_BATCH 32
+#define POLL_SPIN_US 50
+
+
+/* metrics (built with -DRDMA_METRICS): events kept per thread, log2 buckets
+ * per phase histogram, and recent events per thread included in a dump */
+#define METRICS_RING_SIZE 4096
+#define METRICS_HIST_BUCKETS 48
+#define METRICS_DUMP_EVENTS 32
@@ -0,0 +1,108 @@
+#include "transport.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+host_identity local_host_identity()
+{
+    host_identity id = {};
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (f) {
+        if (fgets(id.boot_id, sizeof(id.boot_id), f))
+            id.boot_id[strcspn(id.boot_id, "\n")] = '\0';
+        fclose(f);
+    }
+    struct stat st;
+    if (!stat("/proc/self/ns/pid", &st))
+        id.pid_ns = st.st_ino;
+    id.pid = getpid();
+    return id;
+}
+
+bool same_host(const host_identity& a, const host_identity& b)
+{
+    return a.boot_id[0] && !strncmp(a.boot_id, b.boot_id, sizeof(a.boot_id)) && a.pid_ns && a.pid_ns == b.pid_ns;
+}
+
+shm_transport::shm_transport(pid_t peer, const std::vector<uint32_t>& qp_nums, std::unique_ptr<transport> fallback) :
+    peer(peer), qp_nums(qp_nums), fallback(std::move(fallback))
+{
+}
+
+bool shm_transport::copy(bool write, const ibv_sge *sgl, int num_sge, uint64_t remote)
+{
+    if (refused)
+        return false;
+
+    struct iovec local[num_sge];
+    size_t total = 0;
+    for (int i = 0; i < num_sge; i++) {
+        local[i].iov_base = (void *)(uintptr_t)sgl[i].addr;
+        local[i].iov_len = sgl[i].length;
+        total += sgl[i].length;
+    }
+    struct iovec peer_iov = { (void *)(uintptr_t)remote, total };
+
+    /* the kernel copies page by page and stops early only on an error */
+    ssize_t n = write ? process_vm_writev(peer, local, num_sge, &peer_iov, 1, 0)
+                      : process_vm_readv(peer, local, num_sge, &peer_iov, 1, 0);
+    if (n == (ssize_t)total)
+        return true;
+
+    refused = true;
+    fprintf(stderr, "shared memory %s of pid %d failed (%s), back to %s\n", write ? "write" : "read", peer,
+            n < 0 ? strerror(errno) : "short copy", fallback->name());
+    return false;
+}
+
+void shm_transport::complete(uint64_t wr_id, enum ibv_wc_opcode opcode, int lane)
+{
+    struct ibv_wc wc = {};
+    wc.wr_id = wr_id;
+    wc.status = IBV_WC_SUCCESS;
+    wc.opcode = opcode;
+    wc.qp_num = qp_nums[lane];
+    completed.push_back(wc);
+}
+
+void shm_transport::post_read(const ibv_sge *sgl, int num_sge, uint64_t remote, uint32_t rkey, uint64_t wr_id,
+                              int lane, bool signal)
+{
+    if (!copy(false, sgl, num_sge, remote)) {
+        fallback->post_read(sgl, num_sge, remote, rkey, wr_id, lane, signal);
+        return;
+    }
+    for (int i = 0; i < num_sge; i++)
+        METRIC_ADD(CTR_BYTES_READ, sgl[i].length);
+    complete(wr_id, IBV_WC_RDMA_READ, lane);
+}
+
+void shm_transport::post_write(const ibv_sge *sgl, int num_sge, uint64_t remote, uint32_t rkey, uint64_t wr_id,
+                               const uint32_t *immediate, int lane, bool signal)
+{
+    if (!copy(true, sgl, num_sge, remote)) {
+        fallback->post_write(sgl, num_sge, remote, rkey, wr_id, immediate, lane, signal);
+        return;
+    }
+    for (int i = 0; i < num_sge; i++)
+        METRIC_ADD(CTR_BYTES_WRITTEN, sgl[i].length);
+    if (immediate) {
+        /* the data is in place; the announcement's completion stands for the write */
+        fallback->post_write(NULL, 0, remote, rkey, wr_id, immediate, lane, signal);
+        return;
+    }
+    complete(wr_id, IBV_WC_RDMA_WRITE, lane);
+}
+
+int shm_transport::poll(std::deque<struct ibv_wc>& done)
+{
+    int n = completed.size();
+    done.insert(done.end(), completed.begin(), completed.end());
+    completed.clear();
+    return n;
+}
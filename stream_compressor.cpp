@@ -0,0 +1,161 @@
+#include "stream_compressor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "crc32c.h"
+#include "rdma_error.h"
+
+static uint64_t thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void read_fully(int fd, char *buf, size_t len, uint64_t offset)
+{
+    for (size_t done = 0; done < len; ) {
+        ssize_t ret = pread(fd, buf + done, len - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            throw_errno("pread() failed for streamed file");
+        }
+        if (!ret) {
+            throw_error("streamed file ended at %" PRIu64 ", in a segment", offset + done);
+        }
+        done += ret;
+    }
+}
+
+stream_compressor::stream_compressor(int fd, int num_threads, int level, bool checksum) :
+    fd(fd), level(level), checksum(checksum)
+{
+    for (int i = 0; i < std::max(1, num_threads); i++)
+        threads.emplace_back([this] {
+            try {
+                run();
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(lock);
+                if (!error)
+                    error = std::current_exception();
+            }
+            done_cond.notify_all();
+        });
+}
+
+stream_compressor::~stream_compressor()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    work_cond.notify_all();
+    for (std::thread& t : threads)
+        t.join();
+}
+
+void stream_compressor::submit(uint64_t index, int slot, char *slot_buf, uint32_t slot_size, uint64_t offset, uint32_t len,
+                               bool compress)
+{
+    job j = {};
+    j.seg.index = index;
+    j.seg.slot = slot;
+    j.seg.raw_len = len;
+    j.slot_buf = slot_buf;
+    j.slot_size = slot_size;
+    j.offset = offset;
+    j.compress = compress;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending.push_back(j);
+        outstanding++;
+    }
+    work_cond.notify_one();
+}
+
+void stream_compressor::reap(std::vector<segment>& segments)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (error)
+        std::rethrow_exception(error);
+    segments.insert(segments.end(), done.begin(), done.end());
+    outstanding -= done.size();
+    done.clear();
+}
+
+int stream_compressor::busy()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return outstanding;
+}
+
+void stream_compressor::wait(int timeout_us)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    done_cond.wait_for(guard, std::chrono::microseconds(timeout_us), [this] { return error || !done.empty(); });
+}
+
+void stream_compressor::run()
+{
+    std::vector<char> raw; /* staging for the bytes to deflate */
+    while (true) {
+        job j;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            work_cond.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty())
+                return;
+            j = pending.front();
+            pending.pop_front();
+        }
+
+        process(j, raw);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done.push_back(j.seg);
+        }
+        done_cond.notify_all();
+    }
+}
+
+void stream_compressor::process(job& j, std::vector<char>& raw)
+{
+    segment& seg = j.seg;
+    if (!j.compress) {
+        /* nothing to gain: read straight into the slot */
+        read_fully(fd, j.slot_buf, seg.raw_len, j.offset);
+        seg.wire_len = seg.raw_len;
+        if (checksum)
+            seg.crc = crc32c(0, j.slot_buf, seg.raw_len);
+        return;
+    }
+
+    raw.resize(seg.raw_len);
+    read_fully(fd, raw.data(), seg.raw_len, j.offset);
+    if (checksum)
+        seg.crc = crc32c(0, raw.data(), seg.raw_len);
+
+    uint64_t start = thread_cpu_ns();
+    uLongf wire_len = j.slot_size;
+    int ret = compress2((Bytef *)j.slot_buf, &wire_len, (const Bytef *)raw.data(), seg.raw_len, level);
+    seg.deflate_ns = thread_cpu_ns() - start;
+
+    /* Z_BUF_ERROR: it would have grown past the slot */
+    if (ret == Z_OK && wire_len < seg.raw_len) {
+        seg.wire_len = wire_len;
+        seg.compressed = true;
+    } else {
+        memcpy(j.slot_buf, raw.data(), seg.raw_len);
+        seg.wire_len = seg.raw_len;
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Read and compression stage of a streaming send. Segments of the file are
+ * queued with submit(); worker threads read each one and deflate it with
+ * zlib straight into its registered ring slot, while the segments before it
+ * are on the wire. A segment that doesn't shrink goes into its slot as is.
+ * Finished segments come back through reap(), in any order. A worker that
+ * fails to read stops; reap() throws its error */
+class stream_compressor
+{
+public:
+    struct segment {
+        uint64_t index;
+        int slot;
+        uint32_t wire_len;  /* bytes in the slot */
+        uint32_t raw_len;   /* bytes of the file */
+        bool compressed;
+        uint32_t crc;       /* CRC32C of the raw bytes, if asked for */
+        uint64_t deflate_ns; /* CPU time spent deflating, 0 if not tried */
+    };
+
+    /* num_threads workers reading fd, deflating at zlib level */
+    stream_compressor(int fd, int num_threads, int level, bool checksum);
+    ~stream_compressor();
+
+    /* Fill slot_buf (slot_size bytes) with the len bytes at file offset,
+     * deflated if compress is set and that makes them smaller */
+    void submit(uint64_t index, int slot, char *slot_buf, uint32_t slot_size, uint64_t offset, uint32_t len, bool compress);
+    /* Append the segments finished since the last call */
+    void reap(std::vector<segment>& segments);
+    /* Segments submitted and not reaped yet */
+    int busy();
+    /* Wait up to timeout_us for a segment to finish, or a worker to fail */
+    void wait(int timeout_us);
+
+private:
+    struct job {
+        segment seg;
+        char *slot_buf;
+        uint32_t slot_size;
+        uint64_t offset;
+        bool compress;
+    };
+
+    int fd;
+    int level;
+    bool checksum;
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable work_cond;
+    std::condition_variable done_cond;
+    std::deque<job> pending;
+    std::vector<segment> done;
+    int outstanding = 0;
+    bool stopping = false;
+    std::exception_ptr error; /* of the first worker to fail */
+
+    void run();
+    void process(job& j, std::vector<char>& raw);
+};
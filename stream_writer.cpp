@@ -0,0 +1,108 @@
+#include "stream_writer.h"
+#include "rdma_error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+stream_writer::stream_writer(const char *path)
+{
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    direct = fd >= 0;
+    if (fd < 0 && errno == EINVAL) /* e.g. tmpfs: no O_DIRECT, go through the page cache */
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw_errno("open() failed for stream output file");
+    }
+    printf("streaming into %s%s\n", path, direct ? " (O_DIRECT)" : "");
+
+    thread = std::thread([this] {
+        try {
+            run();
+        } catch (...) {
+            std::lock_guard<std::mutex> guard(lock);
+            error = std::current_exception();
+        }
+        cond.notify_all();
+    });
+}
+
+stream_writer::~stream_writer()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    thread.join();
+    close(fd);
+}
+
+void stream_writer::submit(int slot, const char *buf, uint64_t offset, uint32_t len)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending.push_back({ slot, buf, offset, len });
+    }
+    cond.notify_all();
+}
+
+void stream_writer::reap(std::vector<int>& slots)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (error)
+        std::rethrow_exception(error);
+    slots.insert(slots.end(), done.begin(), done.end());
+    done.clear();
+}
+
+void stream_writer::finish(uint64_t length)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    cond.wait(guard, [this] { return error || (pending.empty() && !in_progress); });
+    if (error)
+        std::rethrow_exception(error);
+
+    /* the last write may have been padded for O_DIRECT */
+    if (ftruncate(fd, length)) {
+        throw_errno("ftruncate() failed for stream output file");
+    }
+}
+
+void stream_writer::run()
+{
+    while (true) {
+        write_op op;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            cond.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty())
+                return;
+            op = pending.front();
+            pending.pop_front();
+            in_progress++;
+        }
+
+        size_t len = op.len;
+        if (direct)
+            len = (len + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1);
+        for (size_t written = 0; written < len; ) {
+            ssize_t ret = pwrite(fd, op.buf + written, len - written, op.offset + written);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw_errno("pwrite() failed for stream output file");
+            }
+            written += ret;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done.push_back(op.slot);
+            in_progress--;
+        }
+        cond.notify_all();
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* alignment of O_DIRECT writes: of buffers, offsets and (padded) lengths */
+#define DIRECT_IO_ALIGN 4096
+
+/* Disk stage of a streaming receive. Completed ring slots are queued with
+ * submit() and written by a background thread with pwrite(), using O_DIRECT
+ * where the filesystem supports it, so the page cache doesn't grow with the
+ * file. Slots whose data is on disk come back through reap() to be reused
+ * for the next reads. A failed write stops the thread; reap() and finish()
+ * throw its error */
+class stream_writer
+{
+public:
+    explicit stream_writer(const char *path);
+    ~stream_writer();
+
+    /* Queue len bytes at buf for file offset. buf and offset must be 4 KiB
+     * aligned; len is padded up to that, so the slot must have room for it */
+    void submit(int slot, const char *buf, uint64_t offset, uint32_t len);
+    /* Append the slots that finished writing since the last call */
+    void reap(std::vector<int>& slots);
+    /* Wait for all writes, then cut the file to its exact length */
+    void finish(uint64_t length);
+
+private:
+    struct write_op {
+        int slot;
+        const char *buf;
+        uint64_t offset;
+        uint32_t len;
+    };
+
+    int fd = -1;
+    bool direct = false; /* fd was opened with O_DIRECT */
+    std::thread thread;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<write_op> pending;
+    std::vector<int> done;
+    int in_progress = 0;
+    bool stopping = false;
+    std::exception_ptr error; /* of the writer thread, which has stopped */
+
+    void run();
+};
@@ -0,0 +1,572 @@
+#include "tcp_transfer.h"
+
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+
+#include <exception>
+#include <thread>
+
+bool tcp_transfers(const transfer_config& config)
+{
+    if (config.tcp)
+        return true;
+    int num_devices = 0;
+    struct ibv_device **device_list = ibv_get_device_list(&num_devices);
+    if (device_list)
+        ibv_free_device_list(device_list);
+    if (num_devices > 0)
+        return false;
+    printf("no RDMA device on this host, transferring over TCP (the peer needs RDMA_TCP=1)\n");
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+/////////////////////////////// COMMON /////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+tcp_context::~tcp_context()
+{
+    for (tcp_stream& s : streams)
+        if (s.fd >= 0)
+            close(s.fd);
+    if (control_fd >= 0)
+        close(control_fd);
+}
+
+void tcp_context::send_all(int fd, const void *buffer, size_t len)
+{
+    const char *p = (const char *)buffer;
+    while (len > 0) {
+        ssize_t ret = send(fd, p, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("send");
+        }
+        p += ret;
+        len -= ret;
+    }
+}
+
+void tcp_context::recv_all(int fd, void *buffer, size_t len)
+{
+    char *p = (char *)buffer;
+    while (len > 0) {
+        ssize_t ret = recv(fd, p, len, MSG_WAITALL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("recv");
+        }
+        if (ret == 0) {
+            throw_error("recv: connection closed by peer");
+        }
+        p += ret;
+        len -= ret;
+    }
+}
+
+void tcp_context::check_hello(const tcp_hello& hello, bool control) const
+{
+    if (hello.magic != TCP_HELLO_MAGIC)
+        throw_error("the peer is not making TCP transfers (run both sides with RDMA_TCP=1)");
+    if (control && (hello.stream != -1 || !hello.num_streams || hello.num_streams > TCP_MAX_STREAMS || !hello.chunk_size))
+        throw_error("bad TCP session hello: %u streams of %u byte chunks", hello.num_streams, hello.chunk_size);
+    if (!control && (hello.stream < 0 || hello.stream >= (int)streams.size()))
+        throw_error("bad TCP stream hello: stream %d of %zu", hello.stream, streams.size());
+}
+
+void tcp_context::chunk_extent(uint64_t c, uint64_t length, uint32_t chunk_size, uint64_t *offset, uint32_t *len)
+{
+    *offset = c * chunk_size;
+    *len = (uint32_t)std::min<uint64_t>(chunk_size, length - *offset);
+}
+
+void tcp_context::for_each_stream(uint64_t num_chunks, const std::function<void(int)>& fn)
+{
+    int used = (int)std::min<uint64_t>(streams.size(), num_chunks);
+    std::vector<std::exception_ptr> errors(used);
+    auto run = [&](int s) {
+        try {
+            fn(s);
+        } catch (...) {
+            errors[s] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int s = 1; s < used; s++)
+        threads.emplace_back(run, s);
+    if (used)
+        run(0);
+    for (std::thread& t : threads)
+        t.join();
+    for (std::exception_ptr& e : errors)
+        if (e)
+            std::rethrow_exception(e);
+}
+
+////////////////////////////////////////////////////////////////////////
+/////////////////////////////// CLIENT /////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+tcp_client_context::tcp_client_context(uint16_t tcp_port, const transfer_config& config) :
+    tcp_context(tcp_port, config)
+{
+    METRIC_SCOPE(PHASE_TCP_CONNECT);
+    int num_streams = std::max(1, std::min(config.tcp_streams, TCP_MAX_STREAMS));
+    control_fd = connect_socket();
+
+    tcp_hello hello = { TCP_HELLO_MAGIC, -1, (uint32_t)num_streams, this->config.chunk_size };
+    send_all(control_fd, &hello, sizeof(hello));
+    streams.resize(num_streams);
+    for (int i = 0; i < num_streams; i++) {
+        streams[i].fd = connect_socket();
+        hello.stream = i;
+        send_all(streams[i].fd, &hello, sizeof(hello));
+        enable_zerocopy(streams[i]);
+    }
+
+    tcp_hello reply;
+    recv_all(control_fd, &reply, sizeof(reply));
+    check_hello(reply, true);
+    printf("TCP session with %s: %d streams of %u byte chunks%s\n", config.server_ip, num_streams,
+           this->config.chunk_size, streams[0].zerocopy ? ", MSG_ZEROCOPY" : "");
+}
+
+tcp_client_context::~tcp_client_context()
+{
+    file_request bye = {};
+    bye.request_id = -1;
+    bye.type = REQ_FILE;
+    try {
+        send_all(control_fd, &bye, sizeof(bye));
+    } catch (const rdma_error& e) {
+        fprintf(stderr, "ending the session: %s\n", e.what());
+    }
+}
+
+int tcp_client_context::connect_socket()
+{
+    int sfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sfd < 0) {
+        throw_errno("socket");
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_addr.s_addr = inet_addr(config.server_ip);
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(tcp_port);
+
+    /* like the verbs client: the server may still be starting up */
+    int attempts = 0;
+    while (connect(sfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        if (errno != ECONNREFUSED || ++attempts >= CONNECT_RETRIES) {
+            int err = errno;
+            close(sfd);
+            errno = err;
+            throw_errno("connect");
+        }
+        METRIC_ADD(CTR_RETRIES, 1);
+        usleep(100000);
+    }
+    /* requests, acks and the last chunk of a file are small: don't let
+     * Nagle hold them back waiting for an ACK */
+    int one = 1;
+    setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sfd;
+}
+
+void tcp_client_context::enable_zerocopy(tcp_stream& s)
+{
+    /* kernels before 4.14 don't have it; those sends just copy */
+    int one = 1;
+    s.zerocopy = !setsockopt(s.fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+}
+
+int tcp_client_context::take_request_id()
+{
+    /* -1 ends the session, so skip it when the ids wrap */
+    int file_id = next_request_id++;
+    if (next_request_id == -1)
+        next_request_id = 0;
+    return file_id;
+}
+
+int tcp_client_context::send_file(const char *filename)
+{
+    int file_id = take_request_id();
+    return send_file(file_id, filename) ? file_id : -1;
+}
+
+bool tcp_client_context::send_file(int file_id, const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a regular file\n", filename);
+        close(fd);
+        return false;
+    }
+
+    bool sent;
+    try {
+        sent = transfer(file_id, fd, nullptr, st.st_size);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return sent;
+}
+
+bool tcp_client_context::send_buffer(int file_id, void *buffer, uint64_t length)
+{
+    return transfer(file_id, -1, (const char *)buffer, length);
+}
+
+bool tcp_client_context::transfer(int file_id, int fd, const char *data, uint64_t length)
+{
+    METRIC_SCOPE(PHASE_TRANSFER);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint32_t chunk = config.chunk_size;
+    uint64_t num_chunks = (length + chunk - 1) / chunk;
+    bool verify = config.verify && length;
+
+    /* checksumming means reading the data once ourselves; for a file, from
+     * a mapping of the page cache sendfile() sends from anyway */
+    const char *view = data;
+    void *map = nullptr;
+    if (verify && fd >= 0) {
+        map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            throw_errno("mmap() in client failed for input file");
+        }
+        view = (const char *)map;
+    }
+    std::vector<uint32_t> crcs(verify ? num_chunks : 0);
+
+    file_request req = {};
+    req.request_id = file_id;
+    req.type = REQ_FILE;
+    req.length = length;
+    req.slot_size = chunk;
+    req.flags = verify ? FILE_REQUEST_CRC : 0;
+    try {
+        send_all(control_fd, &req, sizeof(req));
+        for_each_stream(num_chunks, [&](int s) {
+            for (uint64_t c = s; c < num_chunks; c += streams.size()) {
+                uint64_t offset;
+                uint32_t len;
+                chunk_extent(c, length, chunk, &offset, &len);
+                if (verify)
+                    crcs[c] = crc32c(0, view + offset, len);
+                if (fd >= 0)
+                    send_range(streams[s], fd, offset, len);
+                else
+                    send_zerocopy(streams[s], data + offset, len);
+                METRIC_ADD(CTR_TCP_BYTES_SENT, len);
+            }
+            /* the caller may reuse the buffer once we return */
+            if (fd < 0)
+                reap_zerocopy(streams[s], true);
+        });
+        if (verify)
+            send_all(control_fd, crcs.data(), crcs.size() * sizeof(uint32_t));
+    } catch (...) {
+        if (map)
+            munmap(map, length);
+        throw;
+    }
+    if (map)
+        munmap(map, length);
+
+    file_request ack;
+    recv_all(control_fd, &ack, sizeof(ack));
+    if (ack.type != REQ_ACK || ack.request_id != file_id)
+        throw_error("request %d: unexpected message %u for request %d", file_id, ack.type, ack.request_id);
+    if (ack.flags & FILE_ACK_CORRUPT) {
+        fprintf(stderr, "request %d: the server received corrupted data\n", file_id);
+        return false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (config.verbose)
+        printf("tcp transfer: %" PRIu64 " bytes in %.3f ms, %.2f MB/s\n", length, secs * 1e3,
+               secs > 0 ? length / secs / 1e6 : 0.0);
+    return true;
+}
+
+void tcp_client_context::send_range(tcp_stream& s, int fd, uint64_t offset, uint32_t len)
+{
+    /* page cache to socket, without passing through user space */
+    off_t off = offset;
+    while (len > 0) {
+        ssize_t n = sendfile(s.fd, fd, &off, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("sendfile");
+        }
+        if (n == 0)
+            throw_error("sendfile: file shrank while sending");
+        len -= n;
+    }
+}
+
+void tcp_client_context::send_zerocopy(tcp_stream& s, const char *data, uint32_t len)
+{
+    while (len > 0) {
+        int flags = MSG_NOSIGNAL;
+        if (s.zerocopy && len >= TCP_ZEROCOPY_MIN)
+            flags |= MSG_ZEROCOPY;
+        ssize_t n = send(s.fd, data, len, flags);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                /* over the locked memory limit: let pinned pages go, or copy */
+                if (s.zc_done < s.zc_sent)
+                    reap_zerocopy(s, false);
+                else
+                    s.zerocopy = false;
+                continue;
+            }
+            throw_errno("send");
+        }
+        if (flags & MSG_ZEROCOPY) {
+            s.zc_sent++;
+            METRIC_ADD(CTR_ZEROCOPY_SENDS, 1);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+void tcp_client_context::reap_zerocopy(tcp_stream& s, bool all)
+{
+    while (s.zc_done < s.zc_sent) {
+        char control[128];
+        struct msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(s.fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                throw_errno("recvmsg(MSG_ERRQUEUE)");
+            /* notifications pending: the error queue raises POLLERR */
+            struct pollfd p = { s.fd, 0, 0 };
+            if (poll(&p, 1, -1) < 0 && errno != EINTR)
+                throw_errno("poll");
+            continue;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                errno = ee.ee_errno;
+                throw_errno("send");
+            }
+            /* a range of sends, [ee_info, ee_data] */
+            s.zc_done += ee.ee_data - ee.ee_info + 1;
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                /* loopback, or a NIC without scatter-gather: pinning bought
+                 * nothing and the notifications cost, so plain sends from now on */
+                METRIC_ADD(CTR_ZEROCOPY_COPIED, ee.ee_data - ee.ee_info + 1);
+                s.zerocopy = false;
+            }
+        }
+        if (!all)
+            return;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+/////////////////////////////// SERVER /////////////////////////////////
+////////////////////////////////////////////////////////////////////////
+
+tcp_server_context::tcp_server_context(uint16_t tcp_port, const transfer_config& config) :
+    tcp_context(tcp_port, config)
+{
+    METRIC_SCOPE(PHASE_TCP_CONNECT);
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        throw_errno("socket");
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(struct sockaddr_in));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(tcp_port);
+
+    try {
+        int one = 1;
+        if (setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
+            throw_errno("SO_REUSEADDR");
+        }
+        if (bind(lfd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in)) < 0) {
+            throw_errno("bind");
+        }
+        if (listen(lfd, TCP_MAX_STREAMS + 1)) {
+            throw_errno("listen");
+        }
+        printf("Server waiting on port %d (TCP transfers). Client can connect\n", tcp_port);
+
+        /* the control connection first; the client opens its streams after it */
+        control_fd = accept_socket(lfd);
+        tcp_hello hello;
+        recv_all(control_fd, &hello, sizeof(hello));
+        check_hello(hello, true);
+        chunk_size = hello.chunk_size;
+
+        streams.resize(hello.num_streams);
+        for (uint32_t i = 0; i < hello.num_streams; i++) {
+            int fd = accept_socket(lfd);
+            tcp_hello stream_hello;
+            try {
+                recv_all(fd, &stream_hello, sizeof(stream_hello));
+                check_hello(stream_hello, false);
+            } catch (...) {
+                close(fd);
+                throw;
+            }
+            if (streams[stream_hello.stream].fd >= 0) {
+                close(fd);
+                throw_error("TCP stream %d attached twice", stream_hello.stream);
+            }
+            streams[stream_hello.stream].fd = fd;
+        }
+        send_all(control_fd, &hello, sizeof(hello));
+        printf("client connected successfully: %u streams of %u byte chunks\n", hello.num_streams, chunk_size);
+    } catch (...) {
+        close(lfd);
+        throw;
+    }
+    close(lfd);
+}
+
+tcp_server_context::~tcp_server_context()
+{
+    release_file();
+}
+
+int tcp_server_context::accept_socket(int listen_fd)
+{
+    int sfd = accept(listen_fd, NULL, NULL);
+    if (sfd < 0) {
+        throw_errno("accept");
+    }
+    int one = 1;
+    setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sfd;
+}
+
+void tcp_server_context::open_destination(const file_request& req)
+{
+    file_length = req.length;
+    if (!config.output_dir) {
+        file = (char *)malloc(req.length + 1);
+        if (!file) {
+            throw_error("cannot allocate %" PRIu64 " bytes for request %d", req.length, req.request_id);
+        }
+        file[req.length] = '\0';
+        return;
+    }
+
+    /* received in place, into the page cache of the output file */
+    std::string path = std::string(config.output_dir) + "/file_" + std::to_string(req.request_id);
+    out_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        throw_errno("open() in server failed for output file");
+    }
+    if (config.verbose)
+        printf("receiving into %s\n", path.c_str());
+    if (!req.length)
+        return;
+    int ret = posix_fallocate(out_fd, 0, req.length);
+    if (ret == EOPNOTSUPP || ret == EINVAL)
+        ret = ftruncate(out_fd, req.length) ? errno : 0;
+    if (ret) {
+        errno = ret;
+        throw_errno("fallocate() in server failed for output file");
+    }
+    file = (char *)mmap(NULL, req.length, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+    if (file == MAP_FAILED) {
+        file = nullptr;
+        throw_errno("mmap() in server failed for output file");
+    }
+}
+
+void tcp_server_context::release_file()
+{
+    if (out_fd >= 0) {
+        if (file)
+            munmap(file, file_length);
+        close(out_fd);
+        out_fd = -1;
+    } else {
+        free(file);
+    }
+    file = nullptr;
+    file_length = 0;
+}
+
+bool tcp_server_context::receive_file()
+{
+    file_request req;
+    recv_all(control_fd, &req, sizeof(req));
+    if (req.request_id == -1)
+        return false;
+    if (req.type != REQ_FILE || (req.flags & ~FILE_REQUEST_CRC) || req.slot_size != chunk_size)
+        throw_error("request %d: not a TCP file transfer (type %u, flags 0x%x)", req.request_id, req.type, req.flags);
+    METRIC_SCOPE(PHASE_TRANSFER);
+
+    release_file();
+    request_id = req.request_id;
+    open_destination(req);
+
+    uint64_t num_chunks = (req.length + chunk_size - 1) / chunk_size;
+    bool verify = req.flags & FILE_REQUEST_CRC;
+    std::vector<uint32_t> crcs(verify ? num_chunks : 0);
+    for_each_stream(num_chunks, [&](int s) {
+        for (uint64_t c = s; c < num_chunks; c += streams.size()) {
+            uint64_t offset;
+            uint32_t len;
+            chunk_extent(c, req.length, chunk_size, &offset, &len);
+            recv_all(streams[s].fd, file + offset, len);
+            /* while the chunk is still in cache */
+            if (verify)
+                crcs[c] = crc32c(0, file + offset, len);
+            METRIC_ADD(CTR_TCP_BYTES_RECEIVED, len);
+        }
+    });
+
+    file_request ack = req;
+    ack.type = REQ_ACK;
+    if (verify) {
+        std::vector<uint32_t> expected(num_chunks);
+        recv_all(control_fd, expected.data(), expected.size() * sizeof(uint32_t));
+        for (uint64_t c = 0; c < num_chunks; c++)
+            if (crcs[c] != expected[c]) {
+                fprintf(stderr, "request %d: chunk %" PRIu64 " doesn't match its checksum\n", req.request_id, c);
+                ack.flags |= FILE_ACK_CORRUPT;
+            }
+    }
+    send_all(control_fd, &ack, sizeof(ack));
+    return true;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "rdma_context.h"
+
+/* TCP transfers: the same sessions as over verbs, for hosts without an RDMA
+ * device (or with RDMA_TCP=1 on both sides, to compare the two).
+ *
+ * A session is a control connection and config.tcp_streams data
+ * connections, all to the server's port. Each socket opens with a
+ * tcp_hello; the server answers on the control socket once every stream
+ * is attached. Then, per file, the client sends a REQ_FILE file_request
+ * (slot_size: the chunk size) on the control socket and the data split
+ * into chunks, chunk i on stream i % num_streams, each stream in order, so
+ * chunks need no headers and land at their offset. With FILE_REQUEST_CRC
+ * the CRC32C of every chunk follows on the control socket. The server
+ * answers with a REQ_ACK, flagged FILE_ACK_CORRUPT if a chunk didn't
+ * match, and request_id -1 ends the session.
+ *
+ * Nothing is registered: files go out with sendfile() straight from the
+ * page cache, buffers with MSG_ZEROCOPY, and the server receives into its
+ * buffer or the mmap'd output file in place */
+
+#define TCP_HELLO_MAGIC 0x50435452 /* "RTCP" */
+
+struct tcp_hello
+{
+    uint32_t magic;
+    int32_t stream; /* index of a data connection, -1 for the control one */
+    uint32_t num_streams;
+    uint32_t chunk_size;
+};
+
+/* The TCP side of a configuration: config.tcp, or no RDMA device to use */
+bool tcp_transfers(const transfer_config& config);
+
+class tcp_context
+{
+protected:
+    uint16_t tcp_port;
+    transfer_config config;
+    int control_fd = -1;
+
+    /* A data connection. Its MSG_ZEROCOPY sends are numbered from 0 over the
+     * life of the socket, in the order the kernel reports them done */
+    struct tcp_stream {
+        int fd = -1;
+        bool zerocopy = false; /* SO_ZEROCOPY is on, and the kernel didn't have to copy yet */
+        uint64_t zc_sent = 0;
+        uint64_t zc_done = 0;
+    };
+    std::vector<tcp_stream> streams;
+
+    tcp_context(uint16_t tcp_port, const transfer_config& config) : tcp_port(tcp_port), config(config) {}
+    virtual ~tcp_context();
+
+    static void send_all(int fd, const void *buffer, size_t len);
+    static void recv_all(int fd, void *buffer, size_t len);
+    void check_hello(const tcp_hello& hello, bool control) const;
+
+    /* Chunk c of length bytes, with chunk_size byte chunks */
+    static void chunk_extent(uint64_t c, uint64_t length, uint32_t chunk_size, uint64_t *offset, uint32_t *len);
+    /* Run fn(s) for every stream that has chunks of a num_chunks transfer,
+     * each on its own thread (the first on the caller's), and rethrow the
+     * first failure once all are done */
+    void for_each_stream(uint64_t num_chunks, const std::function<void(int)>& fn);
+};
+
+class tcp_client_context : public tcp_context, public file_sender
+{
+public:
+    explicit tcp_client_context(uint16_t tcp_port, const transfer_config& config = transfer_config());
+    /* Ends the session */
+    ~tcp_client_context();
+
+    int send_file(const char *filename) override;
+    bool send_file(int file_id, const char *filename) override;
+    /* The buffer is only read, and free to reuse once this returns */
+    bool send_buffer(int file_id, void *buffer, uint64_t length) override;
+
+private:
+    int next_request_id = 1;
+    int take_request_id();
+
+    int connect_socket();
+    void enable_zerocopy(tcp_stream& s);
+
+    /* Send length bytes of fd (with sendfile) or of data, and wait for the ack */
+    bool transfer(int file_id, int fd, const char *data, uint64_t length);
+    void send_range(tcp_stream& s, int fd, uint64_t offset, uint32_t len);
+    void send_zerocopy(tcp_stream& s, const char *data, uint32_t len);
+    /* Take MSG_ZEROCOPY notifications off the error queue: one batch, or
+     * until every send of s is done and its pages released */
+    void reap_zerocopy(tcp_stream& s, bool all);
+};
+
+class tcp_server_context : public tcp_context, public file_receiver
+{
+public:
+    /* Waits for a client and its streams */
+    explicit tcp_server_context(uint16_t tcp_port, const transfer_config& config = transfer_config());
+    ~tcp_server_context();
+
+    bool receive_file() override;
+    uint64_t received_length() const override { return file_length; }
+    int request_id = -1; /* of the last file received */
+    char *file = nullptr;
+    uint64_t file_length = 0;
+
+private:
+    uint32_t chunk_size = 0; /* the client's */
+    int out_fd = -1; /* config.output_dir: file is a shared mapping of it */
+
+    int accept_socket(int listen_fd);
+    /* Point file at length bytes to receive request req into */
+    void open_destination(const file_request& req);
+    void release_file();
+};
@@ -1,4 +1,6 @@
 dev_mtu                        ='9000'
+transfer_bytes                 = 1 << 28
+transfer_port                  ='18515'
 csv_fields                     = ['msg_size',\
                                   'num_qps',\
                                   'timeout',\
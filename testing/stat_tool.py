@@ -4,9 +4,12 @@ import socket
 import psutil
 import getpass
 import argparse
+import re
 import subprocess
 from settings import dev_mtu
 from settings import csv_fields
+from settings import transfer_bytes
+from settings import transfer_port
 from pexpect import pxssh
 
 # general setup
@@ -18,7 +21,7 @@ parser = argparse.ArgumentParser(
                     prog='RDMA PROJECT stat-tool')
 parser.add_argument('testcases', type=str, help='path of csv input file')
 parser.add_argument('requestor', type=str, help='machine to run requestor on')
-parser.add_argument('--duration', '-D', type=int, default=2, help='duration of ib_write_bw run for each test case')
+parser.add_argument('--size', '-S', type=int, default=transfer_bytes, help='bytes transferred by each test case')
 parser.add_argument('--output_file', type=str, default=cwd+"/stattool.out", help='output csv file path')
 
 args = parser.parse_args()
@@ -27,7 +30,7 @@ testcases_file = args.testcases
 output_file = args.output_file
 responder = socket.gethostname()
 requestor = args.requestor
-duration = args.duration
+size = args.size
 
 # check args valid
 if not os.path.isfile(testcases_file):
@@ -45,11 +48,18 @@ if (requestor==responder):
 # print args used
 print("testcases file: {input_file}".format(input_file=testcases_file))
 print("requestor: {requestor}".format(requestor=requestor))
-print("duration: {duration}".format(duration=duration))
+print("transfer size: {size}".format(size=size))
 print("output file: {output_file}".format(output_file=output_file))
 
 machine_setup_file = cwd + "/machine_setup"
 
+# both sides of the comparison run this project's server and client (built
+# in the parent directory), once over verbs and once over TCP streams
+server_bin = os.path.dirname(cwd) + "/server"
+client_bin = os.path.dirname(cwd) + "/client"
+test_file = cwd + "/stattool.data"
+responder_ip = socket.gethostbyname(responder)
+
 # Requestor setup
 Requestor = pxssh.pxssh()
 if not Requestor.login (requestor, user):
@@ -61,6 +71,8 @@ Requestor.sendline("source {machine_setup_file} \n".format(machine_setup_file=ma
 Requestor.prompt()
 req_dev = Requestor.before.decode("utf-8").split()[-2]     # print everything before the prompt.
 print("Requestor device: {req_dev}".format(req_dev=req_dev))
+Requestor.sendline("head -c {size} /dev/urandom > {test_file}".format(size=size, test_file=test_file))
+Requestor.prompt()
 
 # Responder setup
 resp_dev = subprocess.check_output([machine_setup_file]).decode("utf-8").strip('\n')
@@ -81,28 +93,54 @@ Requestor.logout()
 
 
 
+def TransferEnv(message_size, num_qps, timeout, mtu, protocol, dev):
+    """RDMA_* settings of one test case: chunks of message_size, no tuning or
+    checksums in the way, and either the verbs device or num_qps TCP streams"""
+    env = {"RDMA_SERVER_IP": responder_ip, "RDMA_CHUNK_SIZE": message_size, "RDMA_TUNE": "0",
+           "RDMA_VERIFY": "0", "RDMA_SHM": "0", "RDMA_MTU": mtu, "RDMA_QP_TIMEOUT": timeout}
+    if protocol=='RDMA':
+        env["RDMA_DEVICE"] = dev
+    if protocol=='TCP':
+        env["RDMA_TCP"] = "1"
+        env["RDMA_TCP_STREAMS"] = num_qps
+    return env
+
 def RunTestOnRequestor(message_size, num_qps, timeout, mtu, protocol):
     Requestor = pxssh.pxssh()
     if not Requestor.login (requestor, user):
         print("SSH session failed on login.")
         exit(-2)
-    bw_avg = None
-    if protocol=='RDMA':
-        Requestor.sendline("ib_write_bw -d {req_dev} -D {duration} -s {message_size} -q {num_qps} -u {timeout} --mtu {mtu} --tx-depth=512 --report_gbits {responder} \n".\
-                format(req_dev=req_dev, duration=duration, message_size=message_size, num_qps=num_qps, timeout=timeout, mtu=mtu, responder=responder))
-        Requestor.prompt()
-        bw_avg = Requestor.before.decode("utf-8").split()[-4]
     if protocol=='TCP':
         Requestor.sendline("sudo ip link set dev eth1 mtu {mtu}".format(mtu=mtu))
         Requestor.prompt()
-        Requestor.sendline("iperf3 -c {responder} --bytes {message_size}".format(message_size=message_size, responder=responder))
-        Requestor.prompt()
-        bw_avg = Requestor.before.decode("utf-8").split()[-5]
+    env = TransferEnv(message_size, num_qps, timeout, mtu, protocol, req_dev)
+    Requestor.sendline("env {env} {client_bin} {port} {test_file} {num_qps}".\
+            format(env=" ".join(k + "=" + v for k, v in env.items()), client_bin=client_bin, port=transfer_port,
+                   test_file=test_file, num_qps=num_qps))
+    Requestor.prompt()
+    # "pull transfer: ..." or "tcp transfer: <bytes> bytes in <ms> ms, <MB/s> MB/s"
+    match = re.search(r"transfer: \d+ bytes in [\d.]+ ms, ([\d.]+) MB/s", Requestor.before.decode("utf-8"))
+    bw_avg = "{:.3f}".format(float(match.group(1)) * 8 / 1000) if match else None
+    if protocol=='TCP':
         Requestor.sendline("sudo ip link set dev eth1 mtu {mtu}".format(mtu=dev_mtu))
+        Requestor.prompt()
     Requestor.logout()
 
     return bw_avg
 
+def RunTest(message_size, num_qps, timeout, mtu, protocol):
+    """Bandwidth in Gbit/s of sending the test file with the project's client
+    to its server on this host, as the client measured it"""
+    env = dict(os.environ, **TransferEnv(message_size, num_qps, timeout, mtu, protocol, resp_dev))
+    server = subprocess.Popen([server_bin, transfer_port, "single"], env=env, stdout=subprocess.DEVNULL)
+    bw_avg = RunTestOnRequestor(message_size, num_qps, timeout, mtu, protocol)
+    try:
+        server.wait(timeout=60)
+    except subprocess.TimeoutExpired:
+        server.kill()
+        server.wait()
+    return bw_avg
+
 # main loop
 with open(testcases_file) as in_f:
     header = [h.strip() for h in next(in_f).split(',')]
@@ -123,13 +161,11 @@ with open(testcases_file) as in_f:
             mtu = row['mtu']
 
             # get RDMA bw
-            subprocess.Popen(["sudo", "ib_write_bw", "-d", resp_dev, "-q", num_qps,"-s", message_size, "-u", timeout, "--mtu", mtu, "--tx-depth=512", "--report_gbits"])
-            row["bw_avg"] = RunTestOnRequestor(message_size, num_qps, timeout, mtu, "RDMA")
+            row["bw_avg"] = RunTest(message_size, num_qps, timeout, mtu, "RDMA")
 
             # get tcp bw
             subprocess.run(['sudo', 'ip', 'link', 'set', 'dev', 'eth1', 'mtu', mtu])
-            subprocess.Popen(['iperf3', '-s', '-1'])
-            row['tcp_bw_avg'] = RunTestOnRequestor(message_size, num_qps, timeout, mtu, "TCP")
+            row['tcp_bw_avg'] = RunTest(message_size, num_qps, timeout, mtu, "TCP")
             subprocess.run(['sudo', 'ip', 'link', 'set', 'dev', resp_net, 'mtu', dev_mtu])
 
             writer.writerow(row)
@@ -1,5 +1,6 @@
+import os
+import re
 import subprocess
-import json
 import csv
 
 # Define MTU and message size values
@@ -8,10 +9,18 @@ message_sizes = [256, 512, 1024, 2048, 4096,65536, 131072, 262144]
 
 # Server and port configuration
 server_ip = "127.0.0.1"  # Replace with actual server IP
-server_port = 5201       # Default iperf3 port
+server_port = 18515
+
+# The project's own server and client (built in the parent directory), over
+# TCP streams; each run sends a file of transfer_bytes in msg_size chunks
+here = os.path.dirname(os.path.abspath(__file__))
+server_bin = os.path.join(here, "..", "server")
+client_bin = os.path.join(here, "..", "client")
+test_file = os.path.join(here, "tcp_final_stat.data")
+transfer_bytes = 1 << 28
 
 # Output CSV file
-output_csv = "iperf3_results.csv"
+output_csv = "tcp_results.csv"
 
 def set_mtu(mtu):
     """Sets the MTU value for the network interface (example: eth0)."""
@@ -25,34 +34,37 @@ def set_mtu(mtu):
     except subprocess.CalledProcessError as e:
         print(f"Failed to set MTU: {e}")
 
-def run_iperf3(mtu, msg_size):
-    """Runs iperf3 for the given MTU and message size."""
-    cmd = [
-        "iperf3",
-        "-c", server_ip,  # Server address
-        "-p", str(server_port),  # Port
-        "-l", str(msg_size),  # Set message size
-        "-t", str(3),
-        "--json",            # Output results in JSON format
-    ]
+def run_transfer(mtu, msg_size):
+    """Sends the test file through the project's TCP transfers; returns the client's output."""
+    env = dict(os.environ, RDMA_TCP="1", RDMA_SERVER_IP=server_ip, RDMA_CHUNK_SIZE=str(msg_size), RDMA_VERIFY="0")
+    server = subprocess.Popen([server_bin, str(server_port), "single"], env=env, stdout=subprocess.DEVNULL)
     try:
-        print(f"Running iperf3 with MTU={mtu}, Message Size={msg_size}")
-        result = subprocess.run(cmd, check=True, capture_output=True, text=True)
-        return json.loads(result.stdout)
+        print(f"Running TCP transfer with MTU={mtu}, Message Size={msg_size}")
+        result = subprocess.run([client_bin, str(server_port), test_file], env=env, check=True,
+                                capture_output=True, text=True)
+        return result.stdout
     except subprocess.CalledProcessError as e:
-        print(f"iperf3 failed: {e}")
+        print(f"transfer failed: {e}")
         return None
+    finally:
+        try:
+            server.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            server.kill()
+            server.wait()
 
 def extract_bitrate(result):
-    """Extracts the receiver's bits_per_second from iperf3 JSON output and converts it to Gbps."""
-    try:
-        bits_per_second = result["end"]["streams"][0]["receiver"]["bits_per_second"]
-        return bits_per_second / 1e9  # Convert to Gbps
-    except (KeyError, IndexError) as e:
-        print(f"Failed to extract bitrate: {e}")
+    """Extracts the rate of "tcp transfer: <bytes> bytes in <ms> ms, <MB/s> MB/s" and converts it to Gbps."""
+    match = re.search(r"tcp transfer: \d+ bytes in [\d.]+ ms, ([\d.]+) MB/s", result)
+    if not match:
+        print("Failed to extract bitrate")
         return None
+    return float(match.group(1)) * 8 / 1000  # Convert to Gbps
 
 def main():
+    with open(test_file, "wb") as f:
+        f.write(os.urandom(transfer_bytes))
+
     with open(output_csv, "w", newline="") as csvfile:
         # Write CSV header
         writer = csv.writer(csvfile)
@@ -61,7 +73,7 @@ def main():
         for mtu in mtu_values:
             set_mtu(mtu)
             for msg_size in message_sizes:
-                result = run_iperf3(mtu, msg_size)
+                result = run_transfer(mtu, msg_size)
                 if result:
                     bitrate_gbps = extract_bitrate(result)
                     if bitrate_gbps is not None:
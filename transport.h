@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <infiniband/verbs.h>
+
+class rdma_context;
+
+/* Where a process runs, exchanged in the handshake: peers with the same
+ * boot_id share a kernel, and with the same pid namespace as well, each
+ * can name the other by pid */
+struct host_identity
+{
+    char boot_id[40]; /* /proc/sys/kernel/random/boot_id, NUL-terminated */
+    uint64_t pid_ns;  /* inode of /proc/self/ns/pid */
+    int32_t pid;
+    int32_t reserved;
+};
+
+host_identity local_host_identity();
+bool same_host(const host_identity& a, const host_identity& b);
+
+/* The data path under an rdma_context: one-sided reads and writes of memory
+ * the peer registered and advertised as (addr, rkey), local memory being
+ * described by SGEs of our own registrations. Completions keep the engine's
+ * semantics: every operation is reported once, with the caller's wr_id and
+ * the qp_num of the lane (QP index) it was posted on, and the ones not
+ * signaled are retired by a later signaled one on the same lane.
+ *
+ * Control messages and memory registration stay with the verbs QPs and the
+ * PD whatever the transport; the registrations double as the names the
+ * peers use for each other's memory */
+class transport
+{
+public:
+    virtual ~transport() {}
+    virtual const char *name() const = 0;
+
+    virtual void post_read(const ibv_sge *sgl, int num_sge, uint64_t remote, uint32_t rkey, uint64_t wr_id,
+                           int lane, bool signal) = 0;
+    /* immediate, if set, reaches the peer's receive queue once the data is there */
+    virtual void post_write(const ibv_sge *sgl, int num_sge, uint64_t remote, uint32_t rkey, uint64_t wr_id,
+                            const uint32_t *immediate, int lane, bool signal) = 0;
+    /* Move completions of finished operations to done. Returns how many */
+    virtual int poll(std::deque<struct ibv_wc>& done) = 0;
+};
+
+/* RDMA through the NIC (or rxe): the operations are WRs on the context's
+ * QPs, completing on its CQ along with the messages, so the context's
+ * drain_cq() reports them and poll() has nothing of its own */
+class verbs_transport : public transport
+{
+public:
+    explicit verbs_transport(rdma_context *ctx) : ctx(ctx) {}
+    const char *name() const override { return "verbs"; }
+
+    void post_read(const ibv_sge *sgl, int num_sge, uint64_t remote, uint32_t rkey, uint64_t wr_id,
+                   int lane, bool signal) override;
+    void post_write(const ibv_sge *sgl, int num_sge, uint64_t remote, uint32_t rkey, uint64_t wr_id,
+                    const uint32_t *immediate, int lane, bool signal) override;
+    int poll(std::deque<struct ibv_wc>& /*done*/) override { return 0; }
+
+private:
+    rdma_context *ctx;
+};
+
+/* Peers on the same host: copy straight between the two address spaces with
+ * process_vm_readv/writev, at memory bandwidth and without the NIC. The
+ * peer's adverts are used as they are, addr being valid in its process;
+ * operations complete as they are posted. An immediate still has to reach
+ * the peer's receive queue, so it follows the data as a zero-length verbs
+ * write. Once the kernel refuses (ptrace policy, another user), everything
+ * goes to the fallback */
+class shm_transport : public transport
+{
+public:
+    shm_transport(pid_t peer, const std::vector<uint32_t>& qp_nums, std::unique_ptr<transport> fallback);
+    const char *name() const override { return refused ? fallback->name() : "shared memory"; }
+
+    void post_read(const ibv_sge *sgl, int num_sge, uint64_t remote, uint32_t rkey, uint64_t wr_id,
+                   int lane, bool signal) override;
+    void post_write(const ibv_sge *sgl, int num_sge, uint64_t remote, uint32_t rkey, uint64_t wr_id,
+                    const uint32_t *immediate, int lane, bool signal) override;
+    int poll(std::deque<struct ibv_wc>& done) override;
+
+private:
+    pid_t peer;
+    std::vector<uint32_t> qp_nums; /* by lane, for the completions */
+    std::unique_ptr<transport> fallback;
+    bool refused = false;
+    std::deque<struct ibv_wc> completed;
+
+    /* Copy between the local SGEs and the peer's remote; false if the kernel won't */
+    bool copy(bool write, const ibv_sge *sgl, int num_sge, uint64_t remote);
+    void complete(uint64_t wr_id, enum ibv_wc_opcode opcode, int lane);
+};
+
+/* A session carrying files, whatever moves the bytes: verbs and the
+ * transports above (rdma_client_context), or plain TCP streams on hosts
+ * without RDMA (tcp_client_context). Files are numbered by request_id */
+class file_sender
+{
+public:
+    virtual ~file_sender() {}
+    /* Numbers the file itself; returns the id used, or -1 on failure */
+    virtual int send_file(const char *filename) = 0;
+    virtual bool send_file(int file_id, const char *filename) = 0;
+    virtual bool send_buffer(int file_id, void *buffer, uint64_t length) = 0;
+};
+
+/* The receiving end of such a session */
+class file_receiver
+{
+public:
+    virtual ~file_receiver() {}
+    /* Receive the next file. Returns false when the client ended the session */
+    virtual bool receive_file() = 0;
+    virtual uint64_t received_length() const = 0;
+};
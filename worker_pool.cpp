@@ -0,0 +1,150 @@
+#include "worker_pool.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <string>
+
+#include <infiniband/verbs.h>
+
+#include "rdma_error.h"
+
+/* set_mempolicy(2) mode, from <numaif.h>; calling the syscall directly
+ * avoids depending on libnuma */
+#define MPOL_PREFERRED 1
+#define MAX_NUMA_NODES 1024
+
+static std::string read_sysfs(const std::string& path)
+{
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+        return "";
+    char line[4096] = "";
+    if (!fgets(line, sizeof(line), f))
+        line[0] = '\0';
+    fclose(f);
+    line[strcspn(line, "\n")] = '\0';
+    return line;
+}
+
+/* "0-7,16-23" */
+static std::vector<int> parse_cpulist(const std::string& list)
+{
+    std::vector<int> cpus;
+    const char *p = list.c_str();
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        long last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return cpus;
+}
+
+nic_locality query_nic_locality(const char *device_name)
+{
+    nic_locality loc;
+    std::string sysfs;
+
+    struct ibv_device **device_list = ibv_get_device_list(NULL);
+    if (device_list) {
+        struct ibv_device *dev = device_list[0];
+        for (int i = 0; device_list[i]; ++i)
+            if (!strcmp(device_list[i]->name, device_name))
+                dev = device_list[i];
+        if (dev)
+            sysfs = std::string(dev->ibdev_path) + "/device/";
+        ibv_free_device_list(device_list);
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        throw_errno("sched_getaffinity");
+    }
+
+    if (!sysfs.empty()) {
+        std::string node = read_sysfs(sysfs + "numa_node");
+        if (!node.empty())
+            loc.node = atoi(node.c_str());
+        for (int cpu : parse_cpulist(read_sysfs(sysfs + "local_cpulist")))
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                loc.cpus.push_back(cpu);
+    }
+
+    /* no topology, or we were confined (taskset, cgroup) to other CPUs */
+    if (loc.cpus.empty())
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                loc.cpus.push_back(cpu);
+    return loc;
+}
+
+void bind_thread(const std::vector<int>& cpus, int node)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        throw_errno("sched_setaffinity");
+    }
+
+    /* a preference, not a binding: with the node full, allocations spill
+     * over instead of failing */
+    if (node < 0 || node >= MAX_NUMA_NODES)
+        return;
+    unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {};
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NUMA_NODES + 1) && errno != ENOSYS)
+        perror("set_mempolicy"); /* first touch from the pinned CPUs still mostly gets it right */
+}
+
+void run_near_nic(const char *device_name)
+{
+    nic_locality loc = query_nic_locality(device_name);
+    bind_thread(loc.cpus, loc.node);
+    printf("running on %zu CPUs near %s, NUMA node %d\n", loc.cpus.size(), device_name, loc.node);
+}
+
+worker_pool::worker_pool(const char *device_name, int num_workers) :
+    locality(query_nic_locality(device_name)), num_workers(num_workers)
+{
+    if (num_workers <= 0)
+        this->num_workers = locality.cpus.size();
+    printf("worker pool: %d workers on %zu CPUs near %s, NUMA node %d\n", this->num_workers, locality.cpus.size(),
+           device_name, locality.node);
+}
+
+void worker_pool::run(const std::function<void(int)>& fn)
+{
+    std::vector<std::exception_ptr> errors(num_workers);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_workers; i++)
+        threads.emplace_back([this, &fn, &errors, i] {
+            try {
+                bind_thread({ locality.cpus[i % locality.cpus.size()] }, locality.node);
+                fn(i);
+            } catch (const std::exception& e) {
+                errors[i] = std::make_exception_ptr(rdma_error("worker " + std::to_string(i) + ": " + e.what()));
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    for (std::thread& t : threads)
+        t.join();
+    for (std::exception_ptr& e : errors)
+        if (e)
+            std::rethrow_exception(e);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <functional>
+#include <thread>
+#include <vector>
+
+/* Where an HCA sits: its NUMA node and the CPUs local to it, as sysfs
+ * reports them, restricted to the CPUs this process may run on */
+struct nic_locality
+{
+    int node = -1; /* -1: unknown, or not a NUMA machine */
+    std::vector<int> cpus; /* all allowed CPUs if none of the local ones are */
+};
+
+/* Look up device_name (the first device if it doesn't exist, as rdma_device
+ * does) under /sys/class/infiniband */
+nic_locality query_nic_locality(const char *device_name);
+
+/* Restrict the calling thread to cpus, and have the pages it touches from
+ * now on allocated on node when it has free memory. Memory allocated before
+ * the call stays where it is */
+void bind_thread(const std::vector<int>& cpus, int node);
+
+/* Keep the calling thread on the CPUs near device_name, so its buffers, CQs
+ * and QPs are allocated on the NIC's node */
+void run_near_nic(const char *device_name);
+
+/* Worker threads pinned one per CPU near the NIC, round-robin when there are
+ * more workers than local CPUs. A worker is meant to own everything it
+ * touches on the data path: it opens its own device context, PD and buffer
+ * pool, and creates its own QPs and CQs, all from the pinned thread so that
+ * memory lands on the NIC's node. Workers then share nothing but whatever
+ * the caller's fn hands them */
+class worker_pool
+{
+public:
+    /* num_workers 0: one per local CPU */
+    worker_pool(const char *device_name, int num_workers);
+
+    /* Run fn(worker index) on every worker and wait for all of them. Then
+     * throw the first failure, as an rdma_error naming its worker */
+    void run(const std::function<void(int)>& fn);
+
+    int size() const { return num_workers; }
+
+private:
+    nic_locality locality;
+    int num_workers;
+};